@@ -0,0 +1,39 @@
+// ----------------------------------------------------------------------------
+//  OgmaNeo
+//  Copyright(c) 2016-2020 Ogma Intelligent Systems Corp. All rights reserved.
+//
+//  This copy of OgmaNeo is licensed to you under the terms described
+//  in the OGMANEO_LICENSE.md file included in this distribution.
+// ----------------------------------------------------------------------------
+
+// Step latency against prediction accuracy of amortized upper layer updates (Hierarchy::setAmortizedUpdates), compared to immediate updates
+
+#include "Benchmark.h"
+
+#include <cstdlib>
+
+using namespace ogmaneo;
+
+int main(
+    int argc,
+    char** argv
+) {
+    int steps = argc > 1 ? std::atoi(argv[1]) : 2000;
+
+    // Deep enough for several layers to fall due on the same step
+    int numLayers = 4;
+
+    std::vector<int> amortizedUpdates = { 0, 1, 2 };
+
+    for (int a = 0; a < amortizedUpdates.size(); a++) {
+        int updates = amortizedUpdates[a];
+
+        BenchmarkResult result = runBenchmark(steps, [updates](Hierarchy &h) {
+            h.setAmortizedUpdates(updates);
+        }, numLayers);
+
+        printBenchmarkResult(updates == 0 ? "immediate" : "amortizedUpdates " + std::to_string(updates), result);
+    }
+
+    return 0;
+}
@@ -0,0 +1,119 @@
+// ----------------------------------------------------------------------------
+//  OgmaNeo
+//  Copyright(c) 2016-2020 Ogma Intelligent Systems Corp. All rights reserved.
+//
+//  This copy of OgmaNeo is licensed to you under the terms described
+//  in the OGMANEO_LICENSE.md file included in this distribution.
+// ----------------------------------------------------------------------------
+
+#pragma once
+
+#include <ogmaneo/Hierarchy.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <functional>
+#include <iostream>
+#include <string>
+
+namespace ogmaneo {
+// Result of a benchmark run
+struct BenchmarkResult {
+    float stepsPerSecond; // Throughput over the whole run
+    float accuracy; // Fraction of input columns predicted correctly over the second half of the run
+    float p99StepTime; // 99th percentile of the step time in milliseconds
+};
+
+// Input of the fixed benchmark sequence at step t. A slowly modulated traveling wave, the same for every run
+inline void benchmarkInput(
+    int t,
+    const Int3 &size,
+    IntBuffer &inputCs
+) {
+    int numColumns = size.x * size.y;
+
+    inputCs.resize(numColumns);
+
+    for (int i = 0; i < numColumns; i++) {
+        float phase = t * 0.2f + i * 0.1f + std::sin(t * 0.013f) * 3.0f;
+
+        inputCs[i] = static_cast<int>((std::sin(phase) * 0.5f + 0.5f) * (size.z - 1) + 0.5f);
+    }
+}
+
+// Train a fresh hierarchy on the fixed sequence and measure it. configure is applied to the hierarchy before the first step
+inline BenchmarkResult runBenchmark(
+    int steps, // Number of steps
+    const std::function<void(Hierarchy&)> &configure, // Sets the learning parameters under test
+    int numLayers = 2 // Number of layers, each ticking once per two updates of the layer below
+) {
+    ComputeSystem cs;
+
+    cs.rng.seed(1234);
+
+    Int3 inputSize(8, 8, 16);
+
+    std::vector<Hierarchy::LayerDesc> lds(numLayers);
+
+    for (int l = 0; l < lds.size(); l++)
+        lds[l].hiddenSize = Int3(8, 8, 16);
+
+    Hierarchy h;
+
+    h.initRandom(cs, { inputSize }, { prediction }, lds);
+
+    configure(h);
+
+    IntBuffer inputCs;
+
+    int correct = 0;
+    int total = 0;
+
+    std::vector<float> stepTimes(steps);
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    for (int t = 0; t < steps; t++) {
+        benchmarkInput(t, inputSize, inputCs);
+
+        // Score the prediction made on the previous step
+        if (t >= steps / 2) {
+            const IntBuffer &predCs = h.getPredictionCs(0);
+
+            for (int i = 0; i < inputCs.size(); i++)
+                correct += predCs[i] == inputCs[i];
+
+            total += inputCs.size();
+        }
+
+        std::chrono::steady_clock::time_point stepStart = std::chrono::steady_clock::now();
+
+        h.step(cs, { &inputCs }, true);
+
+        stepTimes[t] = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - stepStart).count();
+    }
+
+    float seconds = std::chrono::duration<float>(std::chrono::steady_clock::now() - start).count();
+
+    int p99Index = std::min(steps - 1, steps * 99 / 100);
+
+    std::nth_element(stepTimes.begin(), stepTimes.begin() + p99Index, stepTimes.end());
+
+    BenchmarkResult result;
+
+    result.stepsPerSecond = steps / seconds;
+    result.accuracy = static_cast<float>(correct) / std::max(1, total);
+    result.p99StepTime = stepTimes[p99Index];
+
+    return result;
+}
+
+// Print one result row
+inline void printBenchmarkResult(
+    const std::string &name,
+    const BenchmarkResult &result
+) {
+    std::cout << name << "\t" << result.stepsPerSecond << " steps/s\tp99 step " << result.p99StepTime << " ms\taccuracy " << result.accuracy << std::endl;
+}
+} // namespace ogmaneo
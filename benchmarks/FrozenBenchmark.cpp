@@ -0,0 +1,104 @@
+// ----------------------------------------------------------------------------
+//  OgmaNeo
+//  Copyright(c) 2016-2020 Ogma Intelligent Systems Corp. All rights reserved.
+//
+//  This copy of OgmaNeo is licensed to you under the terms described
+//  in the OGMANEO_LICENSE.md file included in this distribution.
+// ----------------------------------------------------------------------------
+
+// Size and inference step time of a FrozenHierarchy, compared to the Hierarchy it was frozen from stepping without learning
+
+#include "Benchmark.h"
+
+#include <ogmaneo/FrozenHierarchy.h>
+
+#include <cstdlib>
+#include <sstream>
+
+using namespace ogmaneo;
+
+// Step time in milliseconds at a percentile of the sorted step times
+static float stepTimePercentile(
+    std::vector<float> &stepTimes,
+    int percentile
+) {
+    int index = std::min(static_cast<int>(stepTimes.size()) - 1, static_cast<int>(stepTimes.size()) * percentile / 100);
+
+    std::nth_element(stepTimes.begin(), stepTimes.begin() + index, stepTimes.end());
+
+    return stepTimes[index];
+}
+
+int main(
+    int argc,
+    char** argv
+) {
+    int steps = argc > 1 ? std::atoi(argv[1]) : 2000;
+
+    ComputeSystem cs;
+
+    cs.rng.seed(1234);
+
+    std::vector<Int3> inputSizes = { Int3(8, 8, 16), Int3(4, 4, 8) };
+
+    std::vector<Hierarchy::LayerDesc> lds(3);
+
+    for (int l = 0; l < lds.size(); l++)
+        lds[l].hiddenSize = Int3(6, 6, 16);
+
+    Hierarchy h;
+
+    h.initRandom(cs, inputSizes, { prediction, prediction }, lds);
+
+    std::vector<IntBuffer> inputCs(inputSizes.size());
+
+    // Train, then measure both on the same continuation of the sequence
+    for (int t = 0; t < steps; t++) {
+        for (int i = 0; i < inputSizes.size(); i++)
+            benchmarkInput(t + i * 17, inputSizes[i], inputCs[i]);
+
+        h.step(cs, { &inputCs[0], &inputCs[1] }, true);
+    }
+
+    FrozenHierarchy frozen;
+
+    frozen.init(h);
+
+    std::ostringstream hierarchyStream;
+    std::ostringstream frozenStream;
+
+    h.writeToStream(hierarchyStream);
+    frozen.writeToStream(frozenStream);
+
+    std::vector<float> hierarchyTimes(steps);
+    std::vector<float> frozenTimes(steps);
+
+    int mismatches = 0;
+
+    for (int t = 0; t < steps; t++) {
+        for (int i = 0; i < inputSizes.size(); i++)
+            benchmarkInput(steps + t + i * 17, inputSizes[i], inputCs[i]);
+
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+        h.step(cs, { &inputCs[0], &inputCs[1] }, false);
+
+        std::chrono::steady_clock::time_point middle = std::chrono::steady_clock::now();
+
+        frozen.step(cs, { &inputCs[0], &inputCs[1] });
+
+        std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+
+        hierarchyTimes[t] = std::chrono::duration<float, std::milli>(middle - start).count();
+        frozenTimes[t] = std::chrono::duration<float, std::milli>(end - middle).count();
+
+        for (int i = 0; i < inputSizes.size(); i++)
+            mismatches += h.getPredictionCs(i) != frozen.getPredictionCs(i);
+    }
+
+    std::cout << "Hierarchy\t" << hierarchyStream.str().size() << " stream bytes\tstep p50 " << stepTimePercentile(hierarchyTimes, 50) << " ms\tp99 " << stepTimePercentile(hierarchyTimes, 99) << " ms" << std::endl;
+    std::cout << "FrozenHierarchy\t" << frozenStream.str().size() << " stream bytes\tstep p50 " << stepTimePercentile(frozenTimes, 50) << " ms\tp99 " << stepTimePercentile(frozenTimes, 99) << " ms" << std::endl;
+    std::cout << "Prediction mismatches\t" << mismatches << std::endl;
+
+    return 0;
+}
@@ -0,0 +1,65 @@
+// ----------------------------------------------------------------------------
+//  OgmaNeo
+//  Copyright(c) 2016-2020 Ogma Intelligent Systems Corp. All rights reserved.
+//
+//  This copy of OgmaNeo is licensed to you under the terms described
+//  in the OGMANEO_LICENSE.md file included in this distribution.
+// ----------------------------------------------------------------------------
+
+// Learning speed against prediction accuracy of error-gated predictor learning (Predictor gateMargin/gateDelta), compared to ungated learning
+
+#include "Benchmark.h"
+
+#include <cstdlib>
+
+using namespace ogmaneo;
+
+// Apply gating parameters to all predictors
+static void setGating(
+    Hierarchy &h,
+    float gateMargin,
+    float gateDelta
+) {
+    for (int l = 0; l < h.getNumLayers(); l++) {
+        for (int p = 0; p < h.getPLayers(l).size(); p++) {
+            if (h.getPLayers(l)[p] != nullptr) {
+                h.getPLayers(l)[p]->gateMargin = gateMargin;
+                h.getPLayers(l)[p]->gateDelta = gateDelta;
+            }
+        }
+    }
+}
+
+int main(
+    int argc,
+    char** argv
+) {
+    int steps = argc > 1 ? std::atoi(argv[1]) : 2000;
+
+    struct Setting {
+        std::string name;
+        float gateMargin;
+        float gateDelta;
+    };
+
+    std::vector<Setting> settings = {
+        { "ungated", -1.0f, 0.0f },
+        { "gateMargin 0.05", 0.05f, 0.0f },
+        { "gateMargin 0.2", 0.2f, 0.0f },
+        { "gateDelta 0.01", -1.0f, 0.01f },
+        { "gateDelta 0.05", -1.0f, 0.05f },
+        { "gateMargin 0.05, gateDelta 0.01", 0.05f, 0.01f }
+    };
+
+    for (int s = 0; s < settings.size(); s++) {
+        const Setting &setting = settings[s];
+
+        BenchmarkResult result = runBenchmark(steps, [&setting](Hierarchy &h) {
+            setGating(h, setting.gateMargin, setting.gateDelta);
+        });
+
+        printBenchmarkResult(setting.name, result);
+    }
+
+    return 0;
+}
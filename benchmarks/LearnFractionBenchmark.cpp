@@ -0,0 +1,43 @@
+// ----------------------------------------------------------------------------
+//  OgmaNeo
+//  Copyright(c) 2016-2020 Ogma Intelligent Systems Corp. All rights reserved.
+//
+//  This copy of OgmaNeo is licensed to you under the terms described
+//  in the OGMANEO_LICENSE.md file included in this distribution.
+// ----------------------------------------------------------------------------
+
+// Throughput against prediction accuracy of column-subset learning (SparseCoder/Predictor learnFraction)
+
+#include "Benchmark.h"
+
+#include <cstdlib>
+
+using namespace ogmaneo;
+
+int main(
+    int argc,
+    char** argv
+) {
+    int steps = argc > 1 ? std::atoi(argv[1]) : 2000;
+
+    std::vector<float> fractions = { 1.0f, 0.5f, 0.25f, 0.1f };
+
+    for (int f = 0; f < fractions.size(); f++) {
+        float fraction = fractions[f];
+
+        BenchmarkResult result = runBenchmark(steps, [fraction](Hierarchy &h) {
+            for (int l = 0; l < h.getNumLayers(); l++) {
+                h.getSCLayer(l).learnFraction = fraction;
+
+                for (int p = 0; p < h.getPLayers(l).size(); p++) {
+                    if (h.getPLayers(l)[p] != nullptr)
+                        h.getPLayers(l)[p]->learnFraction = fraction;
+                }
+            }
+        });
+
+        printBenchmarkResult("learnFraction " + std::to_string(fraction), result);
+    }
+
+    return 0;
+}
@@ -8,18 +8,29 @@
 
 #include "Actor.h"
 
+#include <cstring>
+
 using namespace ogmaneo;
 
 void Actor::forward(
     const Int2 &pos,
     std::mt19937 &rng,
-    const std::vector<const IntBuffer*> &inputCs
+    int e,
+    const std::vector<const IntBuffer*> &inputCs,
+    bool recordActivations
 ) {
     int hiddenColumnIndex = address2(pos, Int2(hiddenSize.x, hiddenSize.y));
 
-    // --- Value ---
+    // Action rows of the column, followed by its value row
+    int numRows = hiddenSize.z + 1;
+    int row = hiddenColumnIndex * numRows;
+
+    // Scratch, reused across calls on the same thread
+    static thread_local FloatBuffer sums;
+    static thread_local FloatBuffer subSums;
+
+    sums.assign(numRows, 0.0f);
 
-    float value = 0.0f;
     int count = 0;
 
     // For each visible layer
@@ -27,37 +38,126 @@ void Actor::forward(
         VisibleLayer &vl = visibleLayers[vli];
         const VisibleLayerDesc &vld = visibleLayerDescs[vli];
 
-        value += vl.valueWeights.multiplyOHVs(*inputCs[vli], hiddenColumnIndex, vld.size.z);
-        count += vl.valueWeights.count(hiddenColumnIndex) / vld.size.z;
+        subSums.assign(numRows, 0.0f);
+
+        vl.weights.multiplyOHVsRows(*inputCs[vli], row, numRows, vld.size.z, subSums);
+
+        for (int r = 0; r < numRows; r++)
+            sums[r] += subSums[r];
+
+        count += vl.weights.count(row) / vld.size.z;
     }
 
-    hiddenValues[hiddenColumnIndex] = value / std::max(1, count);
+    if (recordActivations) {
+        for (int r = 0; r < numRows; r++)
+            hiddenActivations[row + r] = sums[r];
+    }
 
-    // --- Action ---
+    select(hiddenColumnIndex, sums.data(), count, environments[e].hiddenCs, &environments[e].hiddenValues, rng);
+}
 
-    std::vector<float> activations(hiddenSize.z);
-    float maxActivation = -999999.0f;
+void Actor::forwardBatch(
+    const Int2 &pos,
+    std::mt19937 &rng,
+    const std::vector<std::vector<const IntBuffer*>> &inputCs,
+    const std::vector<IntBuffer*> &hiddenCs,
+    const std::vector<FloatBuffer*> &hiddenValues
+) {
+    int hiddenColumnIndex = address2(pos, Int2(hiddenSize.x, hiddenSize.y));
 
-    for (int hc = 0; hc < hiddenSize.z; hc++) {
-        int hiddenIndex = address3(Int3(pos.x, pos.y, hc), hiddenSize);
+    int numRows = hiddenSize.z + 1;
+    int row = hiddenColumnIndex * numRows;
 
-        float sum = 0.0f;
+    int numEnvironments = hiddenCs.size();
 
-        // For each visible layer
-        for (int vli = 0; vli < visibleLayers.size(); vli++) {
-            VisibleLayer &vl = visibleLayers[vli];
-            const VisibleLayerDesc &vld = visibleLayerDescs[vli];
+    // Scratch, reused across calls on the same thread
+    static thread_local FloatBuffer sums;
+    static thread_local FloatBuffer subSums;
+    static thread_local std::vector<const IntBuffer*> layerInputCs;
 
-            sum += vl.actionWeights.multiplyOHVs(*inputCs[vli], hiddenIndex, vld.size.z);
-        }
+    sums.assign(numEnvironments * numRows, 0.0f);
+
+    int count = 0;
+
+    // Rows of the column are traversed once per visible layer for all environments
+    for (int vli = 0; vli < visibleLayers.size(); vli++) {
+        VisibleLayer &vl = visibleLayers[vli];
+        const VisibleLayerDesc &vld = visibleLayerDescs[vli];
+
+        layerInputCs.resize(numEnvironments);
+
+        for (int e = 0; e < numEnvironments; e++)
+            layerInputCs[e] = inputCs[e][vli];
+
+        subSums.assign(numEnvironments * numRows, 0.0f);
+
+        vl.weights.multiplyOHVsRowsBatch(layerInputCs, row, numRows, vld.size.z, subSums);
+
+        for (int i = 0; i < sums.size(); i++)
+            sums[i] += subSums[i];
+
+        count += vl.weights.count(row) / vld.size.z;
+    }
+
+    for (int e = 0; e < numEnvironments; e++)
+        select(hiddenColumnIndex, &sums[e * numRows], count, *hiddenCs[e], hiddenValues[e], rng);
+}
+
+void Actor::choose(
+    const Int2 &pos,
+    std::mt19937 &rng
+) {
+    int hiddenColumnIndex = address2(pos, Int2(hiddenSize.x, hiddenSize.y));
+
+    int numRows = hiddenSize.z + 1;
+    int row = hiddenColumnIndex * numRows;
+
+    int count = 0;
+
+    for (int vli = 0; vli < visibleLayers.size(); vli++)
+        count += visibleLayers[vli].weights.count(row) / visibleLayerDescs[vli].size.z;
+
+    select(hiddenColumnIndex, &hiddenActivations[row], count, environments.front().hiddenCs, &environments.front().hiddenValues, rng);
+}
+
+void Actor::select(
+    int hiddenColumnIndex,
+    const float* sums,
+    int count,
+    IntBuffer &hiddenCs,
+    FloatBuffer* hiddenValues,
+    std::mt19937 &rng
+) {
+    // --- Value ---
 
-        sum /= std::max(1, count);
+    if (hiddenValues != nullptr)
+        (*hiddenValues)[hiddenColumnIndex] = sums[hiddenSize.z] / std::max(1, count);
+
+    // --- Action ---
+
+    // Scratch, reused across calls on the same thread
+    static thread_local FloatBuffer activations;
+
+    activations.resize(hiddenSize.z);
+
+    float maxActivation = -999999.0f;
+
+    for (int hc = 0; hc < hiddenSize.z; hc++) {
+        float sum = sums[hc] / std::max(1, count);
 
         activations[hc] = sum;
 
         maxActivation = std::max(maxActivation, sum);
     }
 
+    hiddenCs[hiddenColumnIndex] = sample(activations, maxActivation, rng);
+}
+
+int Actor::sample(
+    std::vector<float> &activations,
+    float maxActivation,
+    std::mt19937 &rng
+) {
     float total = 0.0f;
 
     for (int hc = 0; hc < hiddenSize.z; hc++) {
@@ -82,109 +182,221 @@ void Actor::forward(
             break;
         }
     }
-    
-    hiddenCs[hiddenColumnIndex] = selectIndex;
+
+    return selectIndex;
 }
 
 void Actor::learn(
     const Int2 &pos,
     std::mt19937 &rng,
-    const std::vector<const IntBuffer*> &inputCsPrev,
-    const IntBuffer* hiddenCsPrev,
-    const FloatBuffer* hiddenValuesPrev,
+    const std::vector<IntBuffer> &inputCsPrev,
+    const IntBuffer &hiddenCsPrev,
+    const FloatBuffer &hiddenValuesPrev,
+    const FloatBuffer &hiddenValues,
     float q,
     float g,
     bool mimic
 ) {
     int hiddenColumnIndex = address2(pos, Int2(hiddenSize.x, hiddenSize.y));
 
-    // --- Value Prev ---
+    // Action rows of the column, followed by its value row
+    int numRows = hiddenSize.z + 1;
+    int row = hiddenColumnIndex * numRows;
 
-    float newValue = q + g * hiddenValues[hiddenColumnIndex];
+    // Scratch, reused across calls on the same thread
+    static thread_local FloatBuffer sums;
+    static thread_local FloatBuffer subSums;
+    static thread_local FloatBuffer deltas;
+
+    sums.assign(numRows, 0.0f);
 
-    float value = 0.0f;
     int count = 0;
 
-    // For each visible layer
+    // Value and action sums in one traversal per visible layer
     for (int vli = 0; vli < visibleLayers.size(); vli++) {
         VisibleLayer &vl = visibleLayers[vli];
         const VisibleLayerDesc &vld = visibleLayerDescs[vli];
 
-        value += vl.valueWeights.multiplyOHVs(*inputCsPrev[vli], hiddenColumnIndex, vld.size.z);
-        count += vl.valueWeights.count(hiddenColumnIndex) / vld.size.z;
+        subSums.assign(numRows, 0.0f);
+
+        vl.weights.multiplyOHVsRows(inputCsPrev[vli], row, numRows, vld.size.z, subSums);
+
+        for (int r = 0; r < numRows; r++)
+            sums[r] += subSums[r];
+
+        count += vl.weights.count(row) / vld.size.z;
     }
 
-    value /= std::max(1, count);
+    deltas.resize(numRows);
+
+    // --- Value Prev ---
+
+    float newValue = q + g * hiddenValues[hiddenColumnIndex];
+
+    float value = sums[hiddenSize.z] / std::max(1, count);
 
     float tdErrorValue = newValue - value;
     
-    float deltaValue = alpha * tdErrorValue;
+    deltas[hiddenSize.z] = alpha * tdErrorValue;
 
-    // For each visible layer
+    // --- Action ---
+
+    int targetC = hiddenCsPrev[hiddenColumnIndex];
+
+    float maxActivation = -999999.0f;
+
+    for (int hc = 0; hc < hiddenSize.z; hc++) {
+        float sum = sums[hc] / std::max(1, count);
+
+        sums[hc] = sum;
+
+        maxActivation = std::max(maxActivation, sum);
+    }
+
+    float total = 0.0f;
+
+    for (int hc = 0; hc < hiddenSize.z; hc++) {
+        sums[hc] = std::exp(sums[hc] - maxActivation);
+        
+        total += sums[hc];
+    }
+
+    float tdErrorAction = newValue - hiddenValuesPrev[hiddenColumnIndex];
+
+    for (int hc = 0; hc < hiddenSize.z; hc++)
+        deltas[hc] = (mimic ? beta : (tdErrorAction > 0.0f ? beta : -beta)) * ((hc == targetC ? 1.0f : 0.0f) - sums[hc] / std::max(0.0001f, total));
+
+    // Value and action updates in one traversal per visible layer
     for (int vli = 0; vli < visibleLayers.size(); vli++) {
         VisibleLayer &vl = visibleLayers[vli];
         const VisibleLayerDesc &vld = visibleLayerDescs[vli];
 
-        vl.valueWeights.deltaOHVs(*inputCsPrev[vli], deltaValue, hiddenColumnIndex, vld.size.z);
+        vl.weights.deltaOHVsRows(inputCsPrev[vli], deltas, row, numRows, vld.size.z);
     }
+}
 
-    // --- Action ---
+void Actor::learnReplay(
+    const Int2 &pos,
+    std::mt19937 &rng,
+    bool mimic
+) {
+    // A column only touches its own weights and value, so replaying its samples in order matches sequential launches
+    for (int it = 0; it < replayIndices.size(); it++)
+        learn(pos, rng, replayInputCs[it], replayHiddenCs[it], replayHiddenValues[it], environments[replayEnvironments[it]].hiddenValues, replayQs[it], replayGs[it], mimic);
+}
 
-    int targetC = (*hiddenCsPrev)[address2(pos, Int2(hiddenSize.x, hiddenSize.y))];
+void Actor::accumulateChange(
+    int vli,
+    int visibleColumnIndex,
+    int inputC
+) {
+    VisibleLayer &vl = visibleLayers[vli];
+    const VisibleLayerDesc &vld = visibleLayerDescs[vli];
 
-    std::vector<float> activations(hiddenSize.z);
-    float maxActivation = -999999.0f;
+    int inputCPrev = vl.inputCsPrev[visibleColumnIndex];
 
-    for (int hc = 0; hc < hiddenSize.z; hc++) {
-        int hiddenIndex = address3(Int3(pos.x, pos.y, hc), hiddenSize);
+    if (inputC == inputCPrev)
+        return;
 
-        float sum = 0.0f;
+    vl.inputCsPrev[visibleColumnIndex] = inputC;
 
-        // For each visible layer
-        for (int vli = 0; vli < visibleLayers.size(); vli++) {
-            VisibleLayer &vl = visibleLayers[vli];
-            const VisibleLayerDesc &vld = visibleLayerDescs[vli];
+    int visibleIndexPrev = inputCPrev + visibleColumnIndex * vld.size.z;
+    int visibleIndex = inputC + visibleColumnIndex * vld.size.z;
 
-            sum += vl.actionWeights.multiplyOHVs(*inputCsPrev[vli], hiddenIndex, vld.size.z);
-        }
+    // Both visible cells are referenced by the same hidden cells/columns, in the same order. Value rows accumulate alongside the action rows
+    int startPrev = vl.weights.columnRanges[visibleIndexPrev];
+    int start = vl.weights.columnRanges[visibleIndex];
+    int count = vl.weights.columnRanges[visibleIndex + 1] - start;
 
-        sum /= std::max(1, count);
+    for (int k = 0; k < count; k++)
+        hiddenActivations[vl.weights.rowIndices[start + k]] += vl.weights.nonZeroValues[vl.weights.nonZeroValueIndices[start + k]] - vl.weights.nonZeroValues[vl.weights.nonZeroValueIndices[startPrev + k]];
+}
 
-        activations[hc] = sum;
+void Actor::remapVisible(
+    int vli,
+    const IntBuffer &cellMap,
+    int newZ
+) {
+    VisibleLayer &vl = visibleLayers[vli];
+    VisibleLayerDesc &vld = visibleLayerDescs[vli];
 
-        maxActivation = std::max(maxActivation, sum);
-    }
+    int numVisibleColumns = vld.size.x * vld.size.y;
 
-    float total = 0.0f;
+    IntBuffer columnMap = cellMapToIndexMap(cellMap, vld.size.z, newZ);
 
-    for (int hc = 0; hc < hiddenSize.z; hc++) {
-        activations[hc] = std::exp(activations[hc] - maxActivation);
-        
-        total += activations[hc];
-    }
+    bool hasT = !vl.weights.columnRanges.empty();
 
-    float tdErrorAction = newValue - (*hiddenValuesPrev)[hiddenColumnIndex];
+    vl.weights.remapColumns(columnMap, numVisibleColumns * newZ);
 
-    for (int hc = 0; hc < hiddenSize.z; hc++) {
-        int hiddenIndex = address3(Int3(pos.x, pos.y, hc), hiddenSize);
+    if (hasT)
+        vl.weights.initT();
 
-        float deltaAction = (mimic ? beta : (tdErrorAction > 0.0f ? beta : -beta)) * ((hc == targetC ? 1.0f : 0.0f) - activations[hc] / std::max(0.0001f, total));
+    if (!vl.inputCsPrev.empty())
+        remapCs(vl.inputCsPrev, cellMap, vld.size.z);
 
-        // For each visible layer
-        for (int vli = 0; vli < visibleLayers.size(); vli++) {
-            VisibleLayer &vl = visibleLayers[vli];
-            const VisibleLayerDesc &vld = visibleLayerDescs[vli];
+    waitPrefetch();
 
-            vl.actionWeights.deltaOHVs(*inputCsPrev[vli], deltaAction, hiddenIndex, vld.size.z);
+    int oldZ = vld.size.z;
+
+    vld.size.z = newZ;
+
+    // History states are repacked, the column size may now fit fewer bytes
+    HistoryLayout oldLayout = historyLayout;
+
+    historyLayout = getHistoryLayout();
+
+    assert(historyLayout.size <= oldLayout.size);
+
+    ByteBuffer record(oldLayout.size);
+    IntBuffer historyCs;
+
+    for (int e = 0; e < environments.size(); e++) {
+        Environment &env = environments[e];
+
+        // Records only shrink, so slots can be rewritten in place from first to last
+        for (int slot = 0; slot < historyCapacity; slot++) {
+            std::memcpy(record.data(), getHistoryRecord(env, 0) + static_cast<size_t>(slot) * oldLayout.size, oldLayout.size);
+
+            unsigned char* newRecord = getHistoryRecord(env, slot);
+
+            for (int i = 0; i < visibleLayers.size(); i++) {
+                const VisibleLayerDesc &other = visibleLayerDescs[i];
+
+                if (i == vli) {
+                    unpackCs(record.data() + oldLayout.inputOffsets[i], numVisibleColumns, packedStateSize(oldZ), historyCs);
+
+                    remapCs(historyCs, cellMap, oldZ);
+
+                    packCs(historyCs, packedStateSize(newZ), newRecord + historyLayout.inputOffsets[i]);
+                }
+                else
+                    std::memcpy(newRecord + historyLayout.inputOffsets[i], record.data() + oldLayout.inputOffsets[i], other.size.x * other.size.y * packedStateSize(other.size.z));
+            }
+
+            std::memcpy(newRecord + historyLayout.hiddenCsOffset, record.data() + oldLayout.hiddenCsOffset, historyLayout.size - historyLayout.hiddenCsOffset);
+        }
+
+        if (env.historyFile != nullptr) {
+            // The records are lost with the mapping if it cannot be resized
+            if (!env.historyFile->resize(static_cast<size_t>(historyCapacity) * historyLayout.size)) {
+                env.historyFile = nullptr;
+
+                clearHistory(env);
+            }
         }
+        else
+            env.historyRecords.resize(static_cast<size_t>(historyCapacity) * historyLayout.size);
     }
+
+    hiddenActivationsValid = false;
 }
 
 void Actor::initRandom(
     ComputeSystem &cs,
     const Int3 &hiddenSize,
     int historyCapacity,
-    const std::vector<VisibleLayerDesc> &visibleLayerDescs
+    const std::vector<VisibleLayerDesc> &visibleLayerDescs,
+    const std::string &historyPath
 ) {
     this->visibleLayerDescs = visibleLayerDescs;
 
@@ -206,41 +418,241 @@ void Actor::initRandom(
         int numVisibleColumns = vld.size.x * vld.size.y;
         int numVisible = numVisibleColumns * vld.size.z;
 
-        // Create weight matrix for this visible layer and initialize randomly
-        initSMLocalRF(vld.size, Int3(hiddenSize.x, hiddenSize.y, 1), vld.radius, vl.valueWeights);
-        initSMLocalRF(vld.size, hiddenSize, vld.radius, vl.actionWeights);
+        // Create weight matrix for this visible layer, with an extra (value) row per column
+        initSMLocalRF(vld.size, Int3(hiddenSize.x, hiddenSize.y, hiddenSize.z + 1), vld.radius, vl.weights);
 
-        for (int i = 0; i < vl.valueWeights.nonZeroValues.size(); i++)
-            vl.valueWeights.nonZeroValues[i] = 0.0f;
+        // Values start at zero, actions randomly
+        for (int row = 0; row < vl.weights.rows; row++) {
+            bool valueRow = row % (hiddenSize.z + 1) == hiddenSize.z;
 
-        for (int i = 0; i < vl.actionWeights.nonZeroValues.size(); i++)
-            vl.actionWeights.nonZeroValues[i] = weightDist(cs.rng);
+            for (int j = vl.weights.rowRanges[row]; j < vl.weights.rowRanges[row + 1]; j++)
+                vl.weights.nonZeroValues[j] = valueRow ? 0.0f : weightDist(cs.rng);
+        }
     }
 
-    hiddenCs = IntBuffer(numHiddenColumns, 0);
+    hiddenActivationsValid = false;
 
-    hiddenValues = FloatBuffer(numHiddenColumns, 0.0f);
+    // Create (pre-allocated) history records
+    waitPrefetch();
 
-    // Create (pre-allocated) history samples
-    historySize = 0;
-    historySamples.resize(historyCapacity);
+    this->historyCapacity = historyCapacity;
 
-    for (int i = 0; i < historySamples.size(); i++) {
-        historySamples[i] = std::make_shared<HistorySample>();
+    historyLayout = getHistoryLayout();
 
-        historySamples[i]->inputCs.resize(visibleLayers.size());
+    environments.assign(1, Environment());
 
-        for (int vli = 0; vli < visibleLayers.size(); vli++) {
-            VisibleLayerDesc &vld = this->visibleLayerDescs[vli];
+    initEnvironment(environments.front(), historyPath);
+}
 
-            int numVisibleColumns = vld.size.x * vld.size.y;
+void Actor::initEnvironment(
+    Environment &env,
+    const std::string &path
+) {
+    int numHiddenColumns = hiddenSize.x * hiddenSize.y;
 
-            historySamples[i]->inputCs[vli] = IntBuffer(numVisibleColumns);
-        }
+    env.hiddenCs = IntBuffer(numHiddenColumns, 0);
+
+    env.hiddenValues = FloatBuffer(numHiddenColumns, 0.0f);
+
+    env.historyFile = nullptr;
+    env.historyRecords.clear();
+
+    if (!path.empty())
+        openHistoryFile(env, path);
+
+    clearHistory(env);
+}
+
+void Actor::clearHistory(
+    Environment &env
+) {
+    env.historySize = 0;
+    env.historyStart = 0;
+
+    if (env.historyFile == nullptr)
+        env.historyRecords = ByteBuffer(static_cast<size_t>(historyCapacity) * historyLayout.size, 0);
+
+    env.returnSum = 0.0;
+    env.discount = 1.0;
+
+    env.historyReturnSums = std::vector<double>(historyCapacity, 0.0);
+    env.historyDiscounts = std::vector<double>(historyCapacity, 1.0);
+
+    env.prefetchIndices.clear();
+}
+
+Actor::HistoryLayout Actor::getHistoryLayout() const {
+    HistoryLayout layout;
+
+    int numHiddenColumns = hiddenSize.x * hiddenSize.y;
+
+    int offset = 0;
+
+    layout.inputOffsets.resize(visibleLayerDescs.size());
+
+    for (int vli = 0; vli < visibleLayerDescs.size(); vli++) {
+        const VisibleLayerDesc &vld = visibleLayerDescs[vli];
+
+        layout.inputOffsets[vli] = offset;
+
+        offset += vld.size.x * vld.size.y * packedStateSize(vld.size.z);
+    }
+
+    layout.hiddenCsOffset = offset;
+
+    offset += numHiddenColumns * packedStateSize(hiddenSize.z);
+
+    layout.valuesOffset = offset;
+
+    offset += numHiddenColumns * sizeof(float);
+
+    layout.rewardOffset = offset;
+
+    offset += sizeof(float);
+
+    layout.size = offset;
+
+    return layout;
+}
+
+void Actor::detachHistoryFile(
+    Environment &env
+) {
+    if (env.historyFile == nullptr)
+        return;
+
+    size_t size = static_cast<size_t>(historyCapacity) * historyLayout.size;
+
+    env.historyRecords = ByteBuffer(size);
+
+    if (size > 0)
+        std::memcpy(env.historyRecords.data(), env.historyFile->getData(), size);
+
+    env.historyFile = nullptr;
+
+    env.prefetchIndices.clear();
+    env.prefetchFuture = std::shared_future<void>();
+}
+
+bool Actor::openHistoryFile(
+    Environment &env,
+    const std::string &path
+) {
+    std::shared_ptr<MappedFile> file = std::make_shared<MappedFile>();
+
+    if (!file->open(path, static_cast<size_t>(historyCapacity) * historyLayout.size))
+        return false;
+
+    env.historyFile = file;
+
+    return true;
+}
+
+std::string Actor::getHistoryPath(
+    const std::string &path,
+    int e
+) const {
+    if (e == 0)
+        return path;
+
+    return path + "." + std::to_string(e);
+}
 
-        historySamples[i]->hiddenCsPrev = IntBuffer(numHiddenColumns);
+bool Actor::setHistoryFile(
+    const std::string &path
+) {
+    waitPrefetch();
+
+    size_t size = static_cast<size_t>(historyCapacity) * historyLayout.size;
+
+    std::vector<std::shared_ptr<MappedFile>> files(environments.size());
+
+    for (int e = 0; e < environments.size(); e++) {
+        files[e] = std::make_shared<MappedFile>();
+
+        if (!files[e]->open(getHistoryPath(path, e), size))
+            return false;
+    }
+
+    for (int e = 0; e < environments.size(); e++) {
+        Environment &env = environments[e];
+
+        // Move the records over
+        if (size > 0)
+            std::memcpy(files[e]->getData(), getHistoryRecord(env, 0), size);
+
+        env.historyFile = files[e];
+
+        env.historyRecords.clear();
+        env.historyRecords.shrink_to_fit();
+
+        env.prefetchIndices.clear();
+    }
+
+    return true;
+}
+
+void Actor::setNumEnvironments(
+    int numEnvironments
+) {
+    assert(numEnvironments > 0);
+
+    waitPrefetch();
+
+    int numEnvironmentsPrev = environments.size();
+
+    // Added environments follow environment 0 into a file
+    std::string path = hasHistoryFile() ? environments.front().historyFile->getPath() : "";
+
+    environments.resize(numEnvironments);
+
+    for (int e = numEnvironmentsPrev; e < numEnvironments; e++)
+        initEnvironment(environments[e], path.empty() ? path : getHistoryPath(path, e));
+}
+
+void Actor::prefetchHistory(
+    ComputeSystem &cs,
+    Environment &env
+) {
+    env.prefetchIndices.clear();
 
-        historySamples[i]->hiddenValuesPrev = FloatBuffer(numHiddenColumns);
+    // Records in memory need no loading
+    if (env.historyFile == nullptr)
+        return;
+
+    // Size and ring start once the next sample is added
+    int nextSize = std::min(env.historySize + 1, historyCapacity);
+    int nextStart = (env.historySize == historyCapacity ? env.historyStart + 1 : env.historyStart) % historyCapacity;
+
+    if (nextSize <= minSteps)
+        return;
+
+    std::uniform_int_distribution<int> historyDist(1, nextSize - minSteps);
+
+    env.prefetchIndices.resize(historyIters);
+
+    IntBuffer slots(historyIters * 2);
+
+    for (int it = 0; it < historyIters; it++) {
+        env.prefetchIndices[it] = historyDist(cs.rng);
+
+        slots[it * 2] = (nextStart + env.prefetchIndices[it] - 1) % historyCapacity;
+        slots[it * 2 + 1] = (nextStart + env.prefetchIndices[it]) % historyCapacity;
+    }
+
+    std::shared_ptr<MappedFile> file = env.historyFile;
+    size_t recordSize = historyLayout.size;
+
+    env.prefetchFuture = std::async(std::launch::async, [file, slots, recordSize]() {
+        for (int i = 0; i < slots.size(); i++)
+            file->prefetch(slots[i] * recordSize, recordSize);
+    }).share();
+}
+
+void Actor::waitPrefetch() const {
+    for (int e = 0; e < environments.size(); e++) {
+        if (environments[e].prefetchFuture.valid())
+            environments[e].prefetchFuture.wait();
     }
 }
 
@@ -249,9 +661,8 @@ const Actor &Actor::operator=(
 ) {
     hiddenSize = other.hiddenSize;
 
-    hiddenCs = other.hiddenCs;
-
-    hiddenValues = other.hiddenValues;
+    hiddenActivations = other.hiddenActivations;
+    hiddenActivationsValid = other.hiddenActivationsValid;
 
     visibleLayerDescs = other.visibleLayerDescs;
     visibleLayers = other.visibleLayers;
@@ -262,20 +673,35 @@ const Actor &Actor::operator=(
     minSteps = other.minSteps;
     historyIters = other.historyIters;
 
-    historySize = other.historySize;
+    waitPrefetch();
+    other.waitPrefetch();
 
-    historySamples.resize(other.historySamples.size());
+    environments = other.environments;
 
-    for (int t = 0; t < historySamples.size(); t++) {
-        if (historySamples[t] == nullptr)
-            historySamples[t] = std::make_shared<HistorySample>();
+    historyCapacity = other.historyCapacity;
 
-        (*historySamples[t]) = (*other.historySamples[t]);
-    }
+    historyLayout = other.historyLayout;
+
+    // Each copy would write its own ring into shared records
+    for (int e = 0; e < environments.size(); e++)
+        detachHistoryFile(environments[e]);
 
     return *this;
 }
 
+void Actor::activateBatch(
+    ComputeSystem &cs,
+    const std::vector<std::vector<const IntBuffer*>> &inputCs,
+    const std::vector<IntBuffer*> &hiddenCs
+) {
+    assert(inputCs.size() >= hiddenCs.size());
+
+    // Values are only needed for learning
+    std::vector<FloatBuffer*> hiddenValues(hiddenCs.size(), nullptr);
+
+    runKernel2(cs, std::bind(Actor::forwardBatchKernel, std::placeholders::_1, std::placeholders::_2, this, inputCs, hiddenCs, hiddenValues), Int2(hiddenSize.x, hiddenSize.y), cs.rng, cs.batchSize2);
+}
+
 void Actor::step(
     ComputeSystem &cs,
     const std::vector<const IntBuffer*> &inputCs,
@@ -284,75 +710,300 @@ void Actor::step(
     bool learnEnabled,
     bool mimic
 ) {
-    int numHiddenColumns = hiddenSize.x * hiddenSize.y;
-    int numHidden = numHiddenColumns * hiddenSize.z;
+    activate(cs, inputCs);
+
+    learn(cs, inputCs, hiddenCsPrev, reward, learnEnabled, mimic);
+}
 
+void Actor::activate(
+    ComputeSystem &cs,
+    const std::vector<const IntBuffer*> &inputCs
+) {
     // Forward kernel
-    runKernel2(cs, std::bind(Actor::forwardKernel, std::placeholders::_1, std::placeholders::_2, this, inputCs), Int2(hiddenSize.x, hiddenSize.y), cs.rng, cs.batchSize2);
+    runKernel2(cs, std::bind(Actor::forwardKernel, std::placeholders::_1, std::placeholders::_2, this, 0, inputCs, false), Int2(hiddenSize.x, hiddenSize.y), cs.rng, cs.batchSize2);
 
-    // Add sample
-    if (historySize == historySamples.size()) {
-        // Circular buffer swap
-        std::shared_ptr<HistorySample> temp = historySamples.front();
+    // Accumulators no longer track the weights/inputs
+    hiddenActivationsValid = false;
+}
+
+void Actor::learn(
+    ComputeSystem &cs,
+    const std::vector<const IntBuffer*> &inputCs,
+    const IntBuffer* hiddenCsPrev,
+    float reward,
+    bool learnEnabled,
+    bool mimic
+) {
+    historyStep(cs, 0, inputCs, hiddenCsPrev, reward, learnEnabled);
 
-        for (int i = 0; i < historySamples.size() - 1; i++)
-            historySamples[i] = historySamples[i + 1];
+    if (learnQueued(cs, mimic))
+        hiddenActivationsValid = false;
 
-        historySamples.back() = temp;
+    prefetchHistory(cs, environments.front());
+}
+
+void Actor::stepBatch(
+    ComputeSystem &cs,
+    const std::vector<std::vector<const IntBuffer*>> &inputCs,
+    const std::vector<const IntBuffer*> &hiddenCsPrev,
+    const std::vector<float> &rewards,
+    bool learnEnabled,
+    bool mimic
+) {
+    assert(inputCs.size() == environments.size());
+    assert(hiddenCsPrev.size() == environments.size());
+    assert(rewards.size() == environments.size());
+
+    std::vector<IntBuffer*> hiddenCs(environments.size());
+    std::vector<FloatBuffer*> hiddenValues(environments.size());
+
+    for (int e = 0; e < environments.size(); e++) {
+        hiddenCs[e] = &environments[e].hiddenCs;
+        hiddenValues[e] = &environments[e].hiddenValues;
     }
 
-    // If not at cap, increment
-    if (historySize < historySamples.size())
-        historySize++;
-    
-    // Add new sample
-    {
-        HistorySample &s = *historySamples[historySize - 1];
+    // Forward kernel, all environments per column
+    runKernel2(cs, std::bind(Actor::forwardBatchKernel, std::placeholders::_1, std::placeholders::_2, this, inputCs, hiddenCs, hiddenValues), Int2(hiddenSize.x, hiddenSize.y), cs.rng, cs.batchSize2);
+
+    // Accumulators no longer track the weights/inputs
+    hiddenActivationsValid = false;
+
+    for (int e = 0; e < environments.size(); e++)
+        historyStep(cs, e, inputCs[e], hiddenCsPrev[e], rewards[e], learnEnabled);
+
+    learnQueued(cs, mimic);
+
+    for (int e = 0; e < environments.size(); e++)
+        prefetchHistory(cs, environments[e]);
+}
+
+void Actor::step(
+    ComputeSystem &cs,
+    const std::vector<const IntBuffer*> &inputCs,
+    const std::vector<const IntBuffer*> &inputChanges,
+    const IntBuffer* hiddenCsPrev,
+    float reward,
+    bool learnEnabled,
+    bool mimic
+) {
+    activate(cs, inputCs, inputChanges);
+
+    learn(cs, inputCs, hiddenCsPrev, reward, learnEnabled, mimic);
+}
+
+void Actor::activate(
+    ComputeSystem &cs,
+    const std::vector<const IntBuffer*> &inputCs,
+    const std::vector<const IntBuffer*> &inputChanges
+) {
+    int numHiddenColumns = hiddenSize.x * hiddenSize.y;
+    int numHidden = numHiddenColumns * hiddenSize.z;
+
+    if (!hiddenActivationsValid) {
+        // Full refresh
+        hiddenActivations.resize(numHiddenColumns * (hiddenSize.z + 1));
+
+        runKernel2(cs, std::bind(Actor::forwardKernel, std::placeholders::_1, std::placeholders::_2, this, 0, inputCs, true), Int2(hiddenSize.x, hiddenSize.y), cs.rng, cs.batchSize2);
 
         for (int vli = 0; vli < visibleLayers.size(); vli++) {
-            VisibleLayerDesc &vld = visibleLayerDescs[vli];
+            VisibleLayer &vl = visibleLayers[vli];
 
-            int numVisibleColumns = vld.size.x * vld.size.y;
+            // Transpose is needed to scatter input changes
+            if (vl.weights.columnRanges.empty())
+                vl.weights.initT();
 
-            // Copy visible Cs
-            runKernel1(cs, std::bind(copyInt, std::placeholders::_1, std::placeholders::_2, inputCs[vli], &s.inputCs[vli]), numVisibleColumns, cs.rng, cs.batchSize1);
+            vl.inputCsPrev = *inputCs[vli];
         }
 
-        // Copy hidden Cs
-        runKernel1(cs, std::bind(copyInt, std::placeholders::_1, std::placeholders::_2, hiddenCsPrev, &s.hiddenCsPrev), numHiddenColumns, cs.rng, cs.batchSize1);
+        hiddenActivationsValid = true;
+    }
+    else {
+        // Scatter input changes into the accumulators
+        for (int vli = 0; vli < visibleLayers.size(); vli++) {
+            const VisibleLayerDesc &vld = visibleLayerDescs[vli];
+
+            if (inputChanges[vli] == nullptr) {
+                int numVisibleColumns = vld.size.x * vld.size.y;
+
+                for (int i = 0; i < numVisibleColumns; i++)
+                    accumulateChange(vli, i, (*inputCs[vli])[i]);
+            }
+            else {
+                for (int i = 0; i < inputChanges[vli]->size(); i++) {
+                    int visibleColumnIndex = (*inputChanges[vli])[i];
+
+                    accumulateChange(vli, visibleColumnIndex, (*inputCs[vli])[visibleColumnIndex]);
+                }
+            }
+        }
+
+        // Actions are sampled every step
+        runKernel2(cs, std::bind(Actor::chooseKernel, std::placeholders::_1, std::placeholders::_2, this), Int2(hiddenSize.x, hiddenSize.y), cs.rng, cs.batchSize2);
+    }
+}
+
+void Actor::rebaseReturns(
+    Environment &env
+) {
+    // Samples occupy slots [0, historySize) whether or not the buffer has wrapped
+    for (int i = 0; i < env.historySize; i++) {
+        double q = (env.returnSum - env.historyReturnSums[i]) / env.historyDiscounts[i];
+
+        // Samples so old that further rewards vanish in precision keep their return
+        double base = std::min(env.historyDiscounts[i] / env.discount, 1e30);
+
+        env.historyReturnSums[i] = -q * base;
+        env.historyDiscounts[i] = base;
+    }
+
+    env.returnSum = 0.0;
+    env.discount = 1.0;
+}
+
+bool Actor::historyStep(
+    ComputeSystem &cs,
+    int e,
+    const std::vector<const IntBuffer*> &inputCs,
+    const IntBuffer* hiddenCsPrev,
+    float reward,
+    bool learnEnabled
+) {
+    Environment &env = environments[e];
+
+    int numHiddenColumns = hiddenSize.x * hiddenSize.y;
+
+    // Records are not written while a prefetch reads them
+    if (env.prefetchFuture.valid())
+        env.prefetchFuture.wait();
+
+    // Add sample, overwriting the oldest once at cap
+    int slot;
+
+    if (env.historySize == historyCapacity) {
+        slot = env.historyStart;
+
+        env.historyStart = (env.historyStart + 1) % historyCapacity;
+    }
+    else {
+        slot = historySlot(env, env.historySize);
+
+        env.historySize++;
+    }
+    
+    // Add new sample
+    {
+        unsigned char* record = getHistoryRecord(env, slot);
+
+        // Pack visible Cs
+        for (int vli = 0; vli < visibleLayers.size(); vli++)
+            packCs(*inputCs[vli], packedStateSize(visibleLayerDescs[vli].size.z), record + historyLayout.inputOffsets[vli]);
+
+        // Pack hidden Cs
+        packCs(*hiddenCsPrev, packedStateSize(hiddenSize.z), record + historyLayout.hiddenCsOffset);
 
         // Copy hidden values
-        runKernel1(cs, std::bind(copyFloat, std::placeholders::_1, std::placeholders::_2, &hiddenValues, &s.hiddenValuesPrev), numHiddenColumns, cs.rng, cs.batchSize1);
+        std::memcpy(record + historyLayout.valuesOffset, env.hiddenValues.data(), numHiddenColumns * sizeof(float));
 
-        s.reward = reward;
+        std::memcpy(record + historyLayout.rewardOffset, &reward, sizeof(float));
     }
 
+    // The new sample's return starts here
+    env.historyReturnSums[slot] = env.returnSum;
+    env.historyDiscounts[slot] = env.discount;
+
+    // Extends the returns of all samples (including the new one) by the new reward at once
+    env.returnSum += reward * env.discount;
+    env.discount *= gamma;
+
+    // New rewards would lose precision against the sum. Rebasing is one pass over the history, once every log(1e-8) / log(gamma) steps (about 1800 at 0.99)
+    if (env.discount < 1e-8)
+        rebaseReturns(env);
+
     // Learn (if have sufficient samples)
-    if (learnEnabled && historySize > minSteps) {
-        std::uniform_int_distribution<int> historyDist(1, historySize - minSteps);
+    if (!learnEnabled || env.historySize <= minSteps)
+        return false;
 
-        for (int it = 0; it < historyIters; it++) {
-            int historyIndex = historyDist(cs.rng);
+    int start = replayIndices.size();
 
-            const HistorySample &sPrev = *historySamples[historyIndex - 1];
-            const HistorySample &s = *historySamples[historyIndex];
+    // Use the indices drawn ahead if they are still valid
+    bool prefetched = env.prefetchIndices.size() == historyIters;
 
-            // Compute (partial) values, rest is completed in the kernel
-            float q = 0.0f;
-            float g = 1.0f;
+    for (int it = 0; prefetched && it < historyIters; it++) {
+        if (env.prefetchIndices[it] > env.historySize - minSteps)
+            prefetched = false;
+    }
 
-            for (int t = historyIndex; t < historySize; t++) {
-                q += historySamples[t]->reward * g;
+    if (prefetched)
+        replayIndices.insert(replayIndices.end(), env.prefetchIndices.begin(), env.prefetchIndices.end());
+    else {
+        std::uniform_int_distribution<int> historyDist(1, env.historySize - minSteps);
 
-                g *= gamma;
-            }
+        for (int it = 0; it < historyIters; it++)
+            replayIndices.push_back(historyDist(cs.rng));
+    }
+
+    int end = replayIndices.size();
+
+    replayEnvironments.resize(end, e);
+    replayQs.resize(end);
+    replayGs.resize(end);
+
+    // Unpacked states are kept allocated between steps
+    if (replayInputCs.size() < end) {
+        replayInputCs.resize(end);
+        replayHiddenCs.resize(end);
+        replayHiddenValues.resize(end);
+    }
+
+    for (int it = start; it < end; it++) {
+        int historyIndex = replayIndices[it];
 
-            // Learn kernel
-            runKernel2(cs, std::bind(Actor::learnKernel, std::placeholders::_1, std::placeholders::_2, this, constGet(sPrev.inputCs), &s.hiddenCsPrev, &sPrev.hiddenValuesPrev, q, g, mimic), Int2(hiddenSize.x, hiddenSize.y), cs.rng, cs.batchSize2);
+        int slot = historySlot(env, historyIndex);
+
+        // (Partial) values, rest is completed in the kernel
+        replayQs[it] = (env.returnSum - env.historyReturnSums[slot]) / env.historyDiscounts[slot];
+        replayGs[it] = env.discount / env.historyDiscounts[slot];
+
+        // Unpack only the sampled records
+        const unsigned char* recordPrev = getHistoryRecord(env, historySlot(env, historyIndex - 1));
+
+        replayInputCs[it].resize(visibleLayers.size());
+
+        for (int vli = 0; vli < visibleLayers.size(); vli++) {
+            const VisibleLayerDesc &vld = visibleLayerDescs[vli];
+
+            unpackCs(recordPrev + historyLayout.inputOffsets[vli], vld.size.x * vld.size.y, packedStateSize(vld.size.z), replayInputCs[it][vli]);
         }
+
+        replayHiddenValues[it].resize(numHiddenColumns);
+
+        std::memcpy(replayHiddenValues[it].data(), recordPrev + historyLayout.valuesOffset, numHiddenColumns * sizeof(float));
+
+        unpackCs(getHistoryRecord(env, slot) + historyLayout.hiddenCsOffset, numHiddenColumns, packedStateSize(hiddenSize.z), replayHiddenCs[it]);
     }
+
+    return true;
 }
 
+bool Actor::learnQueued(
+    ComputeSystem &cs,
+    bool mimic
+) {
+    if (replayIndices.empty())
+        return false;
+
+    // Learn kernel, all iterations of all environments in one launch
+    runKernel2(cs, std::bind(Actor::learnReplayKernel, std::placeholders::_1, std::placeholders::_2, this, mimic), Int2(hiddenSize.x, hiddenSize.y), cs.rng, cs.batchSize2);
+
+    replayEnvironments.clear();
+    replayIndices.clear();
+    replayQs.clear();
+    replayGs.clear();
+
+    return true;
+}
+
+
 void Actor::writeToStream(
     std::ostream &os
 ) const {
@@ -367,10 +1018,6 @@ void Actor::writeToStream(
     os.write(reinterpret_cast<const char*>(&minSteps), sizeof(int));
     os.write(reinterpret_cast<const char*>(&historyIters), sizeof(int));
 
-    writeBufferToStream(os, &hiddenCs);
-
-    writeBufferToStream(os, &hiddenValues);
-
     int numVisibleLayers = visibleLayers.size();
 
     os.write(reinterpret_cast<char*>(&numVisibleLayers), sizeof(int));
@@ -384,27 +1031,48 @@ void Actor::writeToStream(
 
         os.write(reinterpret_cast<const char*>(&vld), sizeof(VisibleLayerDesc));
 
-        writeSMToStream(os, vl.valueWeights);
-        writeSMToStream(os, vl.actionWeights);
+        writeSMToStream(os, vl.weights);
     }
 
-    os.write(reinterpret_cast<const char*>(&historySize), sizeof(int));
+    os.write(reinterpret_cast<const char*>(&historyCapacity), sizeof(int));
 
-    int numHistorySamples = historySamples.size();
+    int numEnvironments = environments.size();
 
-    os.write(reinterpret_cast<const char*>(&numHistorySamples), sizeof(int));
+    os.write(reinterpret_cast<const char*>(&numEnvironments), sizeof(int));
 
-    for (int t = 0; t < historySamples.size(); t++) {
-        const HistorySample &s = *historySamples[t];
+    for (int e = 0; e < environments.size(); e++) {
+        const Environment &env = environments[e];
 
-        for (int vli = 0; vli < visibleLayers.size(); vli++)
-            writeBufferToStream(os, &s.inputCs[vli]);
+        writeBufferToStream(os, &env.hiddenCs);
+
+        writeBufferToStream(os, &env.hiddenValues);
+
+        os.write(reinterpret_cast<const char*>(&env.historySize), sizeof(int));
+        os.write(reinterpret_cast<const char*>(&env.historyStart), sizeof(int));
 
-        writeBufferToStream(os, &s.hiddenCsPrev);
+        char external = env.historyFile != nullptr;
 
-        writeBufferToStream(os, &s.hiddenValuesPrev);
+        os.write(&external, sizeof(char));
 
-        os.write(reinterpret_cast<const char*>(&s.reward), sizeof(float));
+        if (external) {
+            // Records stay in the file
+            env.historyFile->flush();
+
+            const std::string &path = env.historyFile->getPath();
+
+            int pathSize = path.size();
+
+            os.write(reinterpret_cast<const char*>(&pathSize), sizeof(int));
+            os.write(path.data(), pathSize);
+        }
+        else
+            writeBufferToStream(os, &env.historyRecords);
+
+        os.write(reinterpret_cast<const char*>(&env.returnSum), sizeof(double));
+        os.write(reinterpret_cast<const char*>(&env.discount), sizeof(double));
+
+        writeBufferToStream(os, &env.historyReturnSums);
+        writeBufferToStream(os, &env.historyDiscounts);
     }
 }
 
@@ -422,10 +1090,6 @@ void Actor::readFromStream(
     is.read(reinterpret_cast<char*>(&minSteps), sizeof(int));
     is.read(reinterpret_cast<char*>(&historyIters), sizeof(int));
 
-    readBufferFromStream(is, &hiddenCs);
-
-    readBufferFromStream(is, &hiddenValues);
-
     int numVisibleLayers;
     
     is.read(reinterpret_cast<char*>(&numVisibleLayers), sizeof(int));
@@ -442,32 +1106,68 @@ void Actor::readFromStream(
         int numVisibleColumns = vld.size.x * vld.size.y;
         int numVisible = numVisibleColumns * vld.size.z;
 
-        readSMFromStream(is, vl.valueWeights);
-        readSMFromStream(is, vl.actionWeights);
+        readSMFromStream(is, vl.weights);
     }
 
-    is.read(reinterpret_cast<char*>(&historySize), sizeof(int));
+    waitPrefetch();
 
-    int numHistorySamples;
+    is.read(reinterpret_cast<char*>(&historyCapacity), sizeof(int));
 
-    is.read(reinterpret_cast<char*>(&numHistorySamples), sizeof(int));
+    historyLayout = getHistoryLayout();
 
-    historySamples.resize(numHistorySamples);
+    int numEnvironments;
 
-    for (int t = 0; t < historySamples.size(); t++) {
-        historySamples[t] = std::make_shared<HistorySample>();
+    is.read(reinterpret_cast<char*>(&numEnvironments), sizeof(int));
 
-        HistorySample &s = *historySamples[t];
+    environments.assign(numEnvironments, Environment());
 
-        s.inputCs.resize(visibleLayers.size());
+    for (int e = 0; e < environments.size(); e++) {
+        Environment &env = environments[e];
 
-        for (int vli = 0; vli < visibleLayers.size(); vli++)
-            readBufferFromStream(is, &s.inputCs[vli]);
+        readBufferFromStream(is, &env.hiddenCs);
+
+        readBufferFromStream(is, &env.hiddenValues);
+
+        is.read(reinterpret_cast<char*>(&env.historySize), sizeof(int));
+        is.read(reinterpret_cast<char*>(&env.historyStart), sizeof(int));
+
+        char external;
 
-        readBufferFromStream(is, &s.hiddenCsPrev);
+        is.read(&external, sizeof(char));
 
-        readBufferFromStream(is, &s.hiddenValuesPrev);
+        bool opened = true;
 
-        is.read(reinterpret_cast<char*>(&s.reward), sizeof(float));
+        if (external) {
+            int pathSize;
+
+            is.read(reinterpret_cast<char*>(&pathSize), sizeof(int));
+
+            std::string path(pathSize, ' ');
+
+            is.read(&path[0], pathSize);
+
+            // Records are in the file, which the writer may still be using
+            opened = openHistoryFile(env, path);
+
+            if (opened)
+                detachHistoryFile(env);
+        }
+        else
+            readBufferFromStream(is, &env.historyRecords);
+
+        is.read(reinterpret_cast<char*>(&env.returnSum), sizeof(double));
+        is.read(reinterpret_cast<char*>(&env.discount), sizeof(double));
+
+        readBufferFromStream(is, &env.historyReturnSums);
+        readBufferFromStream(is, &env.historyDiscounts);
+
+        // A missing or unmappable file loses the records, the environment continues with an empty history
+        if (!opened) {
+            env.historyFile = nullptr;
+
+            clearHistory(env);
+        }
     }
+
+    hiddenActivationsValid = false;
 }
\ No newline at end of file
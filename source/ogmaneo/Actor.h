@@ -9,6 +9,10 @@
 #pragma once
 
 #include "ComputeSystem.h"
+#include "MappedFile.h"
+
+#include <memory>
+#include <string>
 
 namespace ogmaneo {
 // A reinforcement learning layer
@@ -30,31 +34,93 @@ public:
 
     // Visible layer
     struct VisibleLayer {
-        SparseMatrix valueWeights; // Value function weights
-        SparseMatrix actionWeights; // Action function weights
+        SparseMatrix weights; // Action and value function weights. Each hidden column has hiddenSize.z action rows followed by one value row
+
+        IntBuffer inputCsPrev; // Previous input states (event-driven mode only)
+    };
+
+    // Byte layout of a history record (one sample for delayed updates). States are packed with packCs, using the fewest bytes that fit the column size
+    struct HistoryLayout {
+        IntBuffer inputOffsets; // Packed input states of each visible layer
+        int hiddenCsOffset; // Packed hidden states (actions)
+        int valuesOffset; // Hidden values (floats)
+        int rewardOffset; // Reward (float)
+
+        int size; // Size of a record
+
+        // Defaults
+        HistoryLayout()
+        :
+        hiddenCsOffset(0),
+        valuesOffset(0),
+        rewardOffset(0),
+        size(0)
+        {}
     };
 
-    // History sample for delayed updates
-    struct HistorySample {
-        std::vector<IntBuffer> inputCs;
-        IntBuffer hiddenCsPrev;
+    // State of one environment. Environments share the weights, each has its own actions and history
+    struct Environment {
+        IntBuffer hiddenCs; // Hidden states
+
+        FloatBuffer hiddenValues; // Hidden value function output buffer
 
-        FloatBuffer hiddenValuesPrev;
-        
-        float reward;
+        // Current history size - fixed after initialization. Determines length of wait before updating
+        int historySize;
+
+        int historyStart; // Slot of the oldest sample. Until the buffer is full, samples occupy slots [0, historySize)
+
+        // History ring buffer of fixed-size records, preallocated to the history capacity. Kept in memory, or in a mapped file if one is set
+        ByteBuffer historyRecords;
+        std::shared_ptr<MappedFile> historyFile;
+
+        // History indices of the next step, drawn ahead so their records can be loaded in the background (mapped file only)
+        IntBuffer prefetchIndices;
+        std::shared_future<void> prefetchFuture;
+
+        // Running sum of all rewards so far, each discounted by the product of the discount factors before it, and that product after the newest reward.
+        // Both are relative to the last rebase (see rebaseReturns)
+        double returnSum;
+        double discount;
+
+        // returnSum and discount just before the reward of each slot's sample was added. The return of a sample up to the newest is
+        // (returnSum - historyReturnSums[slot]) / historyDiscounts[slot], the discount of the next reward discount / historyDiscounts[slot]
+        std::vector<double> historyReturnSums;
+        std::vector<double> historyDiscounts;
+
+        // Defaults
+        Environment()
+        :
+        historySize(0),
+        historyStart(0),
+        returnSum(0.0),
+        discount(1.0)
+        {}
     };
 
 private:
     Int3 hiddenSize; // Hidden/output/action size
 
-    // Current history size - fixed after initialization. Determines length of wait before updating
-    int historySize;
+    // Environments, environment 0 is the one stepped by step
+    std::vector<Environment> environments;
 
-    IntBuffer hiddenCs; // Hidden states
+    // Event-driven mode (environment 0 only)
+    FloatBuffer hiddenActivations; // Per-row action and value activation accumulators (same layout as the weight rows)
+    bool hiddenActivationsValid; // Whether the accumulators match the current weights and inputs
 
-    FloatBuffer hiddenValues; // Hidden value function output buffer
+    int historyCapacity; // Number of history slots, per environment
 
-    std::vector<std::shared_ptr<HistorySample>> historySamples; // History buffer, fixed length
+    HistoryLayout historyLayout; // Record layout, shared by all environments
+
+    // Environments, history indices and (partial) values of the samples replayed on the current step, in order
+    IntBuffer replayEnvironments;
+    IntBuffer replayIndices;
+    FloatBuffer replayQs;
+    FloatBuffer replayGs;
+
+    // Unpacked states of the replayed samples (inputs and values of the sample before each index, actions of the sample at it)
+    std::vector<std::vector<IntBuffer>> replayInputCs;
+    std::vector<IntBuffer> replayHiddenCs;
+    std::vector<FloatBuffer> replayHiddenValues;
 
     // Visible layers and descriptors
     std::vector<VisibleLayer> visibleLayers;
@@ -65,47 +131,202 @@ private:
     void forward(
         const Int2 &pos,
         std::mt19937 &rng,
-        const std::vector<const IntBuffer*> &inputCs
+        int e,
+        const std::vector<const IntBuffer*> &inputCs,
+        bool recordActivations
+    );
+
+    void forwardBatch(
+        const Int2 &pos,
+        std::mt19937 &rng,
+        const std::vector<std::vector<const IntBuffer*>> &inputCs,
+        const std::vector<IntBuffer*> &hiddenCs,
+        const std::vector<FloatBuffer*> &hiddenValues
+    );
+
+    void choose(
+        const Int2 &pos,
+        std::mt19937 &rng
+    );
+
+    // Set the value (if hiddenValues is not nullptr) and sample the action of a hidden column from its row sums
+    void select(
+        int hiddenColumnIndex,
+        const float* sums,
+        int count,
+        IntBuffer &hiddenCs,
+        FloatBuffer* hiddenValues,
+        std::mt19937 &rng
+    );
+
+    int sample(
+        std::vector<float> &activations,
+        float maxActivation,
+        std::mt19937 &rng
     );
 
     void learn(
         const Int2 &pos,
         std::mt19937 &rng,
-        const std::vector<const IntBuffer*> &inputCsPrev,
-        const IntBuffer* hiddenCsPrev,
-        const FloatBuffer* hiddenValuesPrev,
+        const std::vector<IntBuffer> &inputCsPrev,
+        const IntBuffer &hiddenCsPrev,
+        const FloatBuffer &hiddenValuesPrev,
+        const FloatBuffer &hiddenValues,
         float q,
         float g,
         bool mimic
     );
 
+    void learnReplay(
+        const Int2 &pos,
+        std::mt19937 &rng,
+        bool mimic
+    );
+
     static void forwardKernel(
         const Int2 &pos,
         std::mt19937 &rng,
         Actor* a,
-        const std::vector<const IntBuffer*> &inputCs
+        int e,
+        const std::vector<const IntBuffer*> &inputCs,
+        bool recordActivations
     ) {
-        a->forward(pos, rng, inputCs);
+        a->forward(pos, rng, e, inputCs, recordActivations);
     }
 
-    static void learnKernel(
+    static void forwardBatchKernel(
+        const Int2 &pos,
+        std::mt19937 &rng,
+        Actor* a,
+        const std::vector<std::vector<const IntBuffer*>> &inputCs,
+        const std::vector<IntBuffer*> &hiddenCs,
+        const std::vector<FloatBuffer*> &hiddenValues
+    ) {
+        a->forwardBatch(pos, rng, inputCs, hiddenCs, hiddenValues);
+    }
+
+    static void chooseKernel(
+        const Int2 &pos,
+        std::mt19937 &rng,
+        Actor* a
+    ) {
+        a->choose(pos, rng);
+    }
+
+    static void learnReplayKernel(
         const Int2 &pos,
         std::mt19937 &rng,
         Actor* a,
-        const std::vector<const IntBuffer*> &inputCsPrev,
-        const IntBuffer* hiddenCsPrev,
-        const FloatBuffer* hiddenValuesPrev,
-        float q,
-        float g,
         bool mimic
     ) {
-        a->learn(pos, rng, inputCsPrev, hiddenCsPrev, hiddenValuesPrev, q, g, mimic);
+        a->learnReplay(pos, rng, mimic);
+    }
+
+    // Slot of the t-th oldest history sample of an environment
+    int historySlot(
+        const Environment &env,
+        int t
+    ) const {
+        return (env.historyStart + t) % historyCapacity;
+    }
+
+    // Record layout for the current sizes
+    HistoryLayout getHistoryLayout() const;
+
+    // Get the record in a history slot of an environment
+    unsigned char* getHistoryRecord(
+        Environment &env,
+        int slot
+    ) {
+        return (env.historyFile != nullptr ? env.historyFile->getData() : env.historyRecords.data()) + static_cast<size_t>(slot) * historyLayout.size;
+    }
+
+    const unsigned char* getHistoryRecord(
+        const Environment &env,
+        int slot
+    ) const {
+        return (env.historyFile != nullptr ? env.historyFile->getData() : env.historyRecords.data()) + static_cast<size_t>(slot) * historyLayout.size;
     }
 
+    // Reset an environment to empty outputs and history. The history is kept in memory, or in a mapped file at path if it can be opened
+    void initEnvironment(
+        Environment &env,
+        const std::string &path
+    );
+
+    // Empty the history of an environment. Records stay in its history file if it has one, otherwise they are kept in memory
+    void clearHistory(
+        Environment &env
+    );
+
+    // Move the history records of an environment from its file into memory, so the file is no longer written through this environment
+    void detachHistoryFile(
+        Environment &env
+    );
+
+    // Map a file for the history records of an environment with the current layout. Returns whether it succeeded
+    bool openHistoryFile(
+        Environment &env,
+        const std::string &path
+    );
+
+    // Path of the history file of an environment, derived from the path of environment 0
+    std::string getHistoryPath(
+        const std::string &path,
+        int e
+    ) const;
+
+    // Draw the history indices of the next step and load their records in the background (mapped file only)
+    void prefetchHistory(
+        ComputeSystem &cs,
+        Environment &env
+    );
+
+    // Block until background prefetches are done
+    void waitPrefetch() const;
+
+    // Restart the running return sums of an environment at zero and a discount of one, before the discount runs out of precision. Keeps the returns of all samples
+    void rebaseReturns(
+        Environment &env
+    );
+
+    // Add a history sample to an environment and queue samples from its history for replay. Returns whether any were queued
+    bool historyStep(
+        ComputeSystem &cs,
+        int e,
+        const std::vector<const IntBuffer*> &inputCs,
+        const IntBuffer* hiddenCsPrev,
+        float reward,
+        bool learnEnabled
+    );
+
+    // Learn from all queued replay samples in one launch. Returns whether learning occurred
+    bool learnQueued(
+        ComputeSystem &cs,
+        bool mimic
+    );
+
+    // --- Event-driven helpers ---
+
+    void accumulateChange(
+        int vli,
+        int visibleColumnIndex,
+        int inputC
+    );
+
+    // --- Compaction helpers ---
+
+    // Remove input cells of a visible layer, including from the history
+    void remapVisible(
+        int vli, // Index of visible layer
+        const IntBuffer &cellMap, // Cell map over the visible cells
+        int newZ // Visible column size after compaction
+    );
+
 public:
     float alpha; // Value learning rate
     float beta; // Action learning rate
-    float gamma; // Discount factor
+    float gamma; // Discount factor (changes apply to rewards received afterwards)
 
     int minSteps; // Minimum value steps
     int historyIters; // Sample iters
@@ -113,6 +334,9 @@ public:
     // Defaults
     Actor()
     :
+    environments(1),
+    hiddenActivationsValid(false),
+    historyCapacity(0),
     alpha(0.02f),
     beta(0.02f),
     gamma(0.99f),
@@ -130,14 +354,38 @@ public:
         const Actor &other
     );
 
-    // Initialized randomly
+    // Initialized randomly, with one environment
     void initRandom(
         ComputeSystem &cs,
         const Int3 &hiddenSize,
         int historyCapacity,
-        const std::vector<VisibleLayerDesc> &visibleLayerDescs
+        const std::vector<VisibleLayerDesc> &visibleLayerDescs,
+        const std::string &historyPath = "" // If not empty, the history is kept in a memory-mapped file at this path (falls back to memory if it cannot be opened)
+    );
+
+    // Move the histories into memory-mapped files, for capacities that do not fit in memory. Copies of the actor, and actors read from a stream that references
+    // the files, load the records into memory instead of sharing the files (set a new file on them to move the records out again).
+    // Environment 0 uses path, other environments path suffixed with their index. Returns whether it succeeded, the histories stay where they were otherwise
+    bool setHistoryFile(
+        const std::string &path // Path of the file, created if needed
     );
 
+    // Whether the histories are kept in memory-mapped files
+    bool hasHistoryFile() const {
+        return environments.front().historyFile != nullptr;
+    }
+
+    // Set the number of environments stepped together by stepBatch. Environments share the weights, each keeps its own actions and history.
+    // Added environments start empty, with their history in memory or in a file like environment 0
+    void setNumEnvironments(
+        int numEnvironments
+    );
+
+    // Get the number of environments
+    int getNumEnvironments() const {
+        return environments.size();
+    }
+
     // Step (get actions and update)
     void step(
         ComputeSystem &cs,
@@ -148,7 +396,61 @@ public:
         bool mimic
     );
 
-    // Write to stream
+    // Event-driven step. Activations are updated only for changed input columns, actions are still sampled for every column.
+    // Builds weight transposes on first use. Learning invalidates the accumulators, so this only saves work while not learning
+    void step(
+        ComputeSystem &cs,
+        const std::vector<const IntBuffer*> &inputCs,
+        const std::vector<const IntBuffer*> &inputChanges, // Indices of input columns that may have changed, per visible layer. nullptr means unknown (compare all columns)
+        const IntBuffer* hiddenCsPrev,
+        float reward,
+        bool learnEnabled,
+        bool mimic
+    );
+
+    // Get actions without recording or learning, the first half of step. Follow with learn before the next activation
+    void activate(
+        ComputeSystem &cs,
+        const std::vector<const IntBuffer*> &inputCs
+    );
+
+    // Event-driven version of activate, the first half of the event-driven step
+    void activate(
+        ComputeSystem &cs,
+        const std::vector<const IntBuffer*> &inputCs,
+        const std::vector<const IntBuffer*> &inputChanges // Indices of input columns that may have changed, per visible layer. nullptr means unknown (compare all columns)
+    );
+
+    // Record the sample of the last activation and learn from the history, the second half of step. Takes the same inputs as the activation
+    void learn(
+        ComputeSystem &cs,
+        const std::vector<const IntBuffer*> &inputCs,
+        const IntBuffer* hiddenCsPrev,
+        float reward,
+        bool learnEnabled,
+        bool mimic
+    );
+
+    // Step all environments. Actions of all environments are evaluated in one pass over the weights,
+    // and the samples replayed from all environment histories are learned in one launch
+    void stepBatch(
+        ComputeSystem &cs,
+        const std::vector<std::vector<const IntBuffer*>> &inputCs, // Input states, per environment
+        const std::vector<const IntBuffer*> &hiddenCsPrev, // Previous actions, per environment
+        const std::vector<float> &rewards, // Rewards, per environment
+        bool learnEnabled,
+        bool mimic
+    );
+
+    // Sample actions for several independent input sets (streams) at once, without learning or recording history. The weights of each hidden column are loaded once for all streams.
+    // Does not touch the environments, results match step without learning on each stream up to the random draws
+    void activateBatch(
+        ComputeSystem &cs, // Compute system
+        const std::vector<std::vector<const IntBuffer*>> &inputCs, // Input states of each stream. Only the first hiddenCs.size() are read, so a longer reused buffer may be passed
+        const std::vector<IntBuffer*> &hiddenCs // Actions of each stream (output)
+    );
+
+    // Write to stream. A history kept in a file is flushed and referenced by path, not written to the stream
     void writeToStream(
         std::ostream &os // Stream to write to
     ) const;
@@ -179,7 +481,14 @@ public:
 
     // Get hidden state/output/actions
     const IntBuffer &getHiddenCs() const {
-        return hiddenCs;
+        return environments.front().hiddenCs;
+    }
+
+    // Get hidden state/output/actions of an environment
+    const IntBuffer &getHiddenCs(
+        int e // Index of environment
+    ) const {
+        return environments[e].hiddenCs;
     }
 
     // Get the hidden size
@@ -187,18 +496,13 @@ public:
         return hiddenSize;
     }
 
-    // Get the value weights for a visible layer
-    const SparseMatrix &getValueWeights(
+    // Get the action and value weights for a visible layer
+    const SparseMatrix &getWeights(
         int i // Index of layer
     ) {
-        return visibleLayers[i].valueWeights;
+        return visibleLayers[i].weights;
     }
 
-    // Get the action weights for a visible layer
-    const SparseMatrix &getActionWeights(
-        int i // Index of layer
-    ) {
-        return visibleLayers[i].actionWeights;
-    }
+    friend class Hierarchy;
 };
 } // namespace ogmaneo
@@ -0,0 +1,753 @@
+// ----------------------------------------------------------------------------
+//  OgmaNeo
+//  Copyright(c) 2016-2020 Ogma Intelligent Systems Corp. All rights reserved.
+//
+//  This copy of OgmaNeo is licensed to you under the terms described
+//  in the OGMANEO_LICENSE.md file included in this distribution.
+// ----------------------------------------------------------------------------
+
+#include "FrozenHierarchy.h"
+
+#include <algorithm>
+
+using namespace ogmaneo;
+
+// Format version of frozen hierarchy streams, written first. Change it whenever the frozen stream layout changes.
+// The high bits tag the stream, so Hierarchy streams (tagged differently, see Hierarchy.cpp) never match
+const int frozenStreamVersion = 0x4f460001;
+
+void FrozenHierarchy::forwardSC(
+    const Int2 &pos,
+    std::mt19937 &rng,
+    int l,
+    State* state
+) const {
+    const Layer &layer = scLayers[l];
+
+    const Int3 &hiddenSize = layer.hiddenSize;
+
+    int hiddenColumnIndex = address2(pos, Int2(hiddenSize.x, hiddenSize.y));
+
+    // Scratch, reused across calls on the same thread
+    static thread_local FloatBuffer sums;
+    static thread_local FloatBuffer subSums;
+
+    sums.assign(hiddenSize.z, 0.0f);
+
+    for (int vli = 0; vli < layer.visibleLayers.size(); vli++) {
+        const VisibleLayer &vl = layer.visibleLayers[vli];
+        const IntBuffer &inputCs = state->histories[l][vli];
+
+        // Each visible layer is normalized over its present columns
+        if (vl.shared) {
+            for (int hc = 0; hc < hiddenSize.z; hc++) {
+                int count;
+
+                float subSum = multiplySharedOHVs(vl.weights, inputCs, Int3(pos.x, pos.y, hc), vl.size, hiddenSize, vl.radius, count);
+
+                sums[hc] += subSum / std::max(1, count);
+            }
+        }
+        else {
+            subSums.assign(hiddenSize.z, 0.0f);
+
+            int count = accumulate(vl, hiddenColumnIndex, hiddenSize.z, inputCs, subSums);
+
+            for (int hc = 0; hc < hiddenSize.z; hc++)
+                sums[hc] += subSums[hc] / std::max(1, count);
+        }
+    }
+
+    int maxIndex = 0;
+    float maxActivation = -999999.0f;
+
+    for (int hc = 0; hc < hiddenSize.z; hc++) {
+        if (sums[hc] > maxActivation) {
+            maxActivation = sums[hc];
+            maxIndex = hc;
+        }
+    }
+
+    state->hiddenCs[l][hiddenColumnIndex] = maxIndex;
+}
+
+void FrozenHierarchy::forwardP(
+    const Int2 &pos,
+    std::mt19937 &rng,
+    int l,
+    const std::vector<const IntBuffer*> &inputCs,
+    State* state
+) const {
+    // Scratch, reused across calls on the same thread
+    static thread_local FloatBuffer sums;
+    static thread_local FloatBuffer subSums;
+
+    // All predictors of a layer read the same inputs
+    for (int p = 0; p < pLayers[l].size(); p++) {
+        const Layer &layer = pLayers[l][p];
+
+        if (layer.visibleLayers.empty())
+            continue;
+
+        const Int3 &hiddenSize = layer.hiddenSize;
+
+        // First layer predictors differ in size, columns outside are not stepped
+        if (pos.x >= hiddenSize.x || pos.y >= hiddenSize.y)
+            continue;
+
+        int hiddenColumnIndex = address2(pos, Int2(hiddenSize.x, hiddenSize.y));
+
+        sums.assign(hiddenSize.z, 0.0f);
+
+        for (int vli = 0; vli < layer.visibleLayers.size(); vli++) {
+            const VisibleLayer &vl = layer.visibleLayers[vli];
+
+            if (vl.shared) {
+                for (int hc = 0; hc < hiddenSize.z; hc++) {
+                    int count;
+
+                    sums[hc] += multiplySharedOHVs(vl.weights, *inputCs[vli], Int3(pos.x, pos.y, hc), vl.size, hiddenSize, vl.radius, count);
+                }
+            }
+            else {
+                subSums.assign(hiddenSize.z, 0.0f);
+
+                accumulate(vl, hiddenColumnIndex, hiddenSize.z, *inputCs[vli], subSums);
+
+                for (int hc = 0; hc < hiddenSize.z; hc++)
+                    sums[hc] += subSums[hc];
+            }
+        }
+
+        int maxIndex = 0;
+        float maxActivation = -999999.0f;
+
+        for (int hc = 0; hc < hiddenSize.z; hc++) {
+            if (sums[hc] > maxActivation) {
+                maxActivation = sums[hc];
+                maxIndex = hc;
+            }
+        }
+
+        state->predHiddenCs[l][p][hiddenColumnIndex] = maxIndex;
+    }
+}
+
+void FrozenHierarchy::forwardA(
+    const Int2 &pos,
+    std::mt19937 &rng,
+    const std::vector<const IntBuffer*> &inputCs,
+    State* state
+) const {
+    // Scratch, reused across calls on the same thread
+    static thread_local FloatBuffer sums;
+    static thread_local FloatBuffer subSums;
+
+    for (int a = 0; a < aLayers.size(); a++) {
+        const Layer &layer = aLayers[a];
+
+        if (layer.visibleLayers.empty())
+            continue;
+
+        const Int3 &hiddenSize = layer.hiddenSize;
+
+        // Actors differ in size, columns outside are not stepped
+        if (pos.x >= hiddenSize.x || pos.y >= hiddenSize.y)
+            continue;
+
+        int hiddenColumnIndex = address2(pos, Int2(hiddenSize.x, hiddenSize.y));
+
+        sums.assign(hiddenSize.z, 0.0f);
+
+        int count = 0;
+
+        for (int vli = 0; vli < layer.visibleLayers.size(); vli++) {
+            subSums.assign(hiddenSize.z, 0.0f);
+
+            count += accumulate(layer.visibleLayers[vli], hiddenColumnIndex, hiddenSize.z, *inputCs[vli], subSums);
+
+            for (int hc = 0; hc < hiddenSize.z; hc++)
+                sums[hc] += subSums[hc];
+        }
+
+        // Sample from the softmax of the normalized activations, as Actor does
+        float maxActivation = -999999.0f;
+
+        for (int hc = 0; hc < hiddenSize.z; hc++) {
+            sums[hc] /= std::max(1, count);
+
+            maxActivation = std::max(maxActivation, sums[hc]);
+        }
+
+        float total = 0.0f;
+
+        for (int hc = 0; hc < hiddenSize.z; hc++) {
+            sums[hc] = std::exp(sums[hc] - maxActivation);
+
+            total += sums[hc];
+        }
+
+        std::uniform_real_distribution<float> cuspDist(0.0f, total);
+
+        float cusp = cuspDist(rng);
+
+        int selectIndex = 0;
+        float sumSoFar = 0.0f;
+
+        for (int hc = 0; hc < hiddenSize.z; hc++) {
+            sumSoFar += sums[hc];
+
+            if (sumSoFar >= cusp) {
+                selectIndex = hc;
+
+                break;
+            }
+        }
+
+        state->actionCs[a][hiddenColumnIndex] = selectIndex;
+    }
+}
+
+int FrozenHierarchy::accumulate(
+    const VisibleLayer &vl,
+    int hiddenColumnIndex,
+    int numRows,
+    const IntBuffer &inputCs,
+    FloatBuffer &sums
+) {
+    int count = 0;
+
+    for (int k = vl.columnRanges[hiddenColumnIndex]; k < vl.columnRanges[hiddenColumnIndex + 1]; k++) {
+        int inC = inputCs[vl.visibleColumns[k]];
+
+        // Absent input column
+        if (inC < 0)
+            continue;
+
+        const float* weights = &vl.weights[(static_cast<size_t>(k) * vl.size.z + inC) * numRows];
+
+        for (int r = 0; r < numRows; r++)
+            sums[r] += weights[r];
+
+        count++;
+    }
+
+    return count;
+}
+
+void FrozenHierarchy::initVisibleLayer(
+    const SparseMatrix &weights,
+    int numRows,
+    int numRowsKept,
+    VisibleLayer &vl
+) {
+    int numHiddenColumns = weights.rows / numRows;
+    int oneHotSize = vl.size.z;
+
+    vl.columnRanges.resize(numHiddenColumns + 1);
+    vl.visibleColumns.clear();
+
+    // Rows of a hidden column share one receptive field
+    for (int i = 0; i < numHiddenColumns; i++) {
+        int row = i * numRows;
+
+        vl.columnRanges[i] = vl.visibleColumns.size();
+
+        for (int jj = weights.rowRanges[row]; jj < weights.rowRanges[row + 1]; jj += oneHotSize)
+            vl.visibleColumns.push_back(weights.columnIndices[jj] / oneHotSize);
+    }
+
+    vl.columnRanges[numHiddenColumns] = vl.visibleColumns.size();
+
+    vl.weights.resize(vl.visibleColumns.size() * static_cast<size_t>(oneHotSize) * numRowsKept);
+
+    for (int i = 0; i < numHiddenColumns; i++) {
+        for (int k = vl.columnRanges[i]; k < vl.columnRanges[i + 1]; k++) {
+            int offset = (k - vl.columnRanges[i]) * oneHotSize;
+
+            for (int c = 0; c < oneHotSize; c++) {
+                for (int r = 0; r < numRowsKept; r++)
+                    vl.weights[(static_cast<size_t>(k) * oneHotSize + c) * numRowsKept + r] = weights.nonZeroValues[weights.rowRanges[i * numRows + r] + offset + c];
+            }
+        }
+    }
+
+    vl.columnRanges.shrink_to_fit();
+    vl.visibleColumns.shrink_to_fit();
+}
+
+void FrozenHierarchy::init(
+    const Hierarchy &h
+) {
+    h.waitCommits();
+
+    int numLayers = h.scLayers.size();
+
+    inputSizes = h.inputSizes;
+
+    inputTypes.resize(inputSizes.size());
+
+    for (int i = 0; i < inputSizes.size(); i++) {
+        if (h.aLayers[i] != nullptr)
+            inputTypes[i] = action;
+        else if (h.pLayers.front()[i] != nullptr)
+            inputTypes[i] = prediction;
+        else
+            inputTypes[i] = none;
+    }
+
+    ticksPerUpdate = h.ticksPerUpdate;
+
+    scLayers.resize(numLayers);
+    pLayers.resize(numLayers);
+
+    for (int l = 0; l < numLayers; l++) {
+        const SparseCoder &sc = h.scLayers[l];
+
+        Layer &layer = scLayers[l];
+
+        layer.hiddenSize = sc.getHiddenSize();
+        layer.visibleLayers.resize(sc.getNumVisibleLayers());
+
+        for (int vli = 0; vli < layer.visibleLayers.size(); vli++) {
+            const SparseCoder::VisibleLayerDesc &vld = sc.getVisibleLayerDesc(vli);
+
+            VisibleLayer &vl = layer.visibleLayers[vli];
+
+            vl.size = vld.size;
+            vl.radius = vld.radius;
+            vl.shared = vld.shared;
+
+            if (vl.shared)
+                vl.weights = sc.getVisibleLayer(vli).sharedWeights;
+            else
+                initVisibleLayer(sc.getVisibleLayer(vli).weights, layer.hiddenSize.z, layer.hiddenSize.z, vl);
+        }
+
+        pLayers[l].resize(h.pLayers[l].size());
+
+        for (int p = 0; p < pLayers[l].size(); p++) {
+            if (h.pLayers[l][p] == nullptr) {
+                pLayers[l][p] = Layer();
+
+                continue;
+            }
+
+            const Predictor &pred = *h.pLayers[l][p];
+
+            Layer &pLayer = pLayers[l][p];
+
+            pLayer.hiddenSize = pred.getHiddenSize();
+            pLayer.visibleLayers.resize(pred.getNumVisibleLayers());
+
+            for (int vli = 0; vli < pLayer.visibleLayers.size(); vli++) {
+                const Predictor::VisibleLayerDesc &vld = pred.getVisibleLayerDesc(vli);
+
+                VisibleLayer &vl = pLayer.visibleLayers[vli];
+
+                vl.size = vld.size;
+                vl.radius = vld.radius;
+                vl.shared = vld.shared;
+
+                if (vl.shared)
+                    vl.weights = pred.getVisibleLayer(vli).sharedWeights;
+                else
+                    initVisibleLayer(pred.getVisibleLayer(vli).weights, pLayer.hiddenSize.z, pLayer.hiddenSize.z, vl);
+            }
+        }
+    }
+
+    aLayers.resize(inputSizes.size());
+
+    for (int a = 0; a < aLayers.size(); a++) {
+        if (h.aLayers[a] == nullptr) {
+            aLayers[a] = Layer();
+
+            continue;
+        }
+
+        const Actor &actor = *h.aLayers[a];
+
+        Layer &aLayer = aLayers[a];
+
+        aLayer.hiddenSize = actor.getHiddenSize();
+        aLayer.visibleLayers.resize(actor.getNumVisibleLayers());
+
+        for (int vli = 0; vli < aLayer.visibleLayers.size(); vli++) {
+            const Actor::VisibleLayerDesc &vld = actor.getVisibleLayerDesc(vli);
+
+            VisibleLayer &vl = aLayer.visibleLayers[vli];
+
+            vl.size = vld.size;
+            vl.radius = vld.radius;
+
+            // Only the action rows, values are for learning
+            initVisibleLayer(actor.getVisibleLayer(vli).weights, aLayer.hiddenSize.z + 1, aLayer.hiddenSize.z, vl);
+        }
+    }
+
+    h.getState(state);
+
+    trimState(state);
+}
+
+void FrozenHierarchy::initState(
+    State &state
+) const {
+    int numLayers = scLayers.size();
+
+    state.hiddenCs.resize(numLayers);
+    state.histories.resize(numLayers);
+    state.predHiddenCs.resize(numLayers);
+    state.predInputCsPrev.clear();
+
+    for (int l = 0; l < numLayers; l++) {
+        const Int3 &hiddenSize = scLayers[l].hiddenSize;
+
+        state.hiddenCs[l].assign(hiddenSize.x * hiddenSize.y, 0);
+
+        state.histories[l].resize(scLayers[l].visibleLayers.size());
+
+        for (int v = 0; v < state.histories[l].size(); v++) {
+            const Int3 &size = scLayers[l].visibleLayers[v].size;
+
+            state.histories[l][v].assign(size.x * size.y, 0);
+        }
+
+        state.predHiddenCs[l].resize(pLayers[l].size());
+
+        for (int p = 0; p < pLayers[l].size(); p++) {
+            const Int3 &size = pLayers[l][p].hiddenSize;
+
+            if (pLayers[l][p].visibleLayers.empty())
+                state.predHiddenCs[l][p].clear();
+            else
+                state.predHiddenCs[l][p].assign(size.x * size.y, 0);
+        }
+    }
+
+    state.actionCs.resize(aLayers.size());
+
+    for (int a = 0; a < aLayers.size(); a++) {
+        const Int3 &size = aLayers[a].hiddenSize;
+
+        if (aLayers[a].visibleLayers.empty())
+            state.actionCs[a].clear();
+        else
+            state.actionCs[a].assign(size.x * size.y, 0);
+    }
+
+    state.updates.assign(numLayers, false);
+    state.ticks.assign(numLayers, 0);
+}
+
+void FrozenHierarchy::setState(
+    const State &state
+) {
+    this->state = state;
+
+    trimState(this->state);
+}
+
+void FrozenHierarchy::trimState(
+    State &state
+) {
+    state.predInputCsPrev.clear();
+    state.predInputCsPrev.shrink_to_fit();
+
+    state.pendingUpdates.clear();
+}
+
+void FrozenHierarchy::step(
+    ComputeSystem &cs,
+    State &state,
+    const std::vector<const IntBuffer*> &inputCs
+) const {
+    assert(inputCs.size() == inputSizes.size());
+
+    // Absent inputs are stored as absent (negative) columns. Absent actions are replaced by the previous action
+    std::vector<IntBuffer> substituteCs(inputSizes.size());
+    std::vector<const IntBuffer*> filledCs = inputCs;
+
+    for (int i = 0; i < inputSizes.size(); i++) {
+        int numColumns = inputSizes[i].x * inputSizes[i].y;
+
+        if (inputTypes[i] == action) {
+            bool masked = inputCs[i] == nullptr;
+
+            for (int j = 0; !masked && j < numColumns; j++)
+                masked = (*inputCs[i])[j] < 0;
+
+            if (!masked)
+                continue;
+
+            const IntBuffer &actionCsPrev = state.actionCs[i];
+
+            substituteCs[i] = inputCs[i] == nullptr ? actionCsPrev : *inputCs[i];
+
+            for (int j = 0; j < numColumns; j++) {
+                if (substituteCs[i][j] < 0)
+                    substituteCs[i][j] = actionCsPrev[j];
+            }
+
+            filledCs[i] = &substituteCs[i];
+        }
+        else if (inputCs[i] == nullptr) {
+            substituteCs[i] = IntBuffer(numColumns, -1);
+
+            filledCs[i] = &substituteCs[i];
+        }
+    }
+
+    // First tick is always 0
+    state.ticks[0] = 0;
+
+    // Add input to first layer history
+    int temporalHorizon = state.histories.front().size() / inputSizes.size();
+
+    for (int i = 0; i < inputSizes.size(); i++) {
+        assert(inputSizes[i].x * inputSizes[i].y == filledCs[i]->size());
+
+        Hierarchy::pushHistory(state.histories.front(), temporalHorizon * i, temporalHorizon, *filledCs[i]);
+    }
+
+    // Set all updates to no update, will be set to true if an update occurred later
+    state.updates.assign(scLayers.size(), false);
+
+    // Forward
+    for (int l = 0; l < scLayers.size(); l++) {
+        // If is time for layer to tick
+        if (l == 0 || state.ticks[l] >= ticksPerUpdate[l]) {
+            // Reset tick
+            state.ticks[l] = 0;
+
+            // Updated
+            state.updates[l] = true;
+
+            runKernel2(cs, std::bind(FrozenHierarchy::forwardSCKernel, std::placeholders::_1, std::placeholders::_2, this, l, &state), Int2(scLayers[l].hiddenSize.x, scLayers[l].hiddenSize.y), cs.rng, cs.batchSize2);
+
+            // Add to next layer's history
+            if (l < scLayers.size() - 1) {
+                int lNext = l + 1;
+
+                Hierarchy::pushHistory(state.histories[lNext], 0, state.histories[lNext].size(), state.hiddenCs[l]);
+
+                state.ticks[lNext]++;
+            }
+        }
+    }
+
+    // Backward
+    for (int l = scLayers.size() - 1; l >= 0; l--) {
+        if (state.updates[l]) {
+            // Feed back is current layer state and next higher layer prediction
+            std::vector<const IntBuffer*> feedBackCs(l < scLayers.size() - 1 ? 2 : 1);
+
+            feedBackCs[0] = &state.hiddenCs[l];
+
+            if (l < scLayers.size() - 1)
+                feedBackCs[1] = &state.predHiddenCs[l + 1][ticksPerUpdate[l + 1] - 1 - state.ticks[l + 1]];
+
+            // All predictors of a layer in one launch, over the largest of them
+            Int2 range(0, 0);
+
+            for (int p = 0; p < pLayers[l].size(); p++) {
+                if (!pLayers[l][p].visibleLayers.empty())
+                    range = Int2(std::max(range.x, pLayers[l][p].hiddenSize.x), std::max(range.y, pLayers[l][p].hiddenSize.y));
+            }
+
+            if (range.x > 0)
+                runKernel2(cs, std::bind(FrozenHierarchy::forwardPKernel, std::placeholders::_1, std::placeholders::_2, this, l, feedBackCs, &state), range, cs.rng, cs.batchSize2);
+
+            if (l == 0) {
+                range = Int2(0, 0);
+
+                for (int a = 0; a < aLayers.size(); a++) {
+                    if (!aLayers[a].visibleLayers.empty())
+                        range = Int2(std::max(range.x, aLayers[a].hiddenSize.x), std::max(range.y, aLayers[a].hiddenSize.y));
+                }
+
+                if (range.x > 0)
+                    runKernel2(cs, std::bind(FrozenHierarchy::forwardAKernel, std::placeholders::_1, std::placeholders::_2, this, feedBackCs, &state), range, cs.rng, cs.batchSize2);
+            }
+        }
+    }
+}
+
+void FrozenHierarchy::writeLayerToStream(
+    std::ostream &os,
+    const Layer &layer
+) {
+    os.write(reinterpret_cast<const char*>(&layer.hiddenSize), sizeof(Int3));
+
+    int numVisibleLayers = layer.visibleLayers.size();
+
+    os.write(reinterpret_cast<const char*>(&numVisibleLayers), sizeof(int));
+
+    for (int vli = 0; vli < numVisibleLayers; vli++) {
+        const VisibleLayer &vl = layer.visibleLayers[vli];
+
+        os.write(reinterpret_cast<const char*>(&vl.size), sizeof(Int3));
+        os.write(reinterpret_cast<const char*>(&vl.radius), sizeof(int));
+
+        char shared = vl.shared;
+
+        os.write(&shared, sizeof(char));
+
+        writeBufferToStream(os, &vl.columnRanges);
+        writeBufferToStream(os, &vl.visibleColumns);
+        writeBufferToStream(os, &vl.weights);
+    }
+}
+
+void FrozenHierarchy::readLayerFromStream(
+    std::istream &is,
+    Layer &layer
+) {
+    is.read(reinterpret_cast<char*>(&layer.hiddenSize), sizeof(Int3));
+
+    int numVisibleLayers;
+
+    is.read(reinterpret_cast<char*>(&numVisibleLayers), sizeof(int));
+
+    layer.visibleLayers.resize(numVisibleLayers);
+
+    for (int vli = 0; vli < numVisibleLayers; vli++) {
+        VisibleLayer &vl = layer.visibleLayers[vli];
+
+        is.read(reinterpret_cast<char*>(&vl.size), sizeof(Int3));
+        is.read(reinterpret_cast<char*>(&vl.radius), sizeof(int));
+
+        char shared;
+
+        is.read(&shared, sizeof(char));
+
+        vl.shared = shared;
+
+        readBufferFromStream(is, &vl.columnRanges);
+        readBufferFromStream(is, &vl.visibleColumns);
+        readBufferFromStream(is, &vl.weights);
+    }
+}
+
+void FrozenHierarchy::writeToStream(
+    std::ostream &os
+) const {
+    os.write(reinterpret_cast<const char*>(&frozenStreamVersion), sizeof(int));
+
+    int numLayers = scLayers.size();
+
+    os.write(reinterpret_cast<const char*>(&numLayers), sizeof(int));
+
+    int numInputs = inputSizes.size();
+
+    os.write(reinterpret_cast<const char*>(&numInputs), sizeof(int));
+
+    os.write(reinterpret_cast<const char*>(inputSizes.data()), numInputs * sizeof(Int3));
+    os.write(reinterpret_cast<const char*>(inputTypes.data()), numInputs * sizeof(InputType));
+
+    os.write(reinterpret_cast<const char*>(ticksPerUpdate.data()), numLayers * sizeof(int));
+
+    for (int l = 0; l < numLayers; l++) {
+        writeLayerToStream(os, scLayers[l]);
+
+        int numPLayers = pLayers[l].size();
+
+        os.write(reinterpret_cast<const char*>(&numPLayers), sizeof(int));
+
+        for (int p = 0; p < numPLayers; p++)
+            writeLayerToStream(os, pLayers[l][p]);
+    }
+
+    for (int a = 0; a < numInputs; a++)
+        writeLayerToStream(os, aLayers[a]);
+
+    // Default session
+    os.write(reinterpret_cast<const char*>(state.updates.data()), numLayers * sizeof(char));
+    os.write(reinterpret_cast<const char*>(state.ticks.data()), numLayers * sizeof(int));
+
+    for (int l = 0; l < numLayers; l++) {
+        writeBufferToStream(os, &state.hiddenCs[l]);
+
+        for (int v = 0; v < state.histories[l].size(); v++)
+            writeBufferToStream(os, &state.histories[l][v]);
+
+        for (int p = 0; p < state.predHiddenCs[l].size(); p++)
+            writeBufferToStream(os, &state.predHiddenCs[l][p]);
+    }
+
+    for (int a = 0; a < numInputs; a++)
+        writeBufferToStream(os, &state.actionCs[a]);
+}
+
+void FrozenHierarchy::readFromStream(
+    std::istream &is
+) {
+    int version;
+    is.read(reinterpret_cast<char*>(&version), sizeof(int));
+
+    // Streams of another layout cannot be read
+    if (!is || version != frozenStreamVersion) {
+        is.setstate(std::ios::failbit);
+
+        return;
+    }
+
+    int numLayers;
+
+    is.read(reinterpret_cast<char*>(&numLayers), sizeof(int));
+
+    int numInputs;
+
+    is.read(reinterpret_cast<char*>(&numInputs), sizeof(int));
+
+    inputSizes.resize(numInputs);
+    inputTypes.resize(numInputs);
+
+    is.read(reinterpret_cast<char*>(inputSizes.data()), numInputs * sizeof(Int3));
+    is.read(reinterpret_cast<char*>(inputTypes.data()), numInputs * sizeof(InputType));
+
+    ticksPerUpdate.resize(numLayers);
+
+    is.read(reinterpret_cast<char*>(ticksPerUpdate.data()), numLayers * sizeof(int));
+
+    scLayers.resize(numLayers);
+    pLayers.resize(numLayers);
+
+    for (int l = 0; l < numLayers; l++) {
+        readLayerFromStream(is, scLayers[l]);
+
+        int numPLayers;
+
+        is.read(reinterpret_cast<char*>(&numPLayers), sizeof(int));
+
+        pLayers[l].resize(numPLayers);
+
+        for (int p = 0; p < numPLayers; p++)
+            readLayerFromStream(is, pLayers[l][p]);
+    }
+
+    aLayers.resize(numInputs);
+
+    for (int a = 0; a < numInputs; a++)
+        readLayerFromStream(is, aLayers[a]);
+
+    // Default session, sized like a new one
+    initState(state);
+
+    is.read(reinterpret_cast<char*>(state.updates.data()), numLayers * sizeof(char));
+    is.read(reinterpret_cast<char*>(state.ticks.data()), numLayers * sizeof(int));
+
+    for (int l = 0; l < numLayers; l++) {
+        readBufferFromStream(is, &state.hiddenCs[l]);
+
+        for (int v = 0; v < state.histories[l].size(); v++)
+            readBufferFromStream(is, &state.histories[l][v]);
+
+        for (int p = 0; p < state.predHiddenCs[l].size(); p++)
+            readBufferFromStream(is, &state.predHiddenCs[l][p]);
+    }
+
+    for (int a = 0; a < numInputs; a++)
+        readBufferFromStream(is, &state.actionCs[a]);
+}
@@ -0,0 +1,263 @@
+// ----------------------------------------------------------------------------
+//  OgmaNeo
+//  Copyright(c) 2016-2020 Ogma Intelligent Systems Corp. All rights reserved.
+//
+//  This copy of OgmaNeo is licensed to you under the terms described
+//  in the OGMANEO_LICENSE.md file included in this distribution.
+// ----------------------------------------------------------------------------
+
+#pragma once
+
+#include "Hierarchy.h"
+
+namespace ogmaneo {
+// Inference-only copy of a hierarchy. Keeps only the forward weights, in a per-column layout, and the states needed to step.
+// There are no transposes, previous inputs, actor histories or learning parameters, and step never learns.
+// The weights are read-only, the states live in State objects (sessions). Many sessions can share one model
+class FrozenHierarchy {
+public:
+    // Forward weights of a visible layer
+    struct VisibleLayer {
+        Int3 size; // Visible/input size
+
+        int radius; // Radius onto input
+
+        bool shared; // Whether all hidden columns share one weight kernel (convolutional)
+
+        IntBuffer columnRanges; // Start of the receptive field of each hidden column in visibleColumns (one more than the number of hidden columns)
+        IntBuffer visibleColumns; // Visible columns of the receptive fields, in weight order
+
+        // Weights of each receptive field column, size.z input cells of one weight per hidden cell of the column (contiguous).
+        // Shared kernel (same layout as SparseCoder/Predictor) if shared
+        FloatBuffer weights;
+
+        // Defaults
+        VisibleLayer()
+        :
+        radius(0),
+        shared(false)
+        {}
+    };
+
+    // Forward part of a sparse coder, predictor or actor
+    struct Layer {
+        Int3 hiddenSize; // Hidden/output size
+
+        std::vector<VisibleLayer> visibleLayers;
+    };
+
+private:
+    // Layers
+    std::vector<Layer> scLayers;
+    std::vector<std::vector<Layer>> pLayers; // Entries of inputs without predictions have no visible layers
+    std::vector<Layer> aLayers; // Entries of inputs without actions have no visible layers
+
+    std::vector<int> ticksPerUpdate;
+
+    // Input dimensions and types
+    std::vector<Int3> inputSizes;
+    std::vector<InputType> inputTypes;
+
+    // State of the default session (stepped by step without a state)
+    State state;
+
+    // --- Kernels ---
+
+    void forwardSC(
+        const Int2 &pos,
+        std::mt19937 &rng,
+        int l,
+        State* state
+    ) const;
+
+    void forwardP(
+        const Int2 &pos,
+        std::mt19937 &rng,
+        int l,
+        const std::vector<const IntBuffer*> &inputCs,
+        State* state
+    ) const;
+
+    void forwardA(
+        const Int2 &pos,
+        std::mt19937 &rng,
+        const std::vector<const IntBuffer*> &inputCs,
+        State* state
+    ) const;
+
+    static void forwardSCKernel(
+        const Int2 &pos,
+        std::mt19937 &rng,
+        const FrozenHierarchy* h,
+        int l,
+        State* state
+    ) {
+        h->forwardSC(pos, rng, l, state);
+    }
+
+    static void forwardPKernel(
+        const Int2 &pos,
+        std::mt19937 &rng,
+        const FrozenHierarchy* h,
+        int l,
+        const std::vector<const IntBuffer*> &inputCs,
+        State* state
+    ) {
+        h->forwardP(pos, rng, l, inputCs, state);
+    }
+
+    static void forwardAKernel(
+        const Int2 &pos,
+        std::mt19937 &rng,
+        const FrozenHierarchy* h,
+        const std::vector<const IntBuffer*> &inputCs,
+        State* state
+    ) {
+        h->forwardA(pos, rng, inputCs, state);
+    }
+
+    // Add the weights of the present receptive field columns of a hidden column to sums (numRows per cell). Returns the number of present columns
+    static int accumulate(
+        const VisibleLayer &vl,
+        int hiddenColumnIndex,
+        int numRows,
+        const IntBuffer &inputCs,
+        FloatBuffer &sums
+    );
+
+    // Convert a weight matrix with numRows consecutive rows per hidden column, of which the first numRowsKept are kept
+    static void initVisibleLayer(
+        const SparseMatrix &weights,
+        int numRows,
+        int numRowsKept,
+        VisibleLayer &vl
+    );
+
+    // Drop the parts of a state that inference does not use
+    static void trimState(
+        State &state
+    );
+
+    static void writeLayerToStream(
+        std::ostream &os,
+        const Layer &layer
+    );
+
+    static void readLayerFromStream(
+        std::istream &is,
+        Layer &layer
+    );
+
+public:
+    // Freeze a hierarchy, including its current state. Weight updates not yet committed (mini-batch mode) are not included
+    void init(
+        const Hierarchy &h // Hierarchy to freeze
+    );
+
+    // Simulation step/tick of the default session, without learning
+    void step(
+        ComputeSystem &cs, // Compute system
+        const std::vector<const IntBuffer*> &inputCs // Inputs, as in Hierarchy::step
+    ) {
+        step(cs, state, inputCs);
+    }
+
+    // Simulation step/tick of a session, without learning. The model is not modified, so sessions can be stepped concurrently (with separate compute systems)
+    void step(
+        ComputeSystem &cs, // Compute system
+        State &state, // State of the session
+        const std::vector<const IntBuffer*> &inputCs // Inputs, as in Hierarchy::step
+    ) const;
+
+    // Start a session from a reset state (zero states and ticks, as a new hierarchy)
+    void initState(
+        State &state // State to initialize
+    ) const;
+
+    // Default session state get
+    void getState(
+        State &state
+    ) const {
+        state = this->state;
+    }
+
+    // Default session state set. States of the hierarchy that was frozen (see Hierarchy::getState) also apply
+    void setState(
+        const State &state
+    );
+
+    // Write to stream
+    void writeToStream(
+        std::ostream &os // Stream to write to
+    ) const;
+
+    // Read from stream. Streams of another format version, including Hierarchy streams, are rejected:
+    // the failbit of the stream is set and the frozen hierarchy is left unchanged
+    void readFromStream(
+        std::istream &is // Stream to read from
+    );
+
+    // Get the number of layers (scLayers)
+    int getNumLayers() const {
+        return scLayers.size();
+    }
+
+    // Retrieve predictions of the default session, or actions for action inputs
+    const IntBuffer &getPredictionCs(
+        int i // Index of input layer to get predictions for
+    ) const {
+        return getPredictionCs(state, i);
+    }
+
+    // Retrieve predictions of a session, or actions for action inputs
+    const IntBuffer &getPredictionCs(
+        const State &state, // State of the session
+        int i // Index of input layer to get predictions for
+    ) const {
+        if (inputTypes[i] == action)
+            return state.actionCs[i];
+
+        return state.predHiddenCs.front()[i];
+    }
+
+    // Get the hidden states of a layer (default session)
+    const IntBuffer &getHiddenCs(
+        int l // Layer index
+    ) const {
+        return state.hiddenCs[l];
+    }
+
+    // Whether this layer received on update this timestep (default session)
+    bool getUpdate(
+        int l // Layer index
+    ) const {
+        return state.updates[l];
+    }
+
+    // Get current layer ticks, relative to previous layer (default session)
+    int getTicks(
+        int l // Layer Index
+    ) const {
+        return state.ticks[l];
+    }
+
+    // Get layer ticks per update, relative to previous layer
+    int getTicksPerUpdate(
+        int l // Layer Index
+    ) const {
+        return ticksPerUpdate[l];
+    }
+
+    // Get input sizes
+    const std::vector<Int3> &getInputSizes() const {
+        return inputSizes;
+    }
+
+    // Retrieve a sparse coding layer
+    const Layer &getSCLayer(
+        int l // Layer index
+    ) const {
+        return scLayers[l];
+    }
+};
+} // namespace ogmaneo
@@ -10,6 +10,11 @@
 
 #include "ComputeSystem.h"
 
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
 using namespace ogmaneo;
 
 void ogmaneo::runKernel1(
@@ -109,6 +114,89 @@ void ogmaneo::runKernel3(
     }
 }
 
+void ogmaneo::runKernel2Team(
+    ComputeSystem &cs,
+    const std::function<void(const Int2 &, std::mt19937 &, int)> &func,
+    const std::function<void(int)> &begin,
+    const Int2 &size,
+    std::mt19937 &rng,
+    const Int2 &batchSize
+) {
+    std::uniform_int_distribution<int> seedDist(0, 999999);
+
+    // Ceil divide
+    Int2 batches((size.x + batchSize.x - 1) / batchSize.x, (size.y + batchSize.y - 1) / batchSize.y);
+
+    int totalBatches = batches.x * batches.y;
+
+    #pragma omp parallel
+    {
+        // Implicit barrier, no item runs before the team is prepared
+        #pragma omp single
+        begin(omp_get_num_threads());
+
+        int t = omp_get_thread_num();
+
+        #pragma omp for
+        for (int i = 0; i < totalBatches; i++) {
+            int bx = i % batches.x;
+            int by = (i / batches.x) % batches.y;
+
+            Int2 itemBatchSize = Int2(std::min(size.x - bx * batchSize.x, batchSize.x), std::min(size.y - by * batchSize.y, batchSize.y));
+
+            std::mt19937 subRng(seedDist(rng));
+            Int2 pos(bx * batchSize.x, by * batchSize.y);
+
+            for (int x = 0; x < itemBatchSize.x; x++)
+                for (int y = 0; y < itemBatchSize.y; y++) {
+                    Int2 bPos;
+                    bPos.x = pos.x + x;
+                    bPos.y = pos.y + y;
+
+                    func(bPos, subRng, t);
+                }
+        }
+    }
+}
+
+void ogmaneo::runKernel1BalancedTeam(
+    ComputeSystem &cs,
+    const std::function<void(int, std::mt19937 &, int)> &func,
+    const std::function<void(int)> &begin,
+    const IntBuffer &workSums,
+    std::mt19937 &rng
+) {
+    std::uniform_int_distribution<int> seedDist(0, 999999);
+
+    int size = workSums.size() - 1;
+
+    // A few batches per thread so that estimation error in the work can still be balanced out
+    int batches = std::max(0, std::min(size, omp_get_max_threads() * 4));
+
+    int totalWork = workSums.back();
+
+    #pragma omp parallel
+    {
+        // Implicit barrier, no item runs before the team is prepared
+        #pragma omp single
+        begin(omp_get_num_threads());
+
+        int t = omp_get_thread_num();
+
+        #pragma omp for
+        for (int i = 0; i < batches; i++) {
+            // Items whose work starts in [i, i + 1) * totalWork / batches
+            int start = std::lower_bound(workSums.begin(), workSums.end() - 1, static_cast<int>(static_cast<long long>(i) * totalWork / batches)) - workSums.begin();
+            int end = i == batches - 1 ? size : std::lower_bound(workSums.begin(), workSums.end() - 1, static_cast<int>(static_cast<long long>(i + 1) * totalWork / batches)) - workSums.begin();
+
+            std::mt19937 subRng(seedDist(rng));
+
+            for (int x = start; x < end; x++)
+                func(x, subRng, t);
+        }
+    }
+}
+
 void ogmaneo::fillInt(
     int pos,
     std::mt19937 &rng,
@@ -312,6 +400,285 @@ void ogmaneo::initSMLocalRF(
     mat.columns = inSize.x * inSize.y * inSize.z;
 }
 
+float ogmaneo::multiplySharedOHVs(
+    const FloatBuffer &kernel,
+    const IntBuffer &nonZeroIndices,
+    const Int3 &outPos,
+    const Int3 &inSize,
+    const Int3 &outSize,
+    int radius,
+    int &count
+) {
+    Float2 outToIn = Float2(static_cast<float>(inSize.x) / static_cast<float>(outSize.x),
+        static_cast<float>(inSize.y) / static_cast<float>(outSize.y));
+
+    int diam = radius * 2 + 1;
+
+    Int2 visiblePositionCenter = project(Int2(outPos.x, outPos.y), outToIn);
+
+    Int2 iterLowerBound(std::max(0, visiblePositionCenter.x - radius), std::max(0, visiblePositionCenter.y - radius));
+    Int2 iterUpperBound(std::min(inSize.x - 1, visiblePositionCenter.x + radius), std::min(inSize.y - 1, visiblePositionCenter.y + radius));
+
+    int kernelStart = outPos.z * diam * diam * inSize.z;
+
+    float sum = 0.0f;
+
+    count = 0;
+
+    for (int ix = iterLowerBound.x; ix <= iterUpperBound.x; ix++)
+        for (int iy = iterLowerBound.y; iy <= iterUpperBound.y; iy++) {
+            int inC = nonZeroIndices[address2(Int2(ix, iy), Int2(inSize.x, inSize.y))];
+
+            // Absent input column
+            if (inC < 0)
+                continue;
+
+            Int2 offset(ix - visiblePositionCenter.x + radius, iy - visiblePositionCenter.y + radius);
+
+            sum += kernel[kernelStart + inC + (offset.y + offset.x * diam) * inSize.z];
+
+            count++;
+        }
+
+    return sum;
+}
+
+void ogmaneo::deltaSharedOHVs(
+    FloatBuffer &kernelDeltas,
+    const IntBuffer &nonZeroIndices,
+    float delta,
+    const Int3 &outPos,
+    const Int3 &inSize,
+    const Int3 &outSize,
+    int radius
+) {
+    Float2 outToIn = Float2(static_cast<float>(inSize.x) / static_cast<float>(outSize.x),
+        static_cast<float>(inSize.y) / static_cast<float>(outSize.y));
+
+    int diam = radius * 2 + 1;
+
+    Int2 visiblePositionCenter = project(Int2(outPos.x, outPos.y), outToIn);
+
+    Int2 iterLowerBound(std::max(0, visiblePositionCenter.x - radius), std::max(0, visiblePositionCenter.y - radius));
+    Int2 iterUpperBound(std::min(inSize.x - 1, visiblePositionCenter.x + radius), std::min(inSize.y - 1, visiblePositionCenter.y + radius));
+
+    int kernelStart = outPos.z * diam * diam * inSize.z;
+
+    for (int ix = iterLowerBound.x; ix <= iterUpperBound.x; ix++)
+        for (int iy = iterLowerBound.y; iy <= iterUpperBound.y; iy++) {
+            int inC = nonZeroIndices[address2(Int2(ix, iy), Int2(inSize.x, inSize.y))];
+
+            // Absent input column
+            if (inC < 0)
+                continue;
+
+            Int2 offset(ix - visiblePositionCenter.x + radius, iy - visiblePositionCenter.y + radius);
+
+            kernelDeltas[kernelStart + inC + (offset.y + offset.x * diam) * inSize.z] += delta;
+        }
+}
+
+float ogmaneo::multiplySharedOHVsT(
+    const FloatBuffer &kernel,
+    const IntBuffer &nonZeroIndices,
+    const Int3 &inPos,
+    const Int3 &inSize,
+    const Int3 &outSize,
+    int radius,
+    int &count
+) {
+    Float2 outToIn = Float2(static_cast<float>(inSize.x) / static_cast<float>(outSize.x),
+        static_cast<float>(inSize.y) / static_cast<float>(outSize.y));
+
+    Float2 inToOut = Float2(1.0f / outToIn.x, 1.0f / outToIn.y);
+
+    int diam = radius * 2 + 1;
+
+    // Conservative range of output columns, filtered with the forward projection below
+    Int2 iterLowerBound(std::max(0, static_cast<int>(std::floor((inPos.x - radius - 0.5f) * inToOut.x)) - 1), std::max(0, static_cast<int>(std::floor((inPos.y - radius - 0.5f) * inToOut.y)) - 1));
+    Int2 iterUpperBound(std::min(outSize.x - 1, static_cast<int>(std::ceil((inPos.x + radius + 0.5f) * inToOut.x)) + 1), std::min(outSize.y - 1, static_cast<int>(std::ceil((inPos.y + radius + 0.5f) * inToOut.y)) + 1));
+
+    float sum = 0.0f;
+
+    count = 0;
+
+    for (int ox = iterLowerBound.x; ox <= iterUpperBound.x; ox++)
+        for (int oy = iterLowerBound.y; oy <= iterUpperBound.y; oy++) {
+            Int2 visiblePositionCenter = project(Int2(ox, oy), outToIn);
+
+            Int2 offset(inPos.x - visiblePositionCenter.x + radius, inPos.y - visiblePositionCenter.y + radius);
+
+            if (!inBounds0(offset, Int2(diam, diam)))
+                continue;
+
+            int outC = nonZeroIndices[address2(Int2(ox, oy), Int2(outSize.x, outSize.y))];
+
+            sum += kernel[inPos.z + (offset.y + offset.x * diam + outC * diam * diam) * inSize.z];
+
+            count++;
+        }
+
+    return sum;
+}
+
+void ogmaneo::deltaSharedOHVsT(
+    FloatBuffer &kernelDeltas,
+    const IntBuffer &nonZeroIndices,
+    float delta,
+    const Int3 &inPos,
+    const Int3 &inSize,
+    const Int3 &outSize,
+    int radius
+) {
+    Float2 outToIn = Float2(static_cast<float>(inSize.x) / static_cast<float>(outSize.x),
+        static_cast<float>(inSize.y) / static_cast<float>(outSize.y));
+
+    Float2 inToOut = Float2(1.0f / outToIn.x, 1.0f / outToIn.y);
+
+    int diam = radius * 2 + 1;
+
+    // Conservative range of output columns, filtered with the forward projection below
+    Int2 iterLowerBound(std::max(0, static_cast<int>(std::floor((inPos.x - radius - 0.5f) * inToOut.x)) - 1), std::max(0, static_cast<int>(std::floor((inPos.y - radius - 0.5f) * inToOut.y)) - 1));
+    Int2 iterUpperBound(std::min(outSize.x - 1, static_cast<int>(std::ceil((inPos.x + radius + 0.5f) * inToOut.x)) + 1), std::min(outSize.y - 1, static_cast<int>(std::ceil((inPos.y + radius + 0.5f) * inToOut.y)) + 1));
+
+    for (int ox = iterLowerBound.x; ox <= iterUpperBound.x; ox++)
+        for (int oy = iterLowerBound.y; oy <= iterUpperBound.y; oy++) {
+            Int2 visiblePositionCenter = project(Int2(ox, oy), outToIn);
+
+            Int2 offset(inPos.x - visiblePositionCenter.x + radius, inPos.y - visiblePositionCenter.y + radius);
+
+            if (!inBounds0(offset, Int2(diam, diam)))
+                continue;
+
+            int outC = nonZeroIndices[address2(Int2(ox, oy), Int2(outSize.x, outSize.y))];
+
+            kernelDeltas[inPos.z + (offset.y + offset.x * diam + outC * diam * diam) * inSize.z] += delta;
+        }
+}
+
+void ogmaneo::remapCs(
+    IntBuffer &cs,
+    const IntBuffer &cellMap,
+    int size
+) {
+    for (int i = 0; i < cs.size(); i++)
+        cs[i] = remapC(cellMap, i, size, cs[i]);
+}
+
+IntBuffer ogmaneo::cellMapToIndexMap(
+    const IntBuffer &cellMap,
+    int size,
+    int newSize
+) {
+    IntBuffer indexMap(cellMap.size());
+
+    for (int i = 0; i < cellMap.size(); i++)
+        indexMap[i] = cellMap[i] < 0 ? -1 : cellMap[i] + (i / size) * newSize;
+
+    return indexMap;
+}
+
+void ogmaneo::remapSharedKernel(
+    FloatBuffer &kernel,
+    const IntBuffer &inCellMap,
+    int newInZ,
+    const IntBuffer &outCellMap,
+    int newOutZ,
+    int radius
+) {
+    int diam = radius * 2 + 1;
+    int area = diam * diam;
+
+    int inZ = inCellMap.size();
+    int outZ = outCellMap.size();
+
+    FloatBuffer newKernel(newOutZ * area * newInZ);
+
+    for (int oc = 0; oc < outZ; oc++) {
+        if (outCellMap[oc] < 0)
+            continue;
+
+        for (int o = 0; o < area; o++)
+            for (int ic = 0; ic < inZ; ic++) {
+                if (inCellMap[ic] < 0)
+                    continue;
+
+                newKernel[inCellMap[ic] + (o + outCellMap[oc] * area) * newInZ] = kernel[ic + (o + oc * area) * inZ];
+            }
+    }
+
+    kernel = newKernel;
+}
+
+IntBuffer ogmaneo::identityCellMap(
+    int size
+) {
+    IntBuffer cellMap(size);
+
+    for (int c = 0; c < size; c++)
+        cellMap[c] = c;
+
+    return cellMap;
+}
+
+void ogmaneo::packCs(
+    const IntBuffer &cs,
+    int stateSize,
+    unsigned char* packed
+) {
+    switch (stateSize) {
+    case 1:
+        for (int i = 0; i < cs.size(); i++) {
+            assert(cs[i] >= 0 && cs[i] < 256);
+
+            packed[i] = static_cast<unsigned char>(cs[i]);
+        }
+
+        break;
+    case 2:
+        for (int i = 0; i < cs.size(); i++) {
+            assert(cs[i] >= 0 && cs[i] < 65536);
+
+            std::uint16_t c = static_cast<std::uint16_t>(cs[i]);
+
+            std::memcpy(&packed[i * 2], &c, 2);
+        }
+
+        break;
+    default:
+        std::memcpy(packed, cs.data(), cs.size() * sizeof(int));
+    }
+}
+
+void ogmaneo::unpackCs(
+    const unsigned char* packed,
+    int numColumns,
+    int stateSize,
+    IntBuffer &cs
+) {
+    cs.resize(numColumns);
+
+    switch (stateSize) {
+    case 1:
+        for (int i = 0; i < cs.size(); i++)
+            cs[i] = packed[i];
+
+        break;
+    case 2:
+        for (int i = 0; i < cs.size(); i++) {
+            std::uint16_t c;
+
+            std::memcpy(&c, &packed[i * 2], 2);
+
+            cs[i] = c;
+        }
+
+        break;
+    default:
+        std::memcpy(cs.data(), packed, numColumns * sizeof(int));
+    }
+}
+
 void ogmaneo::writeSMToStream(
     std::ostream &os,
     const SparseMatrix &mat
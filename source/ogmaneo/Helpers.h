@@ -81,6 +81,7 @@ typedef Vec4<float> Float4;
 
 typedef std::vector<int> IntBuffer;
 typedef std::vector<float> FloatBuffer;
+typedef std::vector<unsigned char> ByteBuffer;
 
 // --- Kernel Executors ---
 
@@ -109,6 +110,26 @@ void runKernel3(
     const Int3 &batchSize // Batch size
 );
 
+// Run 2D kernel in one team of threads, for kernels that accumulate into per-thread buffers.
+// begin receives the size of the team that runs the launch (not omp_get_max_threads, which can differ), func the index of its thread in that team
+void runKernel2Team(
+    ComputeSystem &cs, // Compute system
+    const std::function<void(const Int2 &, std::mt19937 &rng, int t)> &func, // Kernel function, t is the thread index in the team
+    const std::function<void(int numThreads)> &begin, // Called once with the team size before any item runs
+    const Int2 &size, // Execution extent size
+    std::mt19937 &rng, // Generator
+    const Int2 &batchSize // Batch size
+);
+
+// Run 1D kernel with batches of approximately equal work in one team of threads, see runKernel2Team
+void runKernel1BalancedTeam(
+    ComputeSystem &cs, // Compute system
+    const std::function<void(int, std::mt19937 &rng, int t)> &func, // Kernel function, t is the thread index in the team
+    const std::function<void(int numThreads)> &begin, // Called once with the team size before any item runs
+    const IntBuffer &workSums, // Exclusive prefix sum of per-item work, one entry more than the execution extent size
+    std::mt19937 &rng // Generator
+);
+
 // --- Basic Kernels ---
 
 // Copy kernel
@@ -250,6 +271,32 @@ inline float sigmoid(
     return 1.0f / (1.0f + std::exp(-x));
 }
 
+// --- Learning Schedules ---
+
+// Whether a column learns this step when only a fraction of columns learn per step.
+// Each column accumulates credit at the given rate and learns once it reaches 1, so every column learns equally often.
+// Negative credit means unscheduled, in which case the column gets a random phase
+inline bool learnTurn(
+    float &credit, // Credit of the column
+    float fraction, // Fraction of columns learning per step
+    std::mt19937 &rng // Random number generator
+) {
+    if (credit < 0.0f) {
+        std::uniform_real_distribution<float> phaseDist(0.0f, 1.0f);
+
+        credit = phaseDist(rng);
+    }
+
+    credit += fraction;
+
+    if (credit < 1.0f)
+        return false;
+
+    credit -= 1.0f;
+
+    return true;
+}
+
 // --- Serialization ---
 
 template <class T>
@@ -294,6 +341,134 @@ void initSMLocalRF(
     SparseMatrix &mat // Matrix to fill
 );
 
+// --- Shared (Convolutional) Weights ---
+
+// Shared kernels hold one weight per (output cell, receptive field offset, input cell), laid out as [outCell][dx][dy][inCell].
+// Receptive fields match initSMLocalRF, border columns use the in-bounds part of the kernel. Negative input indices mark absent columns and are skipped
+
+// Number of weights in a shared kernel
+inline int sharedKernelSize(
+    const Int3 &inSize, // Size of input field
+    const Int3 &outSize, // Size of output field
+    int radius // Radius of output onto input
+) {
+    int diam = radius * 2 + 1;
+
+    return outSize.z * diam * diam * inSize.z;
+}
+
+// Sum of the kernel weights onto one-hot inputs, for one output cell
+float multiplySharedOHVs(
+    const FloatBuffer &kernel, // Shared kernel
+    const IntBuffer &nonZeroIndices, // One-hot input indices
+    const Int3 &outPos, // Output cell position
+    const Int3 &inSize, // Size of input field
+    const Int3 &outSize, // Size of output field
+    int radius, // Radius of output onto input
+    int &count // Number of present input columns in the receptive field (output)
+);
+
+// Accumulate a delta onto the kernel weights of one-hot inputs, for one output cell
+void deltaSharedOHVs(
+    FloatBuffer &kernelDeltas, // Kernel-sized delta accumulator
+    const IntBuffer &nonZeroIndices, // One-hot input indices
+    float delta, // Delta to add
+    const Int3 &outPos, // Output cell position
+    const Int3 &inSize, // Size of input field
+    const Int3 &outSize, // Size of output field
+    int radius // Radius of output onto input
+);
+
+// Sum of the kernel weights from one-hot outputs onto an input cell (transpose)
+float multiplySharedOHVsT(
+    const FloatBuffer &kernel, // Shared kernel
+    const IntBuffer &nonZeroIndices, // One-hot output indices
+    const Int3 &inPos, // Input cell position
+    const Int3 &inSize, // Size of input field
+    const Int3 &outSize, // Size of output field
+    int radius, // Radius of output onto input
+    int &count // Number of output columns whose receptive field contains the input column (output)
+);
+
+// Accumulate a delta onto the kernel weights from one-hot outputs onto an input cell (transpose)
+void deltaSharedOHVsT(
+    FloatBuffer &kernelDeltas, // Kernel-sized delta accumulator
+    const IntBuffer &nonZeroIndices, // One-hot output indices
+    float delta, // Delta to add
+    const Int3 &inPos, // Input cell position
+    const Int3 &inSize, // Size of input field
+    const Int3 &outSize, // Size of output field
+    int radius // Radius of output onto input
+);
+
+// --- Compaction ---
+
+// Cell maps hold, for every cell of a field, the new index of the cell within its column or -1 if the cell is removed.
+// Kept cells must stay in their original order
+
+// New state of a column after compaction, removed cells map to the first kept cell
+inline int remapC(
+    const IntBuffer &cellMap, // Cell map
+    int columnIndex, // Index of the column
+    int size, // Column size before compaction
+    int c // State before compaction
+) {
+    return std::max(0, cellMap[c + columnIndex * size]);
+}
+
+// Remap every column state of a buffer
+void remapCs(
+    IntBuffer &cs, // States to remap
+    const IntBuffer &cellMap, // Cell map
+    int size // Column size before compaction
+);
+
+// Convert a cell map to a map of flat cell indices (address3 ordering) for sparse matrix rows or columns
+IntBuffer cellMapToIndexMap(
+    const IntBuffer &cellMap, // Cell map
+    int size, // Column size before compaction
+    int newSize // Column size after compaction
+);
+
+// Remove input and output cells from a shared kernel. Maps cover a single column, as shared kernels are the same for every column
+void remapSharedKernel(
+    FloatBuffer &kernel, // Shared kernel
+    const IntBuffer &inCellMap, // Input cell map of one column
+    int newInZ, // Input column size after compaction
+    const IntBuffer &outCellMap, // Output cell map of one column
+    int newOutZ, // Output column size after compaction
+    int radius // Radius of output onto input
+);
+
+// Identity cell map for a column of the given size
+IntBuffer identityCellMap(
+    int size // Column size
+);
+
+// --- Packed States ---
+
+// Number of bytes per packed state for columns of the given size (1, 2 or 4)
+inline int packedStateSize(
+    int size // Column size
+) {
+    return size <= 256 ? 1 : (size <= 65536 ? 2 : 4);
+}
+
+// Pack column states into stateSize bytes each. States must fit, 4 bytes also holds negative states
+void packCs(
+    const IntBuffer &cs, // States to pack
+    int stateSize, // Bytes per state, from packedStateSize
+    unsigned char* packed // Packed states, cs.size() * stateSize bytes
+);
+
+// Unpack column states packed with packCs
+void unpackCs(
+    const unsigned char* packed, // Packed states
+    int numColumns, // Number of states
+    int stateSize, // Bytes per state, from packedStateSize
+    IntBuffer &cs // Unpacked states
+);
+
 // --- Sparse Matrix Serialization ---
 
 void writeSMToStream(
@@ -9,16 +9,23 @@
 #include "Hierarchy.h"
 
 #include <algorithm>
+#include <chrono>
 #include <assert.h>
 
 using namespace ogmaneo;
 
+// Format version of hierarchy streams, written first. Change it whenever the stream layout of the hierarchy or its layers changes.
+// The high bits tag the stream, so older streams (which begin with the layer count) never match
+const int streamVersion = 0x4f480001;
+
 void Hierarchy::initRandom(
     ComputeSystem &cs,
     const std::vector<Int3> &inputSizes,
     const std::vector<InputType> &inputTypes,
     const std::vector<LayerDesc> &layerDescs
 ) {
+    waitLearning();
+
     // Create layers
     scLayers.resize(layerDescs.size());
     pLayers.resize(layerDescs.size());
@@ -27,6 +34,8 @@ void Hierarchy::initRandom(
 
     histories.resize(layerDescs.size());
     historySizes.resize(layerDescs.size());
+    historyHeads.assign(layerDescs.size(), 0);
+    historyCs.resize(layerDescs.size());
     
     ticksPerUpdate.resize(layerDescs.size());
 
@@ -60,6 +69,7 @@ void Hierarchy::initRandom(
 
                     scVisibleLayerDescs[index].size = inputSizes[i];
                     scVisibleLayerDescs[index].radius = layerDescs[l].ffRadius;
+                    scVisibleLayerDescs[index].shared = layerDescs[l].ffShared;
                 }
             }
             
@@ -69,7 +79,7 @@ void Hierarchy::initRandom(
 
                 int inSize = inputSizes[i].x * inputSizes[i].y;
 				
-				histories[l][v] = std::make_shared<IntBuffer>(inSize, 0);
+				histories[l][v] = IntBuffer(inSize, 0);
 
                 historySizes[l][v] = inSize;
 			}
@@ -83,6 +93,7 @@ void Hierarchy::initRandom(
 
             pVisibleLayerDescs[0].size = layerDescs[l].hiddenSize;
             pVisibleLayerDescs[0].radius = layerDescs[l].pRadius;
+            pVisibleLayerDescs[0].shared = layerDescs[l].pShared;
 
             if (l < scLayers.size() - 1)
                 pVisibleLayerDescs.push_back(pVisibleLayerDescs[0]);
@@ -106,7 +117,9 @@ void Hierarchy::initRandom(
                 else if (inputTypes[p] == InputType::action) {
                     aLayers[p] = std::make_unique<Actor>();
 
-                    aLayers[p]->initRandom(cs, inputSizes[p], layerDescs[l].historyCapacity, aVisibleLayerDescs);
+                    std::string historyPath = layerDescs[l].historyPath.empty() ? "" : layerDescs[l].historyPath + "." + std::to_string(p);
+
+                    aLayers[p]->initRandom(cs, inputSizes[p], layerDescs[l].historyCapacity, aVisibleLayerDescs, historyPath);
                 }
             }
         }
@@ -116,12 +129,13 @@ void Hierarchy::initRandom(
             for (int t = 0; t < layerDescs[l].temporalHorizon; t++) {
                 scVisibleLayerDescs[t].size = layerDescs[l - 1].hiddenSize;
                 scVisibleLayerDescs[t].radius = layerDescs[l].ffRadius;
+                scVisibleLayerDescs[t].shared = layerDescs[l].ffShared;
             }
 
             int inSize = layerDescs[l - 1].hiddenSize.x * layerDescs[l - 1].hiddenSize.y;
 
 			for (int v = 0; v < histories[l].size(); v++) {
-                histories[l][v] = std::make_shared<IntBuffer>(inSize, 0);
+                histories[l][v] = IntBuffer(inSize, 0);
 
                 historySizes[l][v] = inSize;
             }
@@ -133,6 +147,7 @@ void Hierarchy::initRandom(
 
             pVisibleLayerDescs[0].size = layerDescs[l].hiddenSize;
             pVisibleLayerDescs[0].radius = layerDescs[l].pRadius;
+            pVisibleLayerDescs[0].shared = layerDescs[l].pShared;
 
             if (l < scLayers.size() - 1)
                 pVisibleLayerDescs.push_back(pVisibleLayerDescs[0]);
@@ -145,25 +160,77 @@ void Hierarchy::initRandom(
             }
         }
 		
+        updateHistoryCs(l);
+
         // Create the sparse coding layer
         scLayers[l].initRandom(cs, layerDescs[l].hiddenSize, scVisibleLayerDescs);
     }
+
+    historyChanges.resize(histories.front().size());
+    historyChangesValid.assign(histories.front().size(), false);
+
+    // Statistics are kept per layer
+    setTargetStepPeriod(targetStepPeriod);
+}
+
+void Hierarchy::waitCommits() const {
+    // Learning may start commits
+    waitLearning();
+
+    for (int l = 0; l < scLayers.size(); l++) {
+        scLayers[l].waitCommit();
+
+        for (int v = 0; v < pLayers[l].size(); v++) {
+            if (pLayers[l][v] != nullptr)
+                pLayers[l][v]->waitCommit();
+        }
+    }
 }
 
 const Hierarchy &Hierarchy::operator=(
     const Hierarchy &other
 ) {
+    // Background commits must finish before the weights are copied, and learning before they are replaced
+    other.waitCommits();
+
+    waitLearning();
+
     // Layers
     scLayers = other.scLayers;
 
+    histories = other.histories;
     historySizes = other.historySizes;
+    historyHeads = other.historyHeads;
     updates = other.updates;
     ticks = other.ticks;
     ticksPerUpdate = other.ticksPerUpdate;
     inputSizes = other.inputSizes;
 
+    eventDriven = other.eventDriven;
+    historyChanges = other.historyChanges;
+    historyChangesValid = other.historyChangesValid;
+
+    lazyPredictions = other.lazyPredictions;
+
+    asyncLearning = other.asyncLearning;
+
+    targetStepPeriod = other.targetStepPeriod;
+    dutySmoothing = other.dutySmoothing;
+    dutyCut = other.dutyCut;
+    dutyRestore = other.dutyRestore;
+    dutyHeadroom = other.dutyHeadroom;
+    dutyFloor = other.dutyFloor;
+    dutyCycle = other.dutyCycle;
+    meanStepTime = other.meanStepTime;
+    learnCredits = other.learnCredits;
+    learnedUpdates = other.learnedUpdates;
+    skippedUpdates = other.skippedUpdates;
+
+    amortizedUpdates = other.amortizedUpdates;
+    pendingUpdates = other.pendingUpdates;
+
     pLayers.resize(other.pLayers.size());
-    histories.resize(other.histories.size());
+    historyCs.resize(histories.size());
 
     for (int l = 0; l < scLayers.size(); l++) {
         pLayers[l].resize(other.pLayers[l].size());
@@ -178,13 +245,8 @@ const Hierarchy &Hierarchy::operator=(
                 pLayers[l][v] = nullptr;
         }
 
-        histories[l].resize(other.histories[l].size());
-
-        for (int v = 0; v < histories[l].size(); v++) {
-            histories[l][v] = std::make_unique<IntBuffer>();
-            
-            (*histories[l][v]) = (*other.histories[l][v]);
-        }
+        // Point at this hierarchy's slots
+        updateHistoryCs(l);
     }
 
     aLayers.resize(inputSizes.size());
@@ -202,15 +264,234 @@ const Hierarchy &Hierarchy::operator=(
     return *this;
 }
 
-void Hierarchy::step(
+void Hierarchy::setEventDriven(
+    bool eventDriven
+) {
+    // Change lists are unknown until each history slot has been filled in event-driven mode
+    if (eventDriven && !this->eventDriven)
+        historyChangesValid.assign(historyChangesValid.size(), false);
+
+    this->eventDriven = eventDriven;
+}
+
+int Hierarchy::compact(
+    int l,
+    int minUsage
+) {
+    waitLearning();
+
+    const Int3 &hiddenSize = scLayers[l].getHiddenSize();
+
+    int numHiddenColumns = hiddenSize.x * hiddenSize.y;
+    int numHidden = numHiddenColumns * hiddenSize.z;
+
+    const IntBuffer &usages = scLayers[l].getHiddenUsages();
+
+    if (usages.size() != numHidden)
+        return hiddenSize.z;
+
+    // Shared kernels require the same cells to be kept in every column
+    bool global = scLayers[l].hasSharedLayers() || (l < scLayers.size() - 1 && scLayers[l + 1].hasSharedLayers());
+
+    for (int l2 = l; l2 < std::min<int>(l + 2, scLayers.size()); l2++) {
+        for (int p = 0; p < pLayers[l2].size(); p++) {
+            if (pLayers[l2][p] != nullptr && pLayers[l2][p]->hasSharedLayers())
+                global = true;
+        }
+    }
+
+    // Usages of the groups of cells that are kept or removed together
+    int numGroups = global ? 1 : numHiddenColumns;
+
+    IntBuffer groupUsages(numGroups * hiddenSize.z, 0);
+
+    for (int i = 0; i < numHidden; i++) {
+        int group = global ? 0 : i / hiddenSize.z;
+
+        groupUsages[i % hiddenSize.z + group * hiddenSize.z] += usages[i];
+    }
+
+    // Every column keeps as many cells as the column with the most live cells
+    int newZ = 1;
+
+    for (int g = 0; g < numGroups; g++) {
+        int numLive = 0;
+
+        for (int c = 0; c < hiddenSize.z; c++) {
+            if (groupUsages[c + g * hiddenSize.z] >= minUsage)
+                numLive++;
+        }
+
+        newZ = std::max(newZ, numLive);
+    }
+
+    if (newZ == hiddenSize.z)
+        return newZ;
+
+    IntBuffer groupMap(numGroups * hiddenSize.z);
+
+    std::vector<int> order(hiddenSize.z);
+
+    for (int g = 0; g < numGroups; g++) {
+        // Keep the most used cells, then restore their original order
+        for (int c = 0; c < hiddenSize.z; c++)
+            order[c] = c;
+
+        std::stable_sort(order.begin(), order.end(), [&](int a, int b) {
+            return groupUsages[a + g * hiddenSize.z] > groupUsages[b + g * hiddenSize.z];
+        });
+
+        std::sort(order.begin(), order.begin() + newZ);
+
+        for (int c = 0; c < hiddenSize.z; c++)
+            groupMap[c + g * hiddenSize.z] = -1;
+
+        for (int c = 0; c < newZ; c++)
+            groupMap[order[c] + g * hiddenSize.z] = c;
+    }
+
+    IntBuffer cellMap(numHidden);
+
+    for (int i = 0; i < numHidden; i++) {
+        int group = global ? 0 : i / hiddenSize.z;
+
+        cellMap[i] = groupMap[i % hiddenSize.z + group * hiddenSize.z];
+    }
+
+    int oldZ = hiddenSize.z;
+
+    scLayers[l].remapHidden(cellMap, newZ);
+
+    // Predictors of this layer read its hidden states (and feedback predictions of the same size)
+    for (int p = 0; p < pLayers[l].size(); p++) {
+        if (pLayers[l][p] != nullptr) {
+            for (int vli = 0; vli < pLayers[l][p]->getNumVisibleLayers(); vli++)
+                pLayers[l][p]->remapVisible(vli, cellMap, newZ);
+        }
+    }
+
+    if (l == 0) {
+        for (int a = 0; a < aLayers.size(); a++) {
+            if (aLayers[a] != nullptr) {
+                for (int vli = 0; vli < aLayers[a]->getNumVisibleLayers(); vli++)
+                    aLayers[a]->remapVisible(vli, cellMap, newZ);
+            }
+        }
+    }
+
+    // Next layer encodes the history of this layer's states, its predictors predict them
+    if (l < scLayers.size() - 1) {
+        for (int vli = 0; vli < scLayers[l + 1].getNumVisibleLayers(); vli++)
+            scLayers[l + 1].remapVisible(vli, cellMap, newZ);
+
+        for (int i = 0; i < histories[l + 1].size(); i++)
+            remapCs(histories[l + 1][i], cellMap, oldZ);
+
+        for (int p = 0; p < pLayers[l + 1].size(); p++)
+            pLayers[l + 1][p]->remapHidden(cellMap, newZ);
+    }
+
+    return newZ;
+}
+
+void Hierarchy::setLazyPredictions(
+    bool lazyPredictions
+) {
+    // Predictions deferred so far are still computed on request
+    this->lazyPredictions = lazyPredictions;
+}
+
+void Hierarchy::fillInputs(
+    const std::vector<const IntBuffer*> &inputCs,
+    const std::vector<const IntBuffer*> &actionCsPrev,
+    std::vector<IntBuffer> &substituteCs,
+    std::vector<const IntBuffer*> &filledCs
+) const {
+    // Absent inputs are stored as absent (negative) columns. Absent actions are replaced by the actor's own previous action
+    substituteCs.resize(inputSizes.size());
+    filledCs = inputCs;
+
+    for (int i = 0; i < inputSizes.size(); i++) {
+        int numColumns = inputSizes[i].x * inputSizes[i].y;
+
+        if (aLayers[i] != nullptr) {
+            bool masked = inputCs[i] == nullptr;
+
+            for (int j = 0; !masked && j < numColumns; j++)
+                masked = (*inputCs[i])[j] < 0;
+
+            if (!masked)
+                continue;
+
+            substituteCs[i] = inputCs[i] == nullptr ? *actionCsPrev[i] : *inputCs[i];
+
+            for (int j = 0; j < numColumns; j++) {
+                if (substituteCs[i][j] < 0)
+                    substituteCs[i][j] = (*actionCsPrev[i])[j];
+            }
+
+            filledCs[i] = &substituteCs[i];
+        }
+        else if (inputCs[i] == nullptr) {
+            substituteCs[i] = IntBuffer(numColumns, -1);
+
+            filledCs[i] = &substituteCs[i];
+        }
+    }
+}
+
+std::vector<const IntBuffer*> Hierarchy::getActionCsPrev(
+    int e
+) const {
+    std::vector<const IntBuffer*> actionCsPrev(aLayers.size(), nullptr);
+
+    for (int i = 0; i < aLayers.size(); i++) {
+        if (aLayers[i] != nullptr)
+            actionCsPrev[i] = &aLayers[i]->getHiddenCs(e);
+    }
+
+    return actionCsPrev;
+}
+
+void Hierarchy::advanceHistory(
+    int l
+) {
+    int temporalHorizon = l == 0 ? histories[l].size() / inputSizes.size() : histories[l].size();
+
+    historyHeads[l] = (historyHeads[l] + temporalHorizon - 1) % temporalHorizon;
+
+    updateHistoryCs(l);
+}
+
+void Hierarchy::updateHistoryCs(
+    int l
+) {
+    historyCs[l].resize(histories[l].size());
+
+    for (int v = 0; v < histories[l].size(); v++)
+        historyCs[l][v] = &histories[l][historyIndex(l, v)];
+}
+
+void Hierarchy::pushHistory(
+    std::vector<IntBuffer> &history,
+    int start,
+    int size,
+    const IntBuffer &inputCs
+) {
+    // Swapping moves the buffers, the oldest ends up in front to be overwritten
+    for (int t = size - 1; t > 0; t--)
+        std::swap(history[start + t], history[start + t - 1]);
+
+    std::copy(inputCs.begin(), inputCs.end(), history[start].begin());
+}
+
+void Hierarchy::stepLayers(
     ComputeSystem &cs,
     const std::vector<const IntBuffer*> &inputCs,
+    const std::vector<const IntBuffer*> &filledCs,
     bool learnEnabled,
-    float reward,
-    bool mimic
+    bool learnDeferred
 ) {
-    assert(inputCs.size() == inputSizes.size());
-
     // First tick is always 0
     ticks[0] = 0;
 
@@ -218,25 +499,43 @@ void Hierarchy::step(
     {
         int temporalHorizon = histories.front().size() / inputSizes.size();
 
-        std::vector<std::shared_ptr<IntBuffer>> lasts(inputSizes.size());
-        
-        for (int i = 0; i < inputSizes.size(); i++)
-            lasts[i] = histories.front()[temporalHorizon - 1 + temporalHorizon * i];
-  
-        for (int t = temporalHorizon - 1; t > 0; t--) {
+        // The oldest slot becomes the newest, its change list is the diff against the previous input. Change lists stay with their slots
+        if (eventDriven) {
             for (int i = 0; i < inputSizes.size(); i++) {
-                // Shift
-                histories.front()[t + temporalHorizon * i] = histories.front()[(t - 1) + temporalHorizon * i];
+                int index = historyIndex(0, temporalHorizon - 1 + temporalHorizon * i);
+
+                const IntBuffer &inputCsPrev = *historyCs.front()[0 + temporalHorizon * i];
+
+                // An acquired slot that is also the newest slot (temporal horizon of 1) has overwritten the previous input, changes are unknown
+                if (filledCs[i] == &inputCsPrev) {
+                    historyChangesValid[index] = false;
+
+                    continue;
+                }
+
+                IntBuffer &changes = historyChanges[index];
+
+                changes.clear();
+
+                for (int j = 0; j < filledCs[i]->size(); j++) {
+                    if ((*filledCs[i])[j] != inputCsPrev[j])
+                        changes.push_back(j);
+                }
+
+                historyChangesValid[index] = true;
             }
         }
 
+        advanceHistory(0);
+
         for (int i = 0; i < inputSizes.size(); i++) {
-            assert(inputSizes[i].x * inputSizes[i].y == inputCs[i]->size());
-            
-            // Copy
-            runKernel1(cs, std::bind(copyInt, std::placeholders::_1, std::placeholders::_2, inputCs[i], lasts[i].get()), inputCs[i]->size(), cs.rng, cs.batchSize1);
+            assert(inputSizes[i].x * inputSizes[i].y == filledCs[i]->size());
+
+            IntBuffer &slot = histories.front()[historyIndex(0, 0 + temporalHorizon * i)];
 
-            histories.front()[0 + temporalHorizon * i] = lasts[i];
+            // Copy, unless the input was written to the slot directly (see acquireInputSlot)
+            if (filledCs[i] != &slot)
+                slot = *filledCs[i];
         }
     }
 
@@ -244,6 +543,43 @@ void Hierarchy::step(
     updates.clear();
     updates.resize(scLayers.size(), false);
 
+    // Whether each layer (actors last) learns this step, decided as it updates
+    learnTurns.assign(scLayers.size() + 1, false);
+
+    if (amortizedUpdates > 0) {
+        // First layer now, upper layers from the queue within the budget
+        ticks[0] = 0;
+        updates[0] = true;
+
+        learnTurns[0] = learnEnabled && takeLearnTurn(cs, 0);
+
+        forwardLayer(cs, 0, learnTurns[0]);
+
+        if (scLayers.size() > 1)
+            pushLayerOutput(cs, 0, inputCs, filledCs, learnEnabled);
+
+        for (int u = 0; u < amortizedUpdates && !pendingUpdates.empty(); u++) {
+            int l = pendingUpdates.front();
+
+            pendingUpdates.erase(pendingUpdates.begin());
+
+            runPendingUpdate(cs, l, inputCs, filledCs, learnEnabled);
+        }
+
+        backwardLayer(cs, 0, inputCs, filledCs, learnTurns[0], false);
+
+        return;
+    }
+
+    // Left over from amortized mode
+    while (!pendingUpdates.empty()) {
+        int l = pendingUpdates.front();
+
+        pendingUpdates.erase(pendingUpdates.begin());
+
+        runPendingUpdate(cs, l, inputCs, filledCs, learnEnabled);
+    }
+
     // Forward
     for (int l = 0; l < scLayers.size(); l++) {
         // If is time for layer to tick
@@ -254,24 +590,18 @@ void Hierarchy::step(
             // Updated
             updates[l] = true;
 
-            // Activate sparse coder
-            scLayers[l].step(cs, constGet(histories[l]), learnEnabled);
+            learnTurns[l] = learnEnabled && takeLearnTurn(cs, l);
 
-            // Add to next layer's history
+            // Deferred learning runs in startLearning
+            forwardLayer(cs, l, learnTurns[l] && !learnDeferred);
+
+            // Write to the newest slot of the next layer's history
             if (l < scLayers.size() - 1) {
                 int lNext = l + 1;
 
-                int temporalHorizon = histories[lNext].size();
-
-                std::shared_ptr<IntBuffer> last = histories[lNext].back();
-
-                for (int t = temporalHorizon - 1; t > 0; t--)
-                    histories[lNext][t] = histories[lNext][t - 1];
-
-                // Copy
-                runKernel1(cs, std::bind(copyInt, std::placeholders::_1, std::placeholders::_2, &scLayers[l].getHiddenCs(), last.get()), scLayers[l].getHiddenCs().size(), cs.rng, cs.batchSize1);
+                advanceHistory(lNext);
 
-                histories[lNext].front() = last;
+                histories[lNext][historyIndex(lNext, 0)] = scLayers[l].getHiddenCs();
 
                 ticks[lNext]++;
             }
@@ -280,42 +610,672 @@ void Hierarchy::step(
 
     // Backward
     for (int l = scLayers.size() - 1; l >= 0; l--) {
-        if (updates[l]) {
-            // Feed back is current layer state and next higher layer prediction
-            std::vector<const IntBuffer*> feedBackCs(l < scLayers.size() - 1 ? 2 : 1);
+        if (updates[l])
+            backwardLayer(cs, l, inputCs, filledCs, learnTurns[l] && !learnDeferred, learnDeferred);
+    }
+}
 
-            feedBackCs[0] = &scLayers[l].getHiddenCs();
+void Hierarchy::forwardLayer(
+    ComputeSystem &cs,
+    int l,
+    bool learnEnabled
+) {
+    // Activate sparse coder
+    if (eventDriven) {
+        changeCs.assign(histories[l].size(), nullptr);
 
-            if (l < scLayers.size() - 1) {
-                assert(pLayers[l + 1][ticksPerUpdate[l + 1] - 1 - ticks[l + 1]] != nullptr);
+        // Upper layer histories have no change lists, they are diffed against the sparse coder's previous inputs
+        if (l == 0) {
+            for (int v = 0; v < historyChanges.size(); v++) {
+                int index = historyIndex(l, v);
 
-                feedBackCs[1] = &pLayers[l + 1][ticksPerUpdate[l + 1] - 1 - ticks[l + 1]]->getHiddenCs();
+                if (historyChangesValid[index])
+                    changeCs[v] = &historyChanges[index];
             }
+        }
+
+        scLayers[l].step(cs, historyCs[l], changeCs, learnEnabled);
+    }
+    else
+        scLayers[l].step(cs, historyCs[l], learnEnabled);
+}
+
+void Hierarchy::backwardLayer(
+    ComputeSystem &cs,
+    int l,
+    const std::vector<const IntBuffer*> &inputCs,
+    const std::vector<const IntBuffer*> &filledCs,
+    bool learnEnabled,
+    bool learnDeferred
+) {
+    // Feed back is current layer state and next higher layer prediction
+    std::vector<const IntBuffer*> feedBackCs(l < scLayers.size() - 1 ? 2 : 1);
+
+    feedBackCs[0] = &scLayers[l].getHiddenCs();
+
+    if (l < scLayers.size() - 1) {
+        assert(pLayers[l + 1][ticksPerUpdate[l + 1] - 1 - ticks[l + 1]] != nullptr);
+
+        feedBackCs[1] = &pLayers[l + 1][ticksPerUpdate[l + 1] - 1 - ticks[l + 1]]->getHiddenCs();
+    }
+
+    // Current layer changes are known, feed back changes are diffed by the receiving layer
+    std::vector<const IntBuffer*> feedBackChanges(feedBackCs.size(), nullptr);
+
+    feedBackChanges[0] = &scLayers[l].getHiddenChanges();
+
+    // Learning runs after the activation, from the inputs it replaces
+    if (learnDeferred) {
+        for (int p = 0; p < pLayers[l].size(); p++) {
+            if (pLayers[l][p] != nullptr)
+                pLayers[l][p]->keepInputs();
+        }
+    }
+
+    if (l == 0 && lazyPredictions) {
+        // First layer predictions feed nothing else, only record their inputs
+        for (int p = 0; p < pLayers[l].size(); p++) {
+            if (pLayers[l][p] != nullptr) {
+                // Nothing to learn from an entirely absent input
+                if (learnEnabled && inputCs[p] != nullptr)
+                    pLayers[l][p]->learn(cs, filledCs[p]);
+
+                pLayers[l][p]->defer(cs, feedBackCs);
+            }
+        }
+    }
+    else if (eventDriven) {
+        for (int p = 0; p < pLayers[l].size(); p++) {
+            if (pLayers[l][p] != nullptr) {
+                // Nothing to learn from an entirely absent input
+                if (learnEnabled && (l > 0 || inputCs[p] != nullptr))
+                    pLayers[l][p]->learn(cs, l == 0 ? filledCs[p] : historyCs[l][p]);
+
+                pLayers[l][p]->activate(cs, feedBackCs, feedBackChanges);
+            }
+        }
+    }
+    else {
+        // All predictors of a layer read the same feed back, step them as heads of one traversal
+        std::vector<Predictor*> heads;
+        std::vector<const IntBuffer*> hiddenTargetCs;
+
+        for (int p = 0; p < pLayers[l].size(); p++) {
+            if (pLayers[l][p] != nullptr) {
+                heads.push_back(pLayers[l][p].get());
+
+                // Nothing to learn from an entirely absent input
+                if (l == 0)
+                    hiddenTargetCs.push_back(inputCs[p] != nullptr ? filledCs[p] : nullptr);
+                else
+                    hiddenTargetCs.push_back(historyCs[l][p]);
+            }
+        }
+
+        if (learnEnabled)
+            Predictor::learnHeads(cs, heads, hiddenTargetCs);
+
+        Predictor::activateHeads(cs, heads, feedBackCs);
+    }
+}
+
+void Hierarchy::pushLayerOutput(
+    ComputeSystem &cs,
+    int l,
+    const std::vector<const IntBuffer*> &inputCs,
+    const std::vector<const IntBuffer*> &filledCs,
+    bool learnEnabled
+) {
+    int lNext = l + 1;
+
+    // A pending update of the next layer must read its history before it moves on
+    for (int i = 0; i < pendingUpdates.size(); i++) {
+        if (pendingUpdates[i] == lNext) {
+            pendingUpdates.erase(pendingUpdates.begin() + i);
+
+            runPendingUpdate(cs, lNext, inputCs, filledCs, learnEnabled);
+
+            break;
+        }
+    }
+
+    advanceHistory(lNext);
+
+    histories[lNext][historyIndex(lNext, 0)] = scLayers[l].getHiddenCs();
+
+    ticks[lNext]++;
+
+    // Due, the tick resets now so lower layers keep reading the predictions for the current step
+    if (ticks[lNext] >= ticksPerUpdate[lNext]) {
+        ticks[lNext] = 0;
+
+        pendingUpdates.push_back(lNext);
+    }
+}
+
+void Hierarchy::runPendingUpdate(
+    ComputeSystem &cs,
+    int l,
+    const std::vector<const IntBuffer*> &inputCs,
+    const std::vector<const IntBuffer*> &filledCs,
+    bool learnEnabled
+) {
+    updates[l] = true;
+
+    learnTurns[l] = learnEnabled && takeLearnTurn(cs, l);
+
+    forwardLayer(cs, l, learnTurns[l]);
+
+    if (l < scLayers.size() - 1)
+        pushLayerOutput(cs, l, inputCs, filledCs, learnEnabled);
+
+    backwardLayer(cs, l, inputCs, filledCs, learnTurns[l], false);
+}
+
+bool Hierarchy::takeLearnTurn(
+    ComputeSystem &cs,
+    int l
+) {
+    if (targetStepPeriod <= 0.0f)
+        return true;
+
+    // Credits spread the skipped updates evenly, starting at a random phase so layers do not skip together
+    bool learn = learnTurn(learnCredits[l], dutyCycle, cs.rng);
+
+    if (learn)
+        learnedUpdates[l]++;
+    else
+        skippedUpdates[l]++;
+
+    return learn;
+}
+
+void Hierarchy::updateDutyCycle(
+    float stepTime
+) {
+    if (targetStepPeriod <= 0.0f)
+        return;
+
+    // Smoothed, single slow steps should not stop learning
+    meanStepTime = meanStepTime > 0.0f ? meanStepTime + (stepTime - meanStepTime) * dutySmoothing : stepTime;
+
+    // Back off quickly when over the target, restore gradually once there is headroom
+    if (meanStepTime > targetStepPeriod)
+        dutyCycle = dutyCycle > dutyFloor ? dutyCycle * dutyCut : 0.0f;
+    else if (meanStepTime < targetStepPeriod * dutyHeadroom)
+        dutyCycle = std::min(1.0f, dutyCycle + dutyRestore);
+}
+
+void Hierarchy::setTargetStepPeriod(
+    float targetStepPeriod
+) {
+    this->targetStepPeriod = targetStepPeriod;
+
+    // Start at full learning with fresh statistics
+    dutyCycle = 1.0f;
+    meanStepTime = 0.0f;
+
+    learnCredits.assign(scLayers.size() + 1, -1.0f);
+    learnedUpdates.assign(scLayers.size() + 1, 0);
+    skippedUpdates.assign(scLayers.size() + 1, 0);
+}
+
+std::vector<const IntBuffer*> Hierarchy::getActorInputs() const {
+    // Same feed back as the first layer predictors
+    std::vector<const IntBuffer*> feedBackCs(scLayers.size() > 1 ? 2 : 1);
+
+    feedBackCs[0] = &scLayers.front().getHiddenCs();
+
+    if (scLayers.size() > 1) {
+        assert(pLayers[1][ticksPerUpdate[1] - 1 - ticks[1]] != nullptr);
+
+        feedBackCs[1] = &pLayers[1][ticksPerUpdate[1] - 1 - ticks[1]]->getHiddenCs();
+    }
+
+    return feedBackCs;
+}
+
+void Hierarchy::step(
+    ComputeSystem &cs,
+    const std::vector<const IntBuffer*> &inputCs,
+    bool learnEnabled,
+    float reward,
+    bool mimic
+) {
+    assert(inputCs.size() == inputSizes.size());
+
+    // Includes waiting for the learning of the last step
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    waitLearning();
+
+    std::vector<IntBuffer> substituteCs;
+    std::vector<const IntBuffer*> filledCs;
+
+    fillInputs(inputCs, getActionCsPrev(0), substituteCs, filledCs);
+
+    if (learnsAsync(learnEnabled)) {
+        stepLayers(cs, inputCs, filledCs, learnEnabled, true);
+
+        stepActors(cs, filledCs, learnEnabled, reward, mimic, true);
+
+        startLearning(cs, inputCs, reward, mimic);
+    }
+    else {
+        stepLayers(cs, inputCs, filledCs, learnEnabled, false);
+
+        stepActors(cs, filledCs, learnEnabled, reward, mimic, false);
+    }
+
+    updateDutyCycle(std::chrono::duration<float>(std::chrono::steady_clock::now() - start).count());
+}
+
+IntBuffer &Hierarchy::acquireInputSlot(
+    int i
+) {
+    // Background learning may still read the slot
+    waitLearning();
+
+    int temporalHorizon = histories.front().size() / inputSizes.size();
+
+    // The oldest slot is recycled as the newest on the next step
+    return histories.front()[historyIndex(0, temporalHorizon - 1 + temporalHorizon * i)];
+}
+
+void Hierarchy::stepAcquired(
+    ComputeSystem &cs,
+    bool learnEnabled,
+    float reward,
+    bool mimic
+) {
+    // Includes waiting for the learning of the last step
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    waitLearning();
+
+    int temporalHorizon = histories.front().size() / inputSizes.size();
+
+    slotCs.resize(inputSizes.size());
+
+    for (int i = 0; i < inputSizes.size(); i++) {
+        IntBuffer &slot = histories.front()[historyIndex(0, temporalHorizon - 1 + temporalHorizon * i)];
+
+        assert(slot.size() == inputSizes[i].x * inputSizes[i].y);
+
+        // Absent action columns are replaced by the actor's previous action, in place
+        if (aLayers[i] != nullptr) {
+            const IntBuffer &actionCsPrev = aLayers[i]->getHiddenCs();
+
+            for (int j = 0; j < slot.size(); j++) {
+                if (slot[j] < 0)
+                    slot[j] = actionCsPrev[j];
+            }
+        }
+
+        slotCs[i] = &slot;
+    }
+
+    if (learnsAsync(learnEnabled)) {
+        stepLayers(cs, slotCs, slotCs, learnEnabled, true);
+
+        stepActors(cs, slotCs, learnEnabled, reward, mimic, true);
+
+        startLearning(cs, slotCs, reward, mimic);
+    }
+    else {
+        stepLayers(cs, slotCs, slotCs, learnEnabled, false);
+
+        stepActors(cs, slotCs, learnEnabled, reward, mimic, false);
+    }
+
+    updateDutyCycle(std::chrono::duration<float>(std::chrono::steady_clock::now() - start).count());
+}
+
+void Hierarchy::stepActors(
+    ComputeSystem &cs,
+    const std::vector<const IntBuffer*> &filledCs,
+    bool learnEnabled,
+    float reward,
+    bool mimic,
+    bool learnDeferred
+) {
+    // Step actors, the first layer always updates
+    std::vector<const IntBuffer*> feedBackCs = getActorInputs();
+
+    // Current layer changes are known, feed back changes are diffed by the receiving layer
+    std::vector<const IntBuffer*> feedBackChanges(feedBackCs.size(), nullptr);
+
+    feedBackChanges[0] = &scLayers.front().getHiddenChanges();
+
+    // One learning turn for all actors
+    learnTurns.back() = learnEnabled && takeLearnTurn(cs, scLayers.size());
+
+    for (int p = 0; p < aLayers.size(); p++) {
+        if (aLayers[p] != nullptr) {
+            // The sample is recorded by the background learning
+            if (learnDeferred) {
+                if (eventDriven)
+                    aLayers[p]->activate(cs, feedBackCs, feedBackChanges);
+                else
+                    aLayers[p]->activate(cs, feedBackCs);
+            }
+            else if (eventDriven)
+                aLayers[p]->step(cs, feedBackCs, feedBackChanges, filledCs[p], reward, learnTurns.back(), mimic);
+            else
+                aLayers[p]->step(cs, feedBackCs, filledCs[p], reward, learnTurns.back(), mimic);
+        }
+    }
+}
+
+void Hierarchy::startLearning(
+    ComputeSystem &cs,
+    const std::vector<const IntBuffer*> &inputCs,
+    float reward,
+    bool mimic
+) {
+    // Everything the worker reads stays put until the next call that waits for it. Inputs are read back from the first layer history,
+    // whose newest slots hold the filled inputs
+    std::vector<char> learnLayers = learnTurns;
+    std::vector<char> presentInputs(inputSizes.size());
+
+    for (int i = 0; i < inputSizes.size(); i++)
+        presentInputs[i] = inputCs[i] != nullptr;
+
+    std::vector<const IntBuffer*> actorInputs = getActorInputs();
+
+    // Draws on the worker must not race the caller's generator
+    learnCs = cs;
+    learnCs.rng.seed(cs.rng());
+
+    learnFuture = std::async(std::launch::async, [this, learnLayers, presentInputs, actorInputs, reward, mimic]() {
+        int temporalHorizon = histories.front().size() / inputSizes.size();
+
+        for (int l = 0; l < scLayers.size(); l++) {
+            if (!learnLayers[l])
+                continue;
+
+            scLayers[l].learn(learnCs, historyCs[l]);
 
-            // Step actor layers
             for (int p = 0; p < pLayers[l].size(); p++) {
-                if (pLayers[l][p] != nullptr) {
-                    if (learnEnabled)
-                        pLayers[l][p]->learn(cs, l == 0 ? inputCs[p] : histories[l][p].get());
+                // Nothing to learn from an entirely absent input
+                if (pLayers[l][p] != nullptr && (l > 0 || presentInputs[p]))
+                    pLayers[l][p]->learnKept(learnCs, historyCs[l][l == 0 ? temporalHorizon * p : p]);
+            }
+        }
 
-                    pLayers[l][p]->activate(cs, feedBackCs);
-                }
+        for (int p = 0; p < aLayers.size(); p++) {
+            if (aLayers[p] != nullptr)
+                aLayers[p]->learn(learnCs, actorInputs, historyCs.front()[temporalHorizon * p], reward, learnLayers.back(), mimic);
+        }
+    }).share();
+}
+
+void Hierarchy::stepEnvironments(
+    ComputeSystem &cs,
+    const std::vector<std::vector<const IntBuffer*>> &inputCs,
+    std::vector<State> &states,
+    const std::vector<float> &rewards,
+    bool learnEnabled,
+    bool mimic
+) {
+    int numEnvironments = states.size();
+
+    assert(inputCs.size() == numEnvironments);
+    assert(rewards.size() == numEnvironments);
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    // Environments are stepped with inline learning
+    waitLearning();
+
+    for (int p = 0; p < aLayers.size(); p++) {
+        if (aLayers[p] != nullptr && aLayers[p]->getNumEnvironments() != numEnvironments)
+            aLayers[p]->setNumEnvironments(numEnvironments);
+    }
+
+    std::vector<std::vector<IntBuffer>> substituteCs(numEnvironments);
+    std::vector<std::vector<const IntBuffer*>> filledCs(numEnvironments);
+
+    // Actor inputs of each environment, copied out before the next environment's state is set
+    std::vector<std::vector<IntBuffer>> feedBackCs(numEnvironments);
+
+    for (int e = 0; e < numEnvironments; e++) {
+        assert(inputCs[e].size() == inputSizes.size());
+
+        setState(states[e]);
+
+        fillInputs(inputCs[e], getActionCsPrev(e), substituteCs[e], filledCs[e]);
+
+        stepLayers(cs, inputCs[e], filledCs[e], learnEnabled, false);
+
+        std::vector<const IntBuffer*> actorInputs = getActorInputs();
+
+        feedBackCs[e].resize(actorInputs.size());
+
+        for (int i = 0; i < actorInputs.size(); i++)
+            feedBackCs[e][i] = *actorInputs[i];
+
+        // Deferred predictions are part of the state
+        if (lazyPredictions) {
+            for (int p = 0; p < pLayers.front().size(); p++) {
+                if (pLayers.front()[p] != nullptr)
+                    pLayers.front()[p]->evaluate(cs);
+            }
+        }
+
+        getState(states[e]);
+    }
+
+    std::vector<std::vector<const IntBuffer*>> actorInputCs(numEnvironments);
+
+    for (int e = 0; e < numEnvironments; e++)
+        actorInputCs[e] = constGet(feedBackCs[e]);
+
+    // One learning turn for all actors
+    bool learnActors = learnEnabled && takeLearnTurn(cs, scLayers.size());
+
+    // Step actors, all environments at once
+    for (int p = 0; p < aLayers.size(); p++) {
+        if (aLayers[p] != nullptr) {
+            std::vector<const IntBuffer*> actionCsPrev(numEnvironments);
+
+            for (int e = 0; e < numEnvironments; e++)
+                actionCsPrev[e] = filledCs[e][p];
+
+            aLayers[p]->stepBatch(cs, actorInputCs, actionCsPrev, rewards, learnActors, mimic);
+
+            for (int e = 0; e < numEnvironments; e++)
+                states[e].actionCs[p] = aLayers[p]->getHiddenCs(e);
+        }
+    }
+
+    updateDutyCycle(std::chrono::duration<float>(std::chrono::steady_clock::now() - start).count());
+}
+
+void Hierarchy::stepBatch(
+    ComputeSystem &cs,
+    const std::vector<std::vector<const IntBuffer*>> &inputCs,
+    std::vector<State> &states
+) {
+    int numStreams = states.size();
+    int numLayers = scLayers.size();
+
+    assert(inputCs.size() == numStreams);
+
+    waitCommits();
+
+    int temporalHorizon = historySizes.front().size() / inputSizes.size();
+
+    if (batchInputCs.size() < numStreams)
+        batchInputCs.resize(numStreams);
+
+    // Add inputs to first layer histories
+    for (int s = 0; s < numStreams; s++) {
+        assert(inputCs[s].size() == inputSizes.size());
+
+        State &state = states[s];
+
+        // States without actions (made before actions were kept) start from the actor's current actions
+        state.actionCs.resize(aLayers.size());
+
+        batchActionCsPrev.assign(inputSizes.size(), nullptr);
+
+        for (int i = 0; i < inputSizes.size(); i++) {
+            if (aLayers[i] != nullptr) {
+                if (state.actionCs[i].empty())
+                    state.actionCs[i] = aLayers[i]->getHiddenCs();
+
+                batchActionCsPrev[i] = &state.actionCs[i];
+            }
+        }
+
+        fillInputs(inputCs[s], batchActionCsPrev, batchSubstituteCs, batchFilledCs);
+
+        // First tick is always 0
+        state.ticks[0] = 0;
+
+        for (int i = 0; i < inputSizes.size(); i++) {
+            assert(inputSizes[i].x * inputSizes[i].y == batchFilledCs[i]->size());
+
+            pushHistory(state.histories.front(), temporalHorizon * i, temporalHorizon, *batchFilledCs[i]);
+        }
+
+        // Set all updates to no update, will be set to true if an update occurred later
+        state.updates.assign(numLayers, false);
+    }
+
+    // Forward, streams due for an update are encoded together
+    for (int l = 0; l < numLayers; l++) {
+        batchOutputCs.clear();
+
+        for (int s = 0; s < numStreams; s++) {
+            State &state = states[s];
+
+            // If is time for layer to tick
+            if (l == 0 || state.ticks[l] >= ticksPerUpdate[l]) {
+                // Reset tick
+                state.ticks[l] = 0;
+
+                // Updated
+                state.updates[l] = true;
+
+                std::vector<const IntBuffer*> &layerInputCs = batchInputCs[batchOutputCs.size()];
+
+                layerInputCs.resize(state.histories[l].size());
+
+                for (int v = 0; v < state.histories[l].size(); v++)
+                    layerInputCs[v] = &state.histories[l][v];
+
+                batchOutputCs.push_back(&state.hiddenCs[l]);
             }
+        }
+
+        if (batchOutputCs.empty())
+            continue;
+
+        scLayers[l].activateBatch(cs, batchInputCs, batchOutputCs);
+
+        // Add to next layer's history
+        if (l < numLayers - 1) {
+            int lNext = l + 1;
 
-            if (l == 0) {
-                // Step actors
-                for (int p = 0; p < aLayers.size(); p++) {
-                    if (aLayers[p] != nullptr)
-                        aLayers[p]->step(cs, feedBackCs, inputCs[p], reward, learnEnabled, mimic);
+            for (int s = 0; s < numStreams; s++) {
+                State &state = states[s];
+
+                if (state.updates[l]) {
+                    pushHistory(state.histories[lNext], 0, state.histories[lNext].size(), state.hiddenCs[l]);
+
+                    state.ticks[lNext]++;
                 }
             }
         }
     }
+
+    // Backward
+    for (int l = numLayers - 1; l >= 0; l--) {
+        batchStreams.clear();
+
+        for (int s = 0; s < numStreams; s++) {
+            State &state = states[s];
+
+            if (!state.updates[l])
+                continue;
+
+            // Feed back is current layer state and next higher layer prediction
+            std::vector<const IntBuffer*> &feedBackCs = batchInputCs[batchStreams.size()];
+
+            feedBackCs.resize(l < numLayers - 1 ? 2 : 1);
+
+            feedBackCs[0] = &state.hiddenCs[l];
+
+            if (l < numLayers - 1)
+                feedBackCs[1] = &state.predHiddenCs[l + 1][ticksPerUpdate[l + 1] - 1 - state.ticks[l + 1]];
+
+            batchStreams.push_back(s);
+        }
+
+        if (batchStreams.empty())
+            continue;
+
+        for (int p = 0; p < pLayers[l].size(); p++) {
+            if (pLayers[l][p] == nullptr)
+                continue;
+
+            batchOutputCs.resize(batchStreams.size());
+
+            for (int j = 0; j < batchStreams.size(); j++)
+                batchOutputCs[j] = &states[batchStreams[j]].predHiddenCs[l][p];
+
+            pLayers[l][p]->activateBatch(cs, batchInputCs, batchOutputCs);
+
+            // Inputs the predictor would learn from on its next step, kept if the state has them
+            for (int j = 0; j < batchStreams.size(); j++) {
+                State &state = states[batchStreams[j]];
+
+                if (state.predInputCsPrev.empty())
+                    continue;
+
+                for (int v = 0; v < batchInputCs[j].size(); v++)
+                    state.predInputCsPrev[l][p][v] = *batchInputCs[j][v];
+            }
+        }
+    }
+
+    // Actors, the first layer always updates
+    for (int s = 0; s < numStreams; s++) {
+        State &state = states[s];
+
+        // Same feed back as the first layer predictors
+        std::vector<const IntBuffer*> &actorInputCs = batchInputCs[s];
+
+        actorInputCs.resize(numLayers > 1 ? 2 : 1);
+
+        actorInputCs[0] = &state.hiddenCs.front();
+
+        if (numLayers > 1)
+            actorInputCs[1] = &state.predHiddenCs[1][ticksPerUpdate[1] - 1 - state.ticks[1]];
+    }
+
+    for (int p = 0; p < aLayers.size(); p++) {
+        if (aLayers[p] == nullptr)
+            continue;
+
+        batchOutputCs.resize(numStreams);
+
+        for (int s = 0; s < numStreams; s++)
+            batchOutputCs[s] = &states[s].actionCs[p];
+
+        aLayers[p]->activateBatch(cs, batchInputCs, batchOutputCs);
+    }
 }
 
 void Hierarchy::writeToStream(
     std::ostream &os
 ) const {
+    waitLearning();
+
+    os.write(reinterpret_cast<const char*>(&streamVersion), sizeof(int));
+
     int numLayers = scLayers.size();
 
     os.write(reinterpret_cast<const char*>(&numLayers), sizeof(int));
@@ -330,6 +1290,11 @@ void Hierarchy::writeToStream(
     os.write(reinterpret_cast<const char*>(ticks.data()), ticks.size() * sizeof(int));
     os.write(reinterpret_cast<const char*>(ticksPerUpdate.data()), ticksPerUpdate.size() * sizeof(int));
 
+    int numPendingUpdates = pendingUpdates.size();
+
+    os.write(reinterpret_cast<const char*>(&numPendingUpdates), sizeof(int));
+    os.write(reinterpret_cast<const char*>(pendingUpdates.data()), numPendingUpdates * sizeof(int));
+
     for (int l = 0; l < numLayers; l++) {
         int numHistorySizes = historySizes[l].size();
 
@@ -337,8 +1302,9 @@ void Hierarchy::writeToStream(
 
         os.write(reinterpret_cast<const char*>(historySizes[l].data()), numHistorySizes * sizeof(int));
 
+        // Time order, independent of the ring heads
         for (int i = 0; i < historySizes[l].size(); i++)
-            writeBufferToStream(os, histories[l][i].get());
+            writeBufferToStream(os, historyCs[l][i]);
 
         scLayers[l].writeToStream(os);
 
@@ -367,6 +1333,18 @@ void Hierarchy::writeToStream(
 void Hierarchy::readFromStream(
     std::istream &is
 ) {
+    waitLearning();
+
+    int version;
+    is.read(reinterpret_cast<char*>(&version), sizeof(int));
+
+    // Streams of another layout cannot be read
+    if (!is || version != streamVersion) {
+        is.setstate(std::ios::failbit);
+
+        return;
+    }
+
     int numLayers;
     is.read(reinterpret_cast<char*>(&numLayers), sizeof(int));
 
@@ -385,6 +1363,8 @@ void Hierarchy::readFromStream(
 
     histories.resize(numLayers);
     historySizes.resize(numLayers);
+    historyHeads.assign(numLayers, 0);
+    historyCs.resize(numLayers);
     
     ticksPerUpdate.resize(numLayers);
 
@@ -393,6 +1373,14 @@ void Hierarchy::readFromStream(
     is.read(reinterpret_cast<char*>(updates.data()), updates.size() * sizeof(char));
     is.read(reinterpret_cast<char*>(ticks.data()), ticks.size() * sizeof(int));
     is.read(reinterpret_cast<char*>(ticksPerUpdate.data()), ticksPerUpdate.size() * sizeof(int));
+
+    int numPendingUpdates;
+
+    is.read(reinterpret_cast<char*>(&numPendingUpdates), sizeof(int));
+
+    pendingUpdates.resize(numPendingUpdates);
+
+    is.read(reinterpret_cast<char*>(pendingUpdates.data()), numPendingUpdates * sizeof(int));
     
     for (int l = 0; l < numLayers; l++) {
         int numHistorySizes;
@@ -403,11 +1391,10 @@ void Hierarchy::readFromStream(
 
         histories[l].resize(numHistorySizes);
 
-        for (int i = 0; i < historySizes[l].size(); i++) {
-            histories[l][i] = std::make_shared<IntBuffer>();
+        for (int i = 0; i < historySizes[l].size(); i++)
+            readBufferFromStream(is, &histories[l][i]);
 
-            readBufferFromStream(is, histories[l][i].get());
-        }
+        updateHistoryCs(l);
 
         scLayers[l].readFromStream(is);
         
@@ -443,11 +1430,19 @@ void Hierarchy::readFromStream(
         else
             aLayers[v] = nullptr;
     }
+
+    historyChanges.resize(histories.front().size());
+    historyChangesValid.assign(histories.front().size(), false);
+
+    // Statistics are kept per layer
+    setTargetStepPeriod(targetStepPeriod);
 }
 
 void Hierarchy::getState(
     State &state
 ) const {
+    waitLearning();
+
     int numLayers = scLayers.size();
 
     state.hiddenCs.resize(numLayers);
@@ -461,12 +1456,16 @@ void Hierarchy::getState(
         state.histories[l].resize(historySizes[l].size());
 
         for (int i = 0; i < historySizes[l].size(); i++)
-            state.histories[l][i] = *histories[l][i];
+            state.histories[l][i] = *historyCs[l][i];
 
         state.predHiddenCs[l].resize(pLayers[l].size());
         state.predInputCsPrev[l].resize(pLayers[l].size());
 
         for (int j = 0; j < pLayers[l].size(); j++) {
+            // Action inputs have no predictor
+            if (pLayers[l][j] == nullptr)
+                continue;
+
             state.predHiddenCs[l][j] = pLayers[l][j]->getHiddenCs();
 
             state.predInputCsPrev[l][j].resize(pLayers[l][j]->getNumVisibleLayers());
@@ -476,29 +1475,58 @@ void Hierarchy::getState(
         }
     }
 
+    state.actionCs.resize(aLayers.size());
+
+    for (int i = 0; i < aLayers.size(); i++) {
+        if (aLayers[i] == nullptr)
+            state.actionCs[i].clear();
+        else
+            state.actionCs[i] = aLayers[i]->getHiddenCs();
+    }
+
     state.ticks = ticks;
     state.updates = updates;
+    state.pendingUpdates = pendingUpdates;
 }
 
 void Hierarchy::setState(
     const State &state
 ) {
+    waitLearning();
+
     int numLayers = scLayers.size();
 
     for (int l = 0; l < numLayers; l++) {
         scLayers[l].hiddenCs = state.hiddenCs[l];
+        scLayers[l].hiddenActivationsValid = false;
 
         for (int i = 0; i < historySizes[l].size(); i++)
-            *histories[l][i] = state.histories[l][i];
+            histories[l][historyIndex(l, i)] = state.histories[l][i];
 
         for (int j = 0; j < pLayers[l].size(); j++) {
+            if (pLayers[l][j] == nullptr)
+                continue;
+
             pLayers[l][j]->hiddenCs = state.predHiddenCs[l][j];
+            pLayers[l][j]->hiddenActivationsValid = false;
+            pLayers[l][j]->hiddenActivationsExact = false;
 
             for (int v = 0; v < pLayers[l][j]->getNumVisibleLayers(); v++)
                 pLayers[l][j]->visibleLayers[v].inputCsPrev = state.predInputCsPrev[l][j][v];
+
+            pLayers[l][j]->pending = false;
         }
     }
 
+    // States from before actions were part of State have none
+    for (int i = 0; i < state.actionCs.size(); i++) {
+        if (aLayers[i] != nullptr && !state.actionCs[i].empty())
+            aLayers[i]->environments.front().hiddenCs = state.actionCs[i];
+    }
+
     ticks = state.ticks;
     updates = state.updates;
+    pendingUpdates = state.pendingUpdates;
+
+    historyChangesValid.assign(historyChangesValid.size(), false);
 }
\ No newline at end of file
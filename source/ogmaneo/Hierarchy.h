@@ -15,6 +15,8 @@
 #include <memory>
 
 namespace ogmaneo {
+class FrozenHierarchy;
+
 // Type of hierarchy input layer
 enum InputType {
     none = 0,
@@ -28,10 +30,14 @@ struct State {
     std::vector<std::vector<std::vector<IntBuffer>>> predInputCsPrev;
     std::vector<std::vector<IntBuffer>> predHiddenCs;
 
+    std::vector<IntBuffer> actionCs; // Actions of actor inputs (empty for other inputs)
+
     std::vector<std::vector<IntBuffer>> histories;
 
     std::vector<char> updates;
     std::vector<int> ticks;
+
+    std::vector<int> pendingUpdates; // Layers whose update is due but not run yet (amortized mode)
 };
 
 // A SPH
@@ -44,6 +50,9 @@ public:
         int ffRadius; // Feed forward radius
         int pRadius; // Prediction radius
 
+        bool ffShared; // Whether the sparse coder shares one weight kernel across hidden columns (convolutional)
+        bool pShared; // Whether the predictors share one weight kernel across hidden columns (convolutional)
+
         int ticksPerUpdate; // Number of ticks a layer takes to update (relative to previous layer)
 
         int temporalHorizon; // Temporal distance into a the past addressed by the layer. Should be greater than or equal to ticksPerUpdate
@@ -51,12 +60,15 @@ public:
         // If there is an actor (only valid for first layer)
         int aRadius;
         int historyCapacity;
+        std::string historyPath; // If not empty, actor histories are kept in memory-mapped files at this path, suffixed with the input index
 
         LayerDesc()
         :
         hiddenSize(4, 4, 16),
         ffRadius(2),
         pRadius(2),
+        ffShared(false),
+        pShared(false),
         ticksPerUpdate(2),
         temporalHorizon(4),
         aRadius(2),
@@ -69,9 +81,11 @@ private:
     std::vector<std::vector<std::unique_ptr<Predictor>>> pLayers;
     std::vector<std::unique_ptr<Actor>> aLayers;
 
-    // Histories
-    std::vector<std::vector<std::shared_ptr<IntBuffer>>> histories;
+    // Histories, one ring of slots per layer. Slot t (0 is the newest) of input i is at (historyHeads[l] + t) % temporalHorizon + temporalHorizon * i
+    std::vector<std::vector<IntBuffer>> histories;
     std::vector<std::vector<int>> historySizes;
+    std::vector<int> historyHeads;
+    std::vector<std::vector<const IntBuffer*>> historyCs; // Slots of each layer in time order, as the sparse coders read them (kept up to date with the heads)
 
     // Per-layer values
     std::vector<char> updates;
@@ -82,9 +96,196 @@ private:
     // Input dimensions
     std::vector<Int3> inputSizes;
 
+    // Event-driven mode
+    bool eventDriven;
+
+    std::vector<IntBuffer> historyChanges; // Changed columns of each first layer history slot relative to the slot's previous contents
+    std::vector<char> historyChangesValid; // Whether the corresponding historyChanges entry is known
+
+    // Lazy mode
+    bool lazyPredictions;
+
+    // Amortized mode
+    int amortizedUpdates; // Maximum number of queued upper layer updates run per step, 0 disables
+    std::vector<int> pendingUpdates; // Layers whose update is due but not run yet, oldest first
+
+    // Adaptive learning duty cycle
+    float targetStepPeriod; // Step time to stay within, in seconds. 0 disables
+    float dutyCycle; // Fraction of layer updates that learn
+    float meanStepTime; // Smoothed step time, in seconds
+    FloatBuffer learnCredits; // Learning schedule credit of each layer, actors last (see learnTurn)
+    std::vector<int> learnedUpdates; // Updates of each layer (actors last) that learned since the target was set
+    std::vector<int> skippedUpdates; // Updates of each layer (actors last) that skipped learning since the target was set
+    std::vector<char> learnTurns; // Whether each layer (actors last) learns in the current step
+
+    std::vector<const IntBuffer*> slotCs; // Acquired input slots of the current step (scratch, see stepAcquired)
+    std::vector<const IntBuffer*> changeCs; // Change lists passed to an event-driven sparse coder (scratch)
+
+    // Scratch of stepBatch, refilled in place so it only allocates when the batch grows
+    std::vector<std::vector<const IntBuffer*>> batchInputCs; // Inputs of each stream due for an update (may be longer than the batch)
+    std::vector<IntBuffer*> batchOutputCs; // Outputs of each stream due for an update
+    std::vector<int> batchStreams; // Streams due for an update
+    std::vector<const IntBuffer*> batchActionCsPrev; // Previous actions of a stream, for fillInputs
+    std::vector<IntBuffer> batchSubstituteCs; // Substituted inputs of a stream, for fillInputs
+    std::vector<const IntBuffer*> batchFilledCs; // Filled inputs of a stream, for fillInputs
+
+    // Asynchronous learning mode
+    bool asyncLearning;
+    ComputeSystem learnCs; // Compute system of the background learning, with its own generator
+    std::shared_future<void> learnFuture; // Learning of the last step. Declared last, so destruction waits for it before anything it reads goes away
+
+    // Replace absent inputs and columns. Absent actions are replaced by actionCsPrev (one per input, only read for actor inputs)
+    void fillInputs(
+        const std::vector<const IntBuffer*> &inputCs,
+        const std::vector<const IntBuffer*> &actionCsPrev,
+        std::vector<IntBuffer> &substituteCs,
+        std::vector<const IntBuffer*> &filledCs
+    ) const;
+
+    // Previous actions of an actor environment, for fillInputs
+    std::vector<const IntBuffer*> getActionCsPrev(
+        int e
+    ) const;
+
+    // Index in histories[l] of time-ordered slot v (t + temporalHorizon * i)
+    int historyIndex(
+        int l,
+        int v
+    ) const {
+        int temporalHorizon = l == 0 ? histories[l].size() / inputSizes.size() : histories[l].size();
+
+        return (historyHeads[l] + v % temporalHorizon) % temporalHorizon + (v / temporalHorizon) * temporalHorizon;
+    }
+
+    // Move the head of a ring back by one, the oldest slots become the newest. Updates historyCs
+    void advanceHistory(
+        int l
+    );
+
+    // Point historyCs at the slots in time order
+    void updateHistoryCs(
+        int l
+    );
+
+    // Shift a history and write inputCs to its newest slot
+    static void pushHistory(
+        std::vector<IntBuffer> &history,
+        int start,
+        int size,
+        const IntBuffer &inputCs
+    );
+
+    // Step the sparse coders and predictors (everything but the actors). With learnDeferred, learning is left to startLearning and predictors keep their inputs for it
+    void stepLayers(
+        ComputeSystem &cs,
+        const std::vector<const IntBuffer*> &inputCs,
+        const std::vector<const IntBuffer*> &filledCs,
+        bool learnEnabled,
+        bool learnDeferred
+    );
+
+    // Encode the history of a layer with its sparse coder
+    void forwardLayer(
+        ComputeSystem &cs,
+        int l,
+        bool learnEnabled
+    );
+
+    // Learn and activate the predictors of a layer
+    void backwardLayer(
+        ComputeSystem &cs,
+        int l,
+        const std::vector<const IntBuffer*> &inputCs,
+        const std::vector<const IntBuffer*> &filledCs,
+        bool learnEnabled,
+        bool learnDeferred
+    );
+
+    // Write a layer's hidden states to the next layer's history and queue the next layer if it is due (amortized mode)
+    void pushLayerOutput(
+        ComputeSystem &cs,
+        int l,
+        const std::vector<const IntBuffer*> &inputCs,
+        const std::vector<const IntBuffer*> &filledCs,
+        bool learnEnabled
+    );
+
+    // Run a queued upper layer update (amortized mode)
+    void runPendingUpdate(
+        ComputeSystem &cs,
+        int l,
+        const std::vector<const IntBuffer*> &inputCs,
+        const std::vector<const IntBuffer*> &filledCs,
+        bool learnEnabled
+    );
+
+    // Step the actors on the feed back of the first layer. filledCs are the inputs after fillInputs (previous actions). With learnDeferred, only get actions (learning is left to startLearning)
+    void stepActors(
+        ComputeSystem &cs,
+        const std::vector<const IntBuffer*> &filledCs,
+        bool learnEnabled,
+        float reward,
+        bool mimic,
+        bool learnDeferred
+    );
+
+    // Whether a step learns on the background worker (asynchronous learning mode)
+    bool learnsAsync(
+        bool learnEnabled
+    ) const {
+        // Amortized updates and updates left over from them learn inline
+        return asyncLearning && learnEnabled && amortizedUpdates == 0 && pendingUpdates.empty();
+    }
+
+    // Run the learning of the step just taken (with learnDeferred) on the background worker
+    void startLearning(
+        ComputeSystem &cs,
+        const std::vector<const IntBuffer*> &inputCs,
+        float reward,
+        bool mimic
+    );
+
+    // Whether an update of layer l (scLayers.size() for the actors) learns at the current duty cycle. Always true without a target step period
+    bool takeLearnTurn(
+        ComputeSystem &cs,
+        int l
+    );
+
+    // Adjust the duty cycle to a measured step time
+    void updateDutyCycle(
+        float stepTime
+    );
+
+    // Inputs of the actors, the feed back of the first layer
+    std::vector<const IntBuffer*> getActorInputs() const;
+
+    // Block until background learning and the background commits of all layers are done
+    void waitCommits() const;
+
 public:
+    // Adaptive learning duty cycle controller (see setTargetStepPeriod). Applied after every measured step
+    float dutySmoothing; // Weight of the newest step time in the smoothed step time, in (0, 1]
+    float dutyCut; // Factor the duty cycle is multiplied by while the smoothed step time is over the target, in (0, 1)
+    float dutyRestore; // Amount added to the duty cycle while there is headroom
+    float dutyHeadroom; // Headroom: the smoothed step time is under this fraction of the target, in (0, 1]
+    float dutyFloor; // Duty cycle below which a cut switches learning off entirely (the target is out of reach even without learning)
+
     // Default
-    Hierarchy() {}
+    Hierarchy()
+    :
+    eventDriven(false),
+    lazyPredictions(false),
+    amortizedUpdates(0),
+    targetStepPeriod(0.0f),
+    dutyCycle(1.0f),
+    meanStepTime(0.0f),
+    asyncLearning(false),
+    dutySmoothing(0.1f),
+    dutyCut(0.9f),
+    dutyRestore(0.02f),
+    dutyHeadroom(0.9f),
+    dutyFloor(0.01f)
+    {}
 
     // Copy
     Hierarchy(
@@ -109,12 +310,47 @@ public:
     // Simulation step/tick
     void step(
         ComputeSystem &cs, // Compute system
-        const std::vector<const IntBuffer*> &inputCs, // Inputs to remember
+        const std::vector<const IntBuffer*> &inputCs, // Inputs to remember. nullptr marks an absent input, negative states mark absent columns. Absent columns are skipped by encoding and learning
         bool learnEnabled = true, // Whether learning is enabled
         float reward = 0.0f, // Optional reward for actor layers
         bool mimic = false
     );
 
+    // Buffer to write input i of the next step into, instead of passing it to step (zero-copy input). Holds an old input, every column must be written.
+    // The buffer becomes the newest history slot when stepAcquired is called, and stays valid until then
+    IntBuffer &acquireInputSlot(
+        int i // Index of input layer
+    );
+
+    // Simulation step/tick with the inputs written to the acquired slots. All inputs must be acquired. Same as step, negative states mark absent columns
+    void stepAcquired(
+        ComputeSystem &cs, // Compute system
+        bool learnEnabled = true, // Whether learning is enabled
+        float reward = 0.0f, // Optional reward for actor layers
+        bool mimic = false
+    );
+
+    // Step several environments that share the model. The sparse coders and predictors step each environment in turn with its state swapped in (see getState/setState),
+    // the actors step all environments together with one history per environment (see Actor::stepBatch). Actors are resized to the number of environments.
+    // The hierarchy is left with the state of the last environment, actions of an environment are retrieved with getActionCs
+    void stepEnvironments(
+        ComputeSystem &cs, // Compute system
+        const std::vector<std::vector<const IntBuffer*>> &inputCs, // Inputs of each environment, as in step
+        std::vector<State> &states, // States of each environment, updated in place. Initialize with getState
+        const std::vector<float> &rewards, // Rewards of each environment
+        bool learnEnabled = true, // Whether learning is enabled
+        bool mimic = false
+    );
+
+    // Inference step of several independent streams (sessions) at once, without learning. Each sparse coder, predictor and actor evaluates all
+    // streams due for an update together, so its weights are loaded once per batch instead of once per stream. Each stream keeps its own tick schedule.
+    // The hierarchy's own state is not used or changed, actions of a stream are in its State::actionCs (taken from the actors if a state has none)
+    void stepBatch(
+        ComputeSystem &cs, // Compute system
+        const std::vector<std::vector<const IntBuffer*>> &inputCs, // Inputs of each stream, as in step
+        std::vector<State> &states // States of each stream, updated in place. Initialize with getState
+    );
+
     // State get
     void getState(
         State &state
@@ -130,26 +366,155 @@ public:
         std::ostream &os // Stream to write to
     ) const;
 
-    // Read from stream
+    // Read from stream. Streams of another format version, including those written before the version was recorded, are rejected:
+    // the failbit of the stream is set and the hierarchy is left unchanged
     void readFromStream(
         std::istream &is // Stream to read from
     );
 
+    // Enable/disable event-driven mode. Layers then only recompute hidden columns whose inputs changed, and change lists are propagated between layers
+    void setEventDriven(
+        bool eventDriven
+    );
+
+    // Whether event-driven mode is enabled
+    bool getEventDriven() const {
+        return eventDriven;
+    }
+
+    // Enable/disable lazy predictions. First layer predictions are then only computed when requested through the non-const getPredictionCs
+    void setLazyPredictions(
+        bool lazyPredictions
+    );
+
+    // Whether lazy predictions are enabled
+    bool getLazyPredictions() const {
+        return lazyPredictions;
+    }
+
+    // Enable/disable amortized mode. Upper layer updates (sparse coder, then predictors) that fall due are queued, and at most maxUpdatesPerStep of them run per step,
+    // so steps where several layers align cost about as much as the others. The first layer always updates immediately.
+    // Staleness: a queued layer's predictions are those of its previous update until it runs, and its lower layer reads them in the meantime.
+    // Each layer has at most one queued update, which runs early if its history is about to receive new input, so with maxUpdatesPerStep >= 1 an update
+    // is delayed by at most numLayers - 2 steps. Queued updates run on the next step after amortized mode is disabled. 0 disables
+    void setAmortizedUpdates(
+        int maxUpdatesPerStep
+    ) {
+        amortizedUpdates = maxUpdatesPerStep;
+    }
+
+    // Maximum number of queued upper layer updates run per step, 0 if amortized mode is disabled
+    int getAmortizedUpdates() const {
+        return amortizedUpdates;
+    }
+
+    // Enable/disable asynchronous learning. Steps that learn then compute predictions and actions first and return, learning runs on a background worker.
+    // Every call that reads or changes the weights or states (steps, acquireInputSlot, state get/set, prediction and action getters, serialization, compaction, copies) first waits for it.
+    // Staleness: predictions of a step are made before the predictors learn from its inputs, so they use predictor weights one update behind synchronous mode.
+    // Sparse coders and actors learn after their forward pass in either mode. Steps in amortized mode learn inline
+    void setAsyncLearning(
+        bool asyncLearning
+    ) {
+        this->asyncLearning = asyncLearning;
+    }
+
+    // Whether asynchronous learning is enabled
+    bool getAsyncLearning() const {
+        return asyncLearning;
+    }
+
+    // Block until the background learning of the last step is done. Needed before changing layers directly (getSCLayer, getPLayers, getALayers)
+    void waitLearning() const {
+        if (learnFuture.valid())
+            learnFuture.wait();
+    }
+
+    // Set a target step period. step, stepAcquired and stepEnvironments then measure their own duration and skip learning passes of layers and actors
+    // (sparse coder and predictor learning, actor history replay) to stay within it, restoring learning when there is headroom. The controller is tuned with the duty* parameters.
+    // Skipped updates are spread evenly at the duty cycle, actors still record every sample. Resets the duty cycle and statistics. 0 disables
+    void setTargetStepPeriod(
+        float targetStepPeriod // Step time in seconds
+    );
+
+    // Target step period in seconds, 0 if disabled
+    float getTargetStepPeriod() const {
+        return targetStepPeriod;
+    }
+
+    // Current fraction of layer updates that learn (duty cycle), 1 without a target step period
+    float getDutyCycle() const {
+        return dutyCycle;
+    }
+
+    // Smoothed duration of recent steps in seconds, measured while a target step period is set
+    float getMeanStepTime() const {
+        return meanStepTime;
+    }
+
+    // Number of updates of a layer that learned since the target step period was set. getNumLayers() as layer index counts the actor steps
+    int getLearnedUpdates(
+        int l // Layer index
+    ) const {
+        return learnedUpdates[l];
+    }
+
+    // Number of updates of a layer that skipped learning since the target step period was set. getNumLayers() as layer index counts the actor steps
+    int getSkippedUpdates(
+        int l // Layer index
+    ) const {
+        return skippedUpdates[l];
+    }
+
+    // Remove hidden cells of a layer that won fewer than minUsage times since usage tracking began (see SparseCoder::trackUsage), shrinking the hidden column size.
+    // Every column keeps the same number of cells, padded with its most used dead cells. Layers with shared kernels keep the same cells in every column.
+    // Weights and states of all layers reading or predicting the layer are remapped. States saved with getState before compaction no longer apply. Returns the new hidden column size
+    int compact(
+        int l, // Layer index
+        int minUsage = 1 // Minimum number of wins for a cell to be kept
+    );
+
     // Get the number of layers (scLayers)
     int getNumLayers() const {
         return scLayers.size();
     }
 
-    // Retrieve predictions
+    // Retrieve predictions. In lazy mode, these are the last computed predictions. Waits for asynchronous learning, which may still be using the layers
     const IntBuffer &getPredictionCs(
         int i // Index of input layer to get predictions for
     ) const {
+        waitLearning();
+
+        if (aLayers[i] != nullptr) // If is an action layer
+            return aLayers[i]->getHiddenCs();
+
+        return pLayers.front()[i]->getHiddenCs();
+    }
+
+    // Retrieve predictions, computing them first if they were deferred (lazy mode)
+    const IntBuffer &getPredictionCs(
+        ComputeSystem &cs, // Compute system
+        int i // Index of input layer to get predictions for
+    ) {
+        waitLearning();
+
         if (aLayers[i] != nullptr) // If is an action layer
             return aLayers[i]->getHiddenCs();
 
+        pLayers.front()[i]->evaluate(cs);
+
         return pLayers.front()[i]->getHiddenCs();
     }
 
+    // Retrieve the actions of an environment stepped with stepEnvironments
+    const IntBuffer &getActionCs(
+        int i, // Index of input layer to get actions for
+        int e // Index of environment
+    ) const {
+        waitLearning();
+
+        return aLayers[i]->getHiddenCs(e);
+    }
+
     // Whether this layer received on update this timestep
     bool getUpdate(
         int l // Layer index
@@ -213,5 +578,7 @@ public:
     const std::vector<std::unique_ptr<Actor>> &getALayers() const {
         return aLayers;
     }
+
+    friend class FrozenHierarchy;
 };
 } // namespace ogmaneo
@@ -0,0 +1,132 @@
+// ----------------------------------------------------------------------------
+//  OgmaNeo
+//  Copyright(c) 2016-2020 Ogma Intelligent Systems Corp. All rights reserved.
+//
+//  This copy of OgmaNeo is licensed to you under the terms described
+//  in the OGMANEO_LICENSE.md file included in this distribution.
+// ----------------------------------------------------------------------------
+
+#include "MappedFile.h"
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+using namespace ogmaneo;
+
+bool MappedFile::map(
+    size_t size
+) {
+#ifdef _WIN32
+    return false;
+#else
+    if (ftruncate(fd, size) != 0)
+        return false;
+
+    if (size == 0)
+        return true;
+
+    void* mapped = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+    if (mapped == MAP_FAILED)
+        return false;
+
+    data = static_cast<unsigned char*>(mapped);
+    this->size = size;
+
+    return true;
+#endif
+}
+
+void MappedFile::unmap() {
+#ifndef _WIN32
+    if (data != nullptr)
+        munmap(data, size);
+#endif
+
+    data = nullptr;
+    size = 0;
+}
+
+bool MappedFile::open(
+    const std::string &path,
+    size_t size
+) {
+    close();
+
+#ifdef _WIN32
+    return false;
+#else
+    fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+
+    if (fd < 0)
+        return false;
+
+    this->path = path;
+
+    if (!map(size)) {
+        close();
+
+        return false;
+    }
+
+    return true;
+#endif
+}
+
+bool MappedFile::resize(
+    size_t size
+) {
+    if (fd < 0)
+        return false;
+
+    flush();
+    unmap();
+
+    return map(size);
+}
+
+void MappedFile::flush() {
+#ifndef _WIN32
+    if (data != nullptr)
+        msync(data, size, MS_SYNC);
+#endif
+}
+
+void MappedFile::close() {
+    flush();
+    unmap();
+
+#ifndef _WIN32
+    if (fd >= 0)
+        ::close(fd);
+#endif
+
+    fd = -1;
+
+    path.clear();
+}
+
+void MappedFile::prefetch(
+    size_t offset,
+    size_t length
+) const {
+#ifndef _WIN32
+    if (data == nullptr || length == 0)
+        return;
+
+    size_t pageSize = sysconf(_SC_PAGESIZE);
+
+    size_t start = offset / pageSize * pageSize;
+
+    madvise(data + start, offset + length - start, MADV_WILLNEED);
+
+    // Touch every page so it is resident when this returns
+    volatile unsigned char sink = 0;
+
+    for (size_t i = start; i < offset + length; i += pageSize)
+        sink += data[i];
+#endif
+}
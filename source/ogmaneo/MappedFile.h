@@ -0,0 +1,101 @@
+// ----------------------------------------------------------------------------
+//  OgmaNeo
+//  Copyright(c) 2016-2020 Ogma Intelligent Systems Corp. All rights reserved.
+//
+//  This copy of OgmaNeo is licensed to you under the terms described
+//  in the OGMANEO_LICENSE.md file included in this distribution.
+// ----------------------------------------------------------------------------
+
+#pragma once
+
+#include <string>
+#include <cstddef>
+
+namespace ogmaneo {
+// A file mapped into memory, for buffers that should not live in RAM (POSIX only, open fails elsewhere)
+class MappedFile {
+private:
+    std::string path; // Path of the open file
+
+    int fd; // File descriptor, -1 if not open
+
+    unsigned char* data; // Mapped bytes
+    size_t size; // Number of mapped bytes
+
+    // Map size bytes of the open file, growing or truncating it
+    bool map(
+        size_t size
+    );
+
+    void unmap();
+
+public:
+    // Defaults
+    MappedFile()
+    :
+    fd(-1),
+    data(nullptr),
+    size(0)
+    {}
+
+    // Mappings are not copyable
+    MappedFile(
+        const MappedFile &other
+    ) = delete;
+
+    MappedFile &operator=(
+        const MappedFile &other
+    ) = delete;
+
+    ~MappedFile() {
+        close();
+    }
+
+    // Open (or create) a file and map size bytes of it. Existing contents are kept. Returns whether it succeeded
+    bool open(
+        const std::string &path, // Path of the file
+        size_t size // Number of bytes to map
+    );
+
+    // Change the mapped size. Contents up to the smaller size are kept. Returns whether it succeeded
+    bool resize(
+        size_t size // Number of bytes to map
+    );
+
+    // Write changes back to the file
+    void flush();
+
+    // Flush and unmap
+    void close();
+
+    // Load a range into memory ahead of use (blocks until the pages are resident)
+    void prefetch(
+        size_t offset, // First byte
+        size_t length // Number of bytes
+    ) const;
+
+    // Whether a file is open
+    bool isOpen() const {
+        return data != nullptr;
+    }
+
+    // Get the mapped bytes
+    unsigned char* getData() {
+        return data;
+    }
+
+    const unsigned char* getData() const {
+        return data;
+    }
+
+    // Get the number of mapped bytes
+    size_t getSize() const {
+        return size;
+    }
+
+    // Get the path of the open file
+    const std::string &getPath() const {
+        return path;
+    }
+};
+} // namespace ogmaneo
@@ -28,9 +28,17 @@ void Predictor::forward(
             VisibleLayer &vl = visibleLayers[vli];
             const VisibleLayerDesc &vld = visibleLayerDescs[vli];
 
-            sum += vl.weights.multiplyOHVs(*inputCs[vli], hiddenIndex, vld.size.z);
+            if (vld.shared) {
+                int count;
+
+                sum += multiplySharedOHVs(vl.sharedWeights, *inputCs[vli], Int3(pos.x, pos.y, hc), vld.size, hiddenSize, vld.radius, count);
+            }
+            else
+                sum += vl.weights.multiplyOHVs(*inputCs[vli], hiddenIndex, vld.size.z);
         }
 
+        hiddenActivations[hiddenIndex] = sum;
+
         if (sum > maxActivation) {
             maxActivation = sum;
             maxIndex = hc;
@@ -40,40 +48,741 @@ void Predictor::forward(
     hiddenCs[address2(pos, Int2(hiddenSize.x, hiddenSize.y))] = maxIndex;
 }
 
+void Predictor::forwardBatch(
+    const Int2 &pos,
+    std::mt19937 &rng,
+    const std::vector<std::vector<const IntBuffer*>> &inputCs,
+    const std::vector<IntBuffer*> &hiddenCs
+) {
+    int hiddenColumnIndex = address2(pos, Int2(hiddenSize.x, hiddenSize.y));
+
+    int numStreams = hiddenCs.size();
+
+    // Scratch, reused across calls on the same thread
+    static thread_local FloatBuffer sums;
+    static thread_local FloatBuffer maxActivations;
+    static thread_local IntBuffer maxIndices;
+
+    sums.resize(numStreams);
+    maxActivations.assign(numStreams, -999999.0f);
+    maxIndices.assign(numStreams, 0);
+
+    for (int hc = 0; hc < hiddenSize.z; hc++) {
+        int hiddenIndex = address3(Int3(pos.x, pos.y, hc), hiddenSize);
+
+        sums.assign(numStreams, 0.0f);
+
+        // Each row is traversed for all streams while it is in cache
+        for (int vli = 0; vli < visibleLayers.size(); vli++) {
+            VisibleLayer &vl = visibleLayers[vli];
+            const VisibleLayerDesc &vld = visibleLayerDescs[vli];
+
+            for (int s = 0; s < numStreams; s++) {
+                if (vld.shared) {
+                    int count;
+
+                    sums[s] += multiplySharedOHVs(vl.sharedWeights, *inputCs[s][vli], Int3(pos.x, pos.y, hc), vld.size, hiddenSize, vld.radius, count);
+                }
+                else
+                    sums[s] += vl.weights.multiplyOHVs(*inputCs[s][vli], hiddenIndex, vld.size.z);
+            }
+        }
+
+        for (int s = 0; s < numStreams; s++) {
+            if (sums[s] > maxActivations[s]) {
+                maxActivations[s] = sums[s];
+                maxIndices[s] = hc;
+            }
+        }
+    }
+
+    for (int s = 0; s < numStreams; s++)
+        (*hiddenCs[s])[hiddenColumnIndex] = maxIndices[s];
+}
+
+void Predictor::choose(
+    int i,
+    std::mt19937 &rng
+) {
+    int hiddenColumnIndex = updateColumns[i];
+
+    int maxIndex = 0;
+    float maxActivation = -999999.0f;
+
+    for (int hc = 0; hc < hiddenSize.z; hc++) {
+        float sum = hiddenActivations[hc + hiddenColumnIndex * hiddenSize.z];
+
+        if (sum > maxActivation) {
+            maxActivation = sum;
+            maxIndex = hc;
+        }
+    }
+
+    hiddenCs[hiddenColumnIndex] = maxIndex;
+}
+
 void Predictor::learn(
     const Int2 &pos,
     std::mt19937 &rng,
-    const IntBuffer* hiddenTargetCs
+    const IntBuffer* hiddenTargetCs,
+    int t
 ) {
     int hiddenColumnIndex = address2(pos, Int2(hiddenSize.x, hiddenSize.y));
 
     int targetC = (*hiddenTargetCs)[hiddenColumnIndex];
 
+    // Absent target
+    if (targetC < 0)
+        return;
+
+    if (learnFraction < 1.0f && !learnTurn(learnCredits[hiddenColumnIndex], learnFraction, rng))
+        return;
+
+    // Scratch, reused across calls on the same thread
+    static thread_local FloatBuffer activations;
+
+    activations.resize(hiddenSize.z);
+
+    int count = 0; // Same receptive field for every cell of the column
+
+    int maxIndex = 0;
+    float maxActivation = -999999.0f;
+    float secondActivation = -999999.0f;
+
     for (int hc = 0; hc < hiddenSize.z; hc++) {
         int hiddenIndex = address3(Int3(pos.x, pos.y, hc), hiddenSize);
 
         float sum = 0.0f;
-        int count = 0;
+
+        count = 0;
 
         for (int vli = 0; vli < visibleLayers.size(); vli++) {
             VisibleLayer &vl = visibleLayers[vli];
             const VisibleLayerDesc &vld = visibleLayerDescs[vli];
 
-            sum += vl.weights.multiplyOHVs(vl.inputCsPrev, hiddenIndex, vld.size.z);
-            count += vl.weights.count(hiddenIndex) / vld.size.z;
+            if (vld.shared) {
+                int subCount;
+
+                float subSum = multiplySharedOHVs(vl.sharedWeights, vl.inputCsPrev, Int3(pos.x, pos.y, hc), vld.size, hiddenSize, vld.radius, subCount);
+
+                if (!hiddenActivationsExact)
+                    sum += subSum;
+
+                count += subCount;
+            }
+            else {
+                if (!hiddenActivationsExact)
+                    sum += vl.weights.multiplyOHVs(vl.inputCsPrev, hiddenIndex, vld.size.z);
+
+                count += vl.weights.count(hiddenIndex) / vld.size.z;
+            }
         }
 
+        // Forward pass already summed the same weights onto the same inputs
+        if (hiddenActivationsExact)
+            sum = hiddenActivations[hiddenIndex];
+
         sum /= std::max(1, count);
 
-        float delta = alpha * ((hc == targetC ? 1.0f : -1.0f) - std::tanh(sum));
+        activations[hc] = sum;
+
+        if (sum > maxActivation) {
+            secondActivation = maxActivation;
+            maxActivation = sum;
+            maxIndex = hc;
+        }
+        else if (sum > secondActivation)
+            secondActivation = sum;
+    }
+
+    // Correct with a margin, nothing to learn
+    if (gateMargin >= 0.0f && maxIndex == targetC && maxActivation - secondActivation >= gateMargin)
+        return;
+
+    for (int hc = 0; hc < hiddenSize.z; hc++) {
+        int hiddenIndex = address3(Int3(pos.x, pos.y, hc), hiddenSize);
+
+        float delta = alpha * ((hc == targetC ? 1.0f : -1.0f) - std::tanh(activations[hc]));
+
+        if (std::abs(delta) < gateDelta)
+            continue;
 
         for (int vli = 0; vli < visibleLayers.size(); vli++) {
             VisibleLayer &vl = visibleLayers[vli];
             const VisibleLayerDesc &vld = visibleLayerDescs[vli];
 
-            vl.weights.deltaOHVs(vl.inputCsPrev, delta, hiddenIndex, vld.size.z);
+            // Shared kernels accumulate into this thread's deltas, applied after the launch
+            if (vld.shared)
+                deltaSharedOHVs(vl.sharedDeltas[t], vl.inputCsPrev, delta, Int3(pos.x, pos.y, hc), vld.size, hiddenSize, vld.radius);
+            else if (commitInterval > 1)
+                vl.weights.deferDeltaOHVs(vl.inputCsPrev, delta, hiddenIndex, vld.size.z, vl.deferredIndices[hiddenColumnIndex], vl.deferredValues[hiddenColumnIndex]);
+            else
+                vl.weights.deltaOHVs(vl.inputCsPrev, delta, hiddenIndex, vld.size.z);
+        }
+
+        // Every weight onto inputCsPrev moved by delta (deferred updates move them on commit, which invalidates the accumulators)
+        if (hiddenActivationsValid && commitInterval <= 1)
+            hiddenActivations[hiddenIndex] += delta * count;
+    }
+
+    for (int vli = 0; vli < visibleLayers.size(); vli++) {
+        if (visibleLayerDescs[vli].shared)
+            visibleLayers[vli].sharedCounts[t]++;
+    }
+}
+
+void Predictor::forwardHeads(
+    const Int2 &pos,
+    std::mt19937 &rng,
+    const std::vector<Predictor*> &heads,
+    const std::vector<const IntBuffer*> &inputCs
+) {
+    const Predictor* p0 = heads[0];
+
+    const Int3 &hiddenSize = p0->hiddenSize;
+
+    int numHeads = heads.size();
+
+    int hiddenColumnIndex = address2(pos, Int2(hiddenSize.x, hiddenSize.y));
+
+    // Scratch, reused across calls on the same thread
+    static thread_local FloatBuffer sums;
+    static thread_local FloatBuffer subSums;
+    static thread_local FloatBuffer maxActivations;
+    static thread_local IntBuffer maxIndices;
+
+    sums.resize(numHeads);
+    subSums.resize(numHeads);
+    maxActivations.assign(numHeads, -999999.0f);
+    maxIndices.assign(numHeads, 0);
+
+    for (int hc = 0; hc < hiddenSize.z; hc++) {
+        int hiddenIndex = address3(Int3(pos.x, pos.y, hc), hiddenSize);
+
+        sums.assign(numHeads, 0.0f);
+
+        for (int vli = 0; vli < p0->visibleLayers.size(); vli++) {
+            const SparseMatrix &structure = p0->visibleLayers[vli].weights;
+            const IntBuffer &visibleCs = *inputCs[vli];
+
+            int oneHotSize = p0->visibleLayerDescs[vli].size.z;
+
+            subSums.assign(numHeads, 0.0f);
+
+            // Same traversal as SparseMatrix::multiplyOHVs, for every head at once
+            for (int jj = structure.rowRanges[hiddenIndex]; jj < structure.rowRanges[hiddenIndex + 1]; jj += oneHotSize) {
+                int j = jj + visibleCs[structure.columnIndices[jj] / oneHotSize];
+
+                for (int h = 0; h < numHeads; h++)
+                    subSums[h] += heads[h]->visibleLayers[vli].weights.nonZeroValues[j];
+            }
+
+            for (int h = 0; h < numHeads; h++)
+                sums[h] += subSums[h];
+        }
+
+        for (int h = 0; h < numHeads; h++) {
+            heads[h]->hiddenActivations[hiddenIndex] = sums[h];
+
+            if (sums[h] > maxActivations[h]) {
+                maxActivations[h] = sums[h];
+                maxIndices[h] = hc;
+            }
+        }
+    }
+
+    for (int h = 0; h < numHeads; h++)
+        heads[h]->hiddenCs[hiddenColumnIndex] = maxIndices[h];
+}
+
+void Predictor::learnHeads(
+    const Int2 &pos,
+    std::mt19937 &rng,
+    const std::vector<Predictor*> &heads,
+    const std::vector<const IntBuffer*> &hiddenTargetCs
+) {
+    Predictor* p0 = heads[0];
+
+    const Int3 &hiddenSize = p0->hiddenSize;
+
+    int numHeads = heads.size();
+
+    int hiddenColumnIndex = address2(pos, Int2(hiddenSize.x, hiddenSize.y));
+
+    // Same receptive field for every cell of the column and every head
+    int count = 0;
+
+    for (int vli = 0; vli < p0->visibleLayers.size(); vli++)
+        count += p0->visibleLayers[vli].weights.count(address3(Int3(pos.x, pos.y, 0), hiddenSize)) / p0->visibleLayerDescs[vli].size.z;
+
+    // Scratch, reused across calls on the same thread
+    static thread_local FloatBuffer deltas;
+    static thread_local std::vector<Predictor*> activeHeads;
+
+    deltas.resize(numHeads * hiddenSize.z);
+    activeHeads.clear();
+
+    // Decide on each head's deltas from the sums of the last forward pass
+    for (int h = 0; h < numHeads; h++) {
+        Predictor* p = heads[h];
+
+        if (hiddenTargetCs[h] == nullptr)
+            continue;
+
+        int targetC = (*hiddenTargetCs[h])[hiddenColumnIndex];
+
+        // Absent target
+        if (targetC < 0)
+            continue;
+
+        if (p->learnFraction < 1.0f && !learnTurn(p->learnCredits[hiddenColumnIndex], p->learnFraction, rng))
+            continue;
+
+        int maxIndex = 0;
+        float maxActivation = -999999.0f;
+        float secondActivation = -999999.0f;
+
+        for (int hc = 0; hc < hiddenSize.z; hc++) {
+            float sum = p->hiddenActivations[address3(Int3(pos.x, pos.y, hc), hiddenSize)] / std::max(1, count);
+
+            if (sum > maxActivation) {
+                secondActivation = maxActivation;
+                maxActivation = sum;
+                maxIndex = hc;
+            }
+            else if (sum > secondActivation)
+                secondActivation = sum;
+        }
+
+        // Correct with a margin, nothing to learn
+        if (p->gateMargin >= 0.0f && maxIndex == targetC && maxActivation - secondActivation >= p->gateMargin)
+            continue;
+
+        for (int hc = 0; hc < hiddenSize.z; hc++) {
+            float sum = p->hiddenActivations[address3(Int3(pos.x, pos.y, hc), hiddenSize)] / std::max(1, count);
+
+            float delta = p->alpha * ((hc == targetC ? 1.0f : -1.0f) - std::tanh(sum));
+
+            // A zero delta leaves the weights unchanged, same as skipping the update
+            deltas[activeHeads.size() * hiddenSize.z + hc] = std::abs(delta) < p->gateDelta ? 0.0f : delta;
+        }
+
+        activeHeads.push_back(p);
+    }
+
+    if (activeHeads.empty())
+        return;
+
+    int numActive = activeHeads.size();
+
+    for (int hc = 0; hc < hiddenSize.z; hc++) {
+        int hiddenIndex = address3(Int3(pos.x, pos.y, hc), hiddenSize);
+
+        for (int vli = 0; vli < p0->visibleLayers.size(); vli++) {
+            const SparseMatrix &structure = p0->visibleLayers[vli].weights;
+            const IntBuffer &visibleCs = p0->visibleLayers[vli].inputCsPrev;
+
+            int oneHotSize = p0->visibleLayerDescs[vli].size.z;
+
+            // Same traversal as SparseMatrix::deltaOHVs, for every head at once
+            for (int jj = structure.rowRanges[hiddenIndex]; jj < structure.rowRanges[hiddenIndex + 1]; jj += oneHotSize) {
+                int j = jj + visibleCs[structure.columnIndices[jj] / oneHotSize];
+
+                for (int a = 0; a < numActive; a++)
+                    activeHeads[a]->visibleLayers[vli].weights.nonZeroValues[j] += deltas[a * hiddenSize.z + hc];
+            }
+        }
+
+        // Every weight onto inputCsPrev moved by delta
+        for (int a = 0; a < numActive; a++) {
+            if (activeHeads[a]->hiddenActivationsValid)
+                activeHeads[a]->hiddenActivations[hiddenIndex] += deltas[a * hiddenSize.z + hc] * count;
+        }
+    }
+}
+
+bool Predictor::sameStructure(
+    const std::vector<Predictor*> &heads
+) {
+    if (heads.size() < 2)
+        return false;
+
+    const Predictor* p0 = heads[0];
+
+    for (int h = 0; h < heads.size(); h++) {
+        const Predictor* p = heads[h];
+
+        if (p->hiddenSize.x != p0->hiddenSize.x || p->hiddenSize.y != p0->hiddenSize.y || p->hiddenSize.z != p0->hiddenSize.z)
+            return false;
+
+        if (p->visibleLayers.size() != p0->visibleLayers.size())
+            return false;
+
+        for (int vli = 0; vli < p->visibleLayers.size(); vli++) {
+            const VisibleLayerDesc &vld = p->visibleLayerDescs[vli];
+            const VisibleLayerDesc &vld0 = p0->visibleLayerDescs[vli];
+
+            if (vld.shared || vld0.shared || vld.radius != vld0.radius)
+                return false;
+
+            if (vld.size.x != vld0.size.x || vld.size.y != vld0.size.y || vld.size.z != vld0.size.z)
+                return false;
+
+            if (p->visibleLayers[vli].weights.nonZeroValues.size() != p0->visibleLayers[vli].weights.nonZeroValues.size())
+                return false;
+        }
+    }
+
+    return true;
+}
+
+void Predictor::activateHeads(
+    ComputeSystem &cs,
+    const std::vector<Predictor*> &heads,
+    const std::vector<const IntBuffer*> &inputCs
+) {
+    for (int h = 0; h < heads.size(); h++)
+        heads[h]->waitCommit();
+
+    if (!sameStructure(heads)) {
+        for (int h = 0; h < heads.size(); h++)
+            heads[h]->activate(cs, inputCs);
+
+        return;
+    }
+
+    const Int3 &hiddenSize = heads[0]->hiddenSize;
+
+    for (int h = 0; h < heads.size(); h++)
+        heads[h]->hiddenActivations.resize(hiddenSize.x * hiddenSize.y * hiddenSize.z);
+
+    // Forward kernel
+    runKernel2(cs, std::bind(Predictor::forwardHeadsKernel, std::placeholders::_1, std::placeholders::_2, heads, inputCs), Int2(hiddenSize.x, hiddenSize.y), cs.rng, cs.batchSize2);
+
+    for (int h = 0; h < heads.size(); h++) {
+        Predictor* p = heads[h];
+
+        // Copy to prevs
+        for (int vli = 0; vli < p->visibleLayers.size(); vli++)
+            p->visibleLayers[vli].inputCsPrev = *inputCs[vli];
+
+        // Accumulators no longer track the weights/inputs, but hold the exact sums for learning
+        p->hiddenActivationsValid = false;
+        p->hiddenActivationsExact = true;
+
+        p->pending = false;
+    }
+}
+
+void Predictor::learnHeads(
+    ComputeSystem &cs,
+    const std::vector<Predictor*> &heads,
+    const std::vector<const IntBuffer*> &hiddenTargetCs
+) {
+    for (int h = 0; h < heads.size(); h++)
+        heads[h]->waitCommit();
+
+    // Fused learning reads the sums of the last forward pass and the inputs of the first head
+    bool fused = sameStructure(heads);
+
+    for (int h = 0; fused && h < heads.size(); h++) {
+        // Fused learning applies updates immediately
+        if (!heads[h]->hiddenActivationsExact || heads[h]->commitInterval > 1 || heads[h]->learnSteps > 0)
+            fused = false;
+        else {
+            for (int vli = 0; vli < heads[h]->visibleLayers.size(); vli++) {
+                if (heads[h]->visibleLayers[vli].inputCsPrev != heads[0]->visibleLayers[vli].inputCsPrev)
+                    fused = false;
+            }
         }
     }
+
+    if (!fused) {
+        for (int h = 0; h < heads.size(); h++) {
+            if (hiddenTargetCs[h] != nullptr)
+                heads[h]->learn(cs, hiddenTargetCs[h]);
+        }
+
+        return;
+    }
+
+    const Int3 &hiddenSize = heads[0]->hiddenSize;
+
+    // Learn kernel
+    runKernel2(cs, std::bind(Predictor::learnHeadsKernel, std::placeholders::_1, std::placeholders::_2, heads, hiddenTargetCs), Int2(hiddenSize.x, hiddenSize.y), cs.rng, cs.batchSize2);
+
+    for (int h = 0; h < heads.size(); h++) {
+        if (hiddenTargetCs[h] != nullptr)
+            heads[h]->hiddenActivationsExact = false;
+    }
+}
+
+void Predictor::initDeferred() {
+    int numHiddenColumns = hiddenSize.x * hiddenSize.y;
+
+    for (int vli = 0; vli < visibleLayers.size(); vli++) {
+        VisibleLayer &vl = visibleLayers[vli];
+
+        if (vl.deferredIndices.size() != numHiddenColumns) {
+            vl.deferredIndices.resize(numHiddenColumns);
+            vl.deferredValues.resize(numHiddenColumns);
+        }
+    }
+}
+
+void Predictor::countLearnStep(
+    ComputeSystem &cs
+) {
+    if (commitInterval > 1)
+        learnSteps++;
+
+    // Also commits leftovers once mini-batch mode is turned off
+    if (learnSteps > 0 && learnSteps >= commitInterval)
+        commit(cs);
+}
+
+const Predictor &Predictor::operator=(
+    const Predictor &other
+) {
+    // The background commits write the weights being copied and replaced
+    other.waitCommit();
+
+    waitCommit();
+
+    hiddenSize = other.hiddenSize;
+
+    hiddenCs = other.hiddenCs;
+
+    hiddenActivations = other.hiddenActivations;
+    hiddenActivationsValid = other.hiddenActivationsValid;
+    hiddenActivationsExact = other.hiddenActivationsExact;
+
+    pending = other.pending;
+
+    hiddenChanges = other.hiddenChanges;
+    updateColumns = other.updateColumns;
+    updateCsPrev = other.updateCsPrev;
+    updateFlags = other.updateFlags;
+
+    learnCredits = other.learnCredits;
+
+    learnSteps = other.learnSteps;
+
+    visibleLayers = other.visibleLayers;
+    visibleLayerDescs = other.visibleLayerDescs;
+
+    // Nothing left to commit in the background
+    commitFuture = std::shared_future<void>();
+
+    alpha = other.alpha;
+    learnFraction = other.learnFraction;
+    gateMargin = other.gateMargin;
+    gateDelta = other.gateDelta;
+    commitInterval = other.commitInterval;
+    asyncCommit = other.asyncCommit;
+
+    return *this;
+}
+
+void Predictor::waitCommit() const {
+    if (commitFuture.valid())
+        commitFuture.wait();
+}
+
+void Predictor::flushDeferred() {
+    waitCommit();
+
+    int numHiddenColumns = hiddenSize.x * hiddenSize.y;
+
+    for (int i = 0; i < numHiddenColumns; i++)
+        applyDeferred(i);
+
+    learnSteps = 0;
+}
+
+void Predictor::clearDeferred() {
+    waitCommit();
+
+    for (int vli = 0; vli < visibleLayers.size(); vli++) {
+        VisibleLayer &vl = visibleLayers[vli];
+
+        vl.deferredIndices.clear();
+        vl.deferredValues.clear();
+    }
+
+    learnSteps = 0;
+}
+
+void Predictor::applyDeferred(
+    int i
+) {
+    // Updates of a hidden column only touch its own rows, so columns can be applied in parallel
+    for (int vli = 0; vli < visibleLayers.size(); vli++) {
+        VisibleLayer &vl = visibleLayers[vli];
+
+        if (i < vl.deferredIndices.size())
+            vl.weights.applyDeferredDeltas(vl.deferredIndices[i], vl.deferredValues[i]);
+    }
+}
+
+bool Predictor::hasSharedLayers() const {
+    for (int vli = 0; vli < visibleLayers.size(); vli++) {
+        if (visibleLayerDescs[vli].shared)
+            return true;
+    }
+
+    return false;
+}
+
+void Predictor::clearSharedDeltas(
+    int numThreads
+) {
+    for (int vli = 0; vli < visibleLayers.size(); vli++) {
+        VisibleLayer &vl = visibleLayers[vli];
+
+        if (!visibleLayerDescs[vli].shared)
+            continue;
+
+        vl.sharedDeltas.resize(numThreads);
+        vl.sharedCounts.assign(numThreads, 0);
+
+        for (int t = 0; t < numThreads; t++)
+            vl.sharedDeltas[t].assign(vl.sharedWeights.size(), 0.0f);
+    }
+}
+
+void Predictor::applySharedDeltas() {
+    for (int vli = 0; vli < visibleLayers.size(); vli++) {
+        VisibleLayer &vl = visibleLayers[vli];
+
+        if (!visibleLayerDescs[vli].shared)
+            continue;
+
+        int count = 0;
+
+        for (int t = 0; t < vl.sharedCounts.size(); t++)
+            count += vl.sharedCounts[t];
+
+        if (count == 0)
+            continue;
+
+        // Average over the hidden columns that learned, so the step size does not grow with the layer size (each delta already includes alpha)
+        float scale = 1.0f / count;
+
+        for (int t = 0; t < vl.sharedDeltas.size(); t++) {
+            for (int i = 0; i < vl.sharedWeights.size(); i++)
+                vl.sharedWeights[i] += vl.sharedDeltas[t][i] * scale;
+        }
+    }
+}
+
+void Predictor::accumulateChange(
+    int vli,
+    int visibleColumnIndex,
+    int inputC
+) {
+    VisibleLayer &vl = visibleLayers[vli];
+    const VisibleLayerDesc &vld = visibleLayerDescs[vli];
+
+    int inputCPrev = vl.inputCsPrev[visibleColumnIndex];
+
+    if (inputC == inputCPrev)
+        return;
+
+    vl.inputCsPrev[visibleColumnIndex] = inputC;
+
+    int visibleIndexPrev = inputCPrev + visibleColumnIndex * vld.size.z;
+    int visibleIndex = inputC + visibleColumnIndex * vld.size.z;
+
+    // Both visible cells are referenced by the same hidden cells, in the same order
+    int startPrev = vl.weights.columnRanges[visibleIndexPrev];
+    int start = vl.weights.columnRanges[visibleIndex];
+    int count = vl.weights.columnRanges[visibleIndex + 1] - start;
+
+    for (int k = 0; k < count; k++) {
+        int hiddenIndex = vl.weights.rowIndices[start + k];
+
+        hiddenActivations[hiddenIndex] += vl.weights.nonZeroValues[vl.weights.nonZeroValueIndices[start + k]] - vl.weights.nonZeroValues[vl.weights.nonZeroValueIndices[startPrev + k]];
+
+        int hiddenColumnIndex = hiddenIndex / hiddenSize.z;
+
+        if (!updateFlags[hiddenColumnIndex]) {
+            updateFlags[hiddenColumnIndex] = true;
+
+            updateColumns.push_back(hiddenColumnIndex);
+        }
+    }
+}
+
+void Predictor::remapHidden(
+    const IntBuffer &cellMap,
+    int newZ
+) {
+    // Pending updates refer to the old weight layout
+    flushDeferred();
+
+    int numHiddenColumns = hiddenSize.x * hiddenSize.y;
+
+    IntBuffer rowMap = cellMapToIndexMap(cellMap, hiddenSize.z, newZ);
+
+    IntBuffer outCellMap(cellMap.begin(), cellMap.begin() + hiddenSize.z);
+
+    for (int vli = 0; vli < visibleLayers.size(); vli++) {
+        VisibleLayer &vl = visibleLayers[vli];
+        const VisibleLayerDesc &vld = visibleLayerDescs[vli];
+
+        if (vld.shared)
+            remapSharedKernel(vl.sharedWeights, identityCellMap(vld.size.z), vld.size.z, outCellMap, newZ, vld.radius);
+        else {
+            bool hasT = !vl.weights.columnRanges.empty();
+
+            vl.weights.remapRows(rowMap, numHiddenColumns * newZ);
+
+            if (hasT)
+                vl.weights.initT();
+        }
+    }
+
+    remapCs(hiddenCs, cellMap, hiddenSize.z);
+
+    hiddenSize.z = newZ;
+
+    hiddenActivationsValid = false;
+    hiddenActivationsExact = false;
+}
+
+void Predictor::remapVisible(
+    int vli,
+    const IntBuffer &cellMap,
+    int newZ
+) {
+    flushDeferred();
+
+    VisibleLayer &vl = visibleLayers[vli];
+    VisibleLayerDesc &vld = visibleLayerDescs[vli];
+
+    int numVisibleColumns = vld.size.x * vld.size.y;
+
+    if (vld.shared) {
+        IntBuffer inCellMap(cellMap.begin(), cellMap.begin() + vld.size.z);
+
+        remapSharedKernel(vl.sharedWeights, inCellMap, newZ, identityCellMap(hiddenSize.z), hiddenSize.z, vld.radius);
+    }
+    else {
+        bool hasT = !vl.weights.columnRanges.empty();
+
+        vl.weights.remapColumns(cellMapToIndexMap(cellMap, vld.size.z, newZ), numVisibleColumns * newZ);
+
+        if (hasT)
+            vl.weights.initT();
+    }
+
+    remapCs(vl.inputCsPrev, cellMap, vld.size.z);
+
+    vld.size.z = newZ;
+
+    hiddenActivationsValid = false;
+    hiddenActivationsExact = false;
 }
 
 void Predictor::initRandom(
@@ -81,6 +790,8 @@ void Predictor::initRandom(
     const Int3 &hiddenSize,
     const std::vector<VisibleLayerDesc> &visibleLayerDescs
 ) {
+    clearDeferred();
+
     this->visibleLayerDescs = visibleLayerDescs;
 
     this->hiddenSize = hiddenSize;
@@ -100,17 +811,33 @@ void Predictor::initRandom(
 
         int numVisibleColumns = vld.size.x * vld.size.y;
 
-        // Create weight matrix for this visible layer and initialize randomly
-        initSMLocalRF(vld.size, hiddenSize, vld.radius, vl.weights);
+        if (vld.shared) {
+            // Create one kernel for all hidden columns and initialize randomly
+            vl.sharedWeights.resize(sharedKernelSize(vld.size, hiddenSize, vld.radius));
+
+            for (int i = 0; i < vl.sharedWeights.size(); i++)
+                vl.sharedWeights[i] = weightDist(cs.rng);
+        }
+        else {
+            // Create weight matrix for this visible layer and initialize randomly
+            initSMLocalRF(vld.size, hiddenSize, vld.radius, vl.weights);
 
-        for (int i = 0; i < vl.weights.nonZeroValues.size(); i++)
-            vl.weights.nonZeroValues[i] = weightDist(cs.rng);
+            for (int i = 0; i < vl.weights.nonZeroValues.size(); i++)
+                vl.weights.nonZeroValues[i] = weightDist(cs.rng);
+        }
 
         vl.inputCsPrev = IntBuffer(numVisibleColumns, 0);
     }
 
     // Hidden Cs
     hiddenCs = IntBuffer(numHiddenColumns, 0);
+
+    learnCredits = FloatBuffer(numHiddenColumns, -1.0f);
+
+    hiddenActivationsValid = false;
+    hiddenActivationsExact = false;
+
+    pending = false;
 }
 
 void Predictor::activate(
@@ -120,17 +847,165 @@ void Predictor::activate(
     int numHiddenColumns = hiddenSize.x * hiddenSize.y;
     int numHidden = numHiddenColumns * hiddenSize.z;
 
+    waitCommit();
+
+    hiddenActivations.resize(numHidden);
+
     // Forward kernel
     runKernel2(cs, std::bind(Predictor::forwardKernel, std::placeholders::_1, std::placeholders::_2, this, inputCs), Int2(hiddenSize.x, hiddenSize.y), cs.rng, cs.batchSize2);
 
     // Copy to prevs
+    for (int vli = 0; vli < visibleLayers.size(); vli++)
+        visibleLayers[vli].inputCsPrev = *inputCs[vli];
+
+    // Accumulators no longer track the weights/inputs, but hold the exact sums for learning
+    hiddenActivationsValid = false;
+    hiddenActivationsExact = true;
+
+    pending = false;
+}
+
+void Predictor::activateBatch(
+    ComputeSystem &cs,
+    const std::vector<std::vector<const IntBuffer*>> &inputCs,
+    const std::vector<IntBuffer*> &hiddenCs
+) {
+    assert(inputCs.size() >= hiddenCs.size());
+
+    waitCommit();
+
+    runKernel2(cs, std::bind(Predictor::forwardBatchKernel, std::placeholders::_1, std::placeholders::_2, this, inputCs, hiddenCs), Int2(hiddenSize.x, hiddenSize.y), cs.rng, cs.batchSize2);
+}
+
+void Predictor::defer(
+    ComputeSystem &cs,
+    const std::vector<const IntBuffer*> &inputCs
+) {
+    // Copy to prevs
+    for (int vli = 0; vli < visibleLayers.size(); vli++)
+        visibleLayers[vli].inputCsPrev = *inputCs[vli];
+
+    hiddenActivationsValid = false;
+    hiddenActivationsExact = false;
+
+    pending = true;
+}
+
+void Predictor::evaluate(
+    ComputeSystem &cs
+) {
+    if (!pending)
+        return;
+
+    waitCommit();
+
+    int numHiddenColumns = hiddenSize.x * hiddenSize.y;
+    int numHidden = numHiddenColumns * hiddenSize.z;
+
+    // Inputs were recorded by defer
+    std::vector<const IntBuffer*> inputCs(visibleLayers.size());
+
+    for (int vli = 0; vli < visibleLayers.size(); vli++)
+        inputCs[vli] = &visibleLayers[vli].inputCsPrev;
+
+    hiddenActivations.resize(numHidden);
+
+    // Forward kernel
+    runKernel2(cs, std::bind(Predictor::forwardKernel, std::placeholders::_1, std::placeholders::_2, this, inputCs), Int2(hiddenSize.x, hiddenSize.y), cs.rng, cs.batchSize2);
+
+    hiddenActivationsExact = true;
+
+    pending = false;
+}
+
+void Predictor::activate(
+    ComputeSystem &cs,
+    const std::vector<const IntBuffer*> &inputCs,
+    const std::vector<const IntBuffer*> &inputChanges
+) {
+    int numHiddenColumns = hiddenSize.x * hiddenSize.y;
+    int numHidden = numHiddenColumns * hiddenSize.z;
+
+    waitCommit();
+
+    hiddenChanges.clear();
+
+    pending = false;
+
+    // Shared kernels have no transpose to scatter changes through
+    if (hasSharedLayers())
+        hiddenActivationsValid = false;
+
+    if (!hiddenActivationsValid) {
+        // Full refresh
+        IntBuffer hiddenCsPrev = hiddenCs;
+
+        hiddenActivations.resize(numHidden);
+
+        runKernel2(cs, std::bind(Predictor::forwardKernel, std::placeholders::_1, std::placeholders::_2, this, inputCs), Int2(hiddenSize.x, hiddenSize.y), cs.rng, cs.batchSize2);
+
+        for (int vli = 0; vli < visibleLayers.size(); vli++) {
+            VisibleLayer &vl = visibleLayers[vli];
+
+            // Transpose is needed to scatter input changes
+            if (!visibleLayerDescs[vli].shared && vl.weights.columnRanges.empty())
+                vl.weights.initT();
+
+            vl.inputCsPrev = *inputCs[vli];
+        }
+
+        for (int i = 0; i < numHiddenColumns; i++) {
+            if (hiddenCs[i] != hiddenCsPrev[i])
+                hiddenChanges.push_back(i);
+        }
+
+        updateFlags.resize(numHiddenColumns, false);
+
+        hiddenActivationsValid = true;
+        hiddenActivationsExact = true;
+
+        return;
+    }
+
+    // Incremental updates do not reproduce the sums exactly
+    hiddenActivationsExact = false;
+
+    updateColumns.clear();
+
+    // Scatter input changes into the accumulators
     for (int vli = 0; vli < visibleLayers.size(); vli++) {
-        VisibleLayer &vl = visibleLayers[vli];
-        VisibleLayerDesc &vld = visibleLayerDescs[vli];
+        const VisibleLayerDesc &vld = visibleLayerDescs[vli];
 
-        int numVisibleColumns = vld.size.x * vld.size.y;
+        if (inputChanges[vli] == nullptr) {
+            int numVisibleColumns = vld.size.x * vld.size.y;
+
+            for (int i = 0; i < numVisibleColumns; i++)
+                accumulateChange(vli, i, (*inputCs[vli])[i]);
+        }
+        else {
+            for (int i = 0; i < inputChanges[vli]->size(); i++) {
+                int visibleColumnIndex = (*inputChanges[vli])[i];
 
-        runKernel1(cs, std::bind(copyInt, std::placeholders::_1, std::placeholders::_2, inputCs[vli], &vl.inputCsPrev), numVisibleColumns, cs.rng, cs.batchSize1);
+                accumulateChange(vli, visibleColumnIndex, (*inputCs[vli])[visibleColumnIndex]);
+            }
+        }
+    }
+
+    // Re-run argmax on affected columns only
+    updateCsPrev.resize(updateColumns.size());
+
+    for (int i = 0; i < updateColumns.size(); i++) {
+        updateCsPrev[i] = hiddenCs[updateColumns[i]];
+
+        updateFlags[updateColumns[i]] = false;
+    }
+
+    if (!updateColumns.empty())
+        runKernel1(cs, std::bind(Predictor::chooseKernel, std::placeholders::_1, std::placeholders::_2, this), updateColumns.size(), cs.rng, cs.batchSize1);
+
+    for (int i = 0; i < updateColumns.size(); i++) {
+        if (hiddenCs[updateColumns[i]] != updateCsPrev[i])
+            hiddenChanges.push_back(updateColumns[i]);
     }
 }
 
@@ -138,19 +1013,100 @@ void Predictor::learn(
     ComputeSystem &cs,
     const IntBuffer* hiddenTargetCs
 ) {
-    // Learn kernel
-    runKernel2(cs, std::bind(Predictor::learnKernel, std::placeholders::_1, std::placeholders::_2, this, hiddenTargetCs), Int2(hiddenSize.x, hiddenSize.y), cs.rng, cs.batchSize2);
+    waitCommit();
+
+    if (commitInterval > 1)
+        initDeferred();
+
+    // Learn kernel, shared kernel accumulators are sized from the team that runs it
+    runKernel2Team(cs, std::bind(Predictor::learnKernel, std::placeholders::_1, std::placeholders::_2, std::placeholders::_3, this, hiddenTargetCs),
+        std::bind(&Predictor::clearSharedDeltas, this, std::placeholders::_1), Int2(hiddenSize.x, hiddenSize.y), cs.rng, cs.batchSize2);
+
+    applySharedDeltas();
+
+    // Kernel updates are only known after the reduction
+    if (hasSharedLayers())
+        hiddenActivationsValid = false;
+
+    hiddenActivationsExact = false;
+
+    countLearnStep(cs);
+}
+
+void Predictor::keepInputs() {
+    for (int vli = 0; vli < visibleLayers.size(); vli++)
+        visibleLayers[vli].inputCsKept = visibleLayers[vli].inputCsPrev;
+}
+
+void Predictor::learnKept(
+    ComputeSystem &cs,
+    const IntBuffer* hiddenTargetCs
+) {
+    for (int vli = 0; vli < visibleLayers.size(); vli++)
+        std::swap(visibleLayers[vli].inputCsPrev, visibleLayers[vli].inputCsKept);
+
+    // Activations of the last activation do not belong to the kept inputs
+    hiddenActivationsExact = false;
+
+    learn(cs, hiddenTargetCs);
+
+    for (int vli = 0; vli < visibleLayers.size(); vli++)
+        std::swap(visibleLayers[vli].inputCsPrev, visibleLayers[vli].inputCsKept);
+
+    // Accumulators were moved along the kept inputs, not the current ones
+    hiddenActivationsValid = false;
+}
+
+void Predictor::commit(
+    ComputeSystem &cs
+) {
+    waitCommit();
+
+    learnSteps = 0;
+
+    if (asyncCommit) {
+        // Hand the pending updates over to the background pass, learning continues into empty lists
+        for (int vli = 0; vli < visibleLayers.size(); vli++) {
+            VisibleLayer &vl = visibleLayers[vli];
+
+            std::swap(vl.deferredIndices, vl.committingIndices);
+            std::swap(vl.deferredValues, vl.committingValues);
+        }
+
+        initDeferred();
+
+        commitFuture = std::async(std::launch::async, [this]() {
+            for (int vli = 0; vli < visibleLayers.size(); vli++) {
+                VisibleLayer &vl = visibleLayers[vli];
+
+                for (int i = 0; i < vl.committingIndices.size(); i++)
+                    vl.weights.applyDeferredDeltas(vl.committingIndices[i], vl.committingValues[i]);
+            }
+        }).share();
+    }
+    else
+        runKernel1(cs, std::bind(Predictor::applyDeferredKernel, std::placeholders::_1, std::placeholders::_2, this), hiddenSize.x * hiddenSize.y, cs.rng, cs.batchSize1);
+
+    // Accumulators no longer track the weights
+    hiddenActivationsValid = false;
+    hiddenActivationsExact = false;
 }
 
 void Predictor::writeToStream(
     std::ostream &os
 ) const {
+    waitCommit();
+
     int numHiddenColumns = hiddenSize.x * hiddenSize.y;
     int numHidden = numHiddenColumns * hiddenSize.z;
 
     os.write(reinterpret_cast<const char*>(&hiddenSize), sizeof(Int3));
 
     os.write(reinterpret_cast<const char*>(&alpha), sizeof(float));
+    os.write(reinterpret_cast<const char*>(&learnFraction), sizeof(float));
+    os.write(reinterpret_cast<const char*>(&gateMargin), sizeof(float));
+    os.write(reinterpret_cast<const char*>(&gateDelta), sizeof(float));
+    os.write(reinterpret_cast<const char*>(&commitInterval), sizeof(int));
 
     writeBufferToStream(os, &hiddenCs);
 
@@ -166,6 +1122,8 @@ void Predictor::writeToStream(
 
         writeSMToStream(os, vl.weights);
 
+        writeBufferToStream(os, &vl.sharedWeights);
+
         writeBufferToStream(os, &vl.inputCsPrev);
     }
 }
@@ -173,15 +1131,23 @@ void Predictor::writeToStream(
 void Predictor::readFromStream(
     std::istream &is
 ) {
+    clearDeferred();
+
     is.read(reinterpret_cast<char*>(&hiddenSize), sizeof(Int3));
 
     int numHiddenColumns = hiddenSize.x * hiddenSize.y;
     int numHidden = numHiddenColumns * hiddenSize.z;
 
     is.read(reinterpret_cast<char*>(&alpha), sizeof(float));
+    is.read(reinterpret_cast<char*>(&learnFraction), sizeof(float));
+    is.read(reinterpret_cast<char*>(&gateMargin), sizeof(float));
+    is.read(reinterpret_cast<char*>(&gateDelta), sizeof(float));
+    is.read(reinterpret_cast<char*>(&commitInterval), sizeof(int));
 
     readBufferFromStream(is, &hiddenCs);
 
+    learnCredits = FloatBuffer(numHiddenColumns, -1.0f);
+
     int numVisibleLayers;
     
     is.read(reinterpret_cast<char*>(&numVisibleLayers), sizeof(int));
@@ -197,6 +1163,13 @@ void Predictor::readFromStream(
 
         readSMFromStream(is, vl.weights);
 
+        readBufferFromStream(is, &vl.sharedWeights);
+
         readBufferFromStream(is, &vl.inputCsPrev);
     }
+
+    hiddenActivationsValid = false;
+    hiddenActivationsExact = false;
+
+    pending = false;
 }
\ No newline at end of file
@@ -20,19 +20,35 @@ public:
 
         int radius; // Radius onto input
 
+        bool shared; // Whether all hidden columns share one weight kernel (convolutional). A learning step moves the kernel by the mean of the updates of the columns that learned, so alpha does not scale with the layer size
+
         // Defaults
         VisibleLayerDesc()
         :
         size(4, 4, 16),
-        radius(2)
+        radius(2),
+        shared(false)
         {}
     };
 
     // Visible layer
     struct VisibleLayer {
-        SparseMatrix weights; // Weight matrix
+        SparseMatrix weights; // Weight matrix (unused if shared)
+
+        FloatBuffer sharedWeights; // Shared weight kernel (shared only)
+
+        // Kernel update accumulators and learning position counts, one per thread of the learning team (shared only)
+        std::vector<FloatBuffer> sharedDeltas;
+        IntBuffer sharedCounts;
 
         IntBuffer inputCsPrev; // Previous timestep (prev) input states
+        IntBuffer inputCsKept; // Inputs of the activation before the last one, for learnKept
+
+        // Pending weight updates per hidden column, and those being applied by a background commit (mini-batch mode only)
+        std::vector<IntBuffer> deferredIndices;
+        std::vector<FloatBuffer> deferredValues;
+        std::vector<IntBuffer> committingIndices;
+        std::vector<FloatBuffer> committingValues;
     };
 
 private:
@@ -40,10 +56,29 @@ private:
 
     IntBuffer hiddenCs; // Hidden state
 
+    // Event-driven mode
+    FloatBuffer hiddenActivations; // Per-cell activation accumulators
+    bool hiddenActivationsValid; // Whether the accumulators match the current weights and inputCsPrev
+    bool hiddenActivationsExact; // Whether the accumulators hold the sums of the last full forward pass, with weights and inputCsPrev unchanged since (reused by learn)
+
+    bool pending; // Whether the last activation was deferred, so hiddenCs do not reflect inputCsPrev yet
+
+    IntBuffer hiddenChanges; // Hidden columns whose state changed on the last event-driven activation
+    IntBuffer updateColumns; // Hidden columns to re-run argmax on
+    IntBuffer updateCsPrev; // States of updateColumns before the argmax
+    std::vector<char> updateFlags; // Whether a hidden column is already in updateColumns
+
+    FloatBuffer learnCredits; // Learning schedule credit per hidden column
+
+    // Mini-batch mode
+    int learnSteps; // Learning steps since the last commit
+
     // Visible layers and descs
     std::vector<VisibleLayer> visibleLayers;
     std::vector<VisibleLayerDesc> visibleLayerDescs;
 
+    std::shared_future<void> commitFuture; // Background commit, if one was started. Declared last, so destruction waits for it before anything it writes goes away
+
     // --- Kernels ---
 
     void forward(
@@ -52,10 +87,23 @@ private:
         const std::vector<const IntBuffer*> &inputCs
     );
 
+    void forwardBatch(
+        const Int2 &pos,
+        std::mt19937 &rng,
+        const std::vector<std::vector<const IntBuffer*>> &inputCs,
+        const std::vector<IntBuffer*> &hiddenCs
+    );
+
+    void choose(
+        int i,
+        std::mt19937 &rng
+    );
+
     void learn(
         const Int2 &pos,
         std::mt19937 &rng,
-        const IntBuffer* hiddenTargetCs
+        const IntBuffer* hiddenTargetCs,
+        int t // Thread index in the learning team, selects the shared kernel accumulators
     );
 
     static void forwardKernel(
@@ -67,24 +115,183 @@ private:
         p->forward(pos, rng, inputCs);
     }
 
+    static void forwardBatchKernel(
+        const Int2 &pos,
+        std::mt19937 &rng,
+        Predictor* p,
+        const std::vector<std::vector<const IntBuffer*>> &inputCs,
+        const std::vector<IntBuffer*> &hiddenCs
+    ) {
+        p->forwardBatch(pos, rng, inputCs, hiddenCs);
+    }
+
+    static void chooseKernel(
+        int i,
+        std::mt19937 &rng,
+        Predictor* p
+    ) {
+        p->choose(i, rng);
+    }
+
     static void learnKernel(
         const Int2 &pos,
         std::mt19937 &rng,
+        int t,
         Predictor* p,
         const IntBuffer* hiddenTargetCs
     ) {
-        p->learn(pos, rng, hiddenTargetCs);
+        p->learn(pos, rng, hiddenTargetCs, t);
+    }
+
+    // --- Fused heads ---
+
+    static void forwardHeads(
+        const Int2 &pos,
+        std::mt19937 &rng,
+        const std::vector<Predictor*> &heads,
+        const std::vector<const IntBuffer*> &inputCs
+    );
+
+    static void learnHeads(
+        const Int2 &pos,
+        std::mt19937 &rng,
+        const std::vector<Predictor*> &heads,
+        const std::vector<const IntBuffer*> &hiddenTargetCs
+    );
+
+    static void forwardHeadsKernel(
+        const Int2 &pos,
+        std::mt19937 &rng,
+        const std::vector<Predictor*> &heads,
+        const std::vector<const IntBuffer*> &inputCs
+    ) {
+        forwardHeads(pos, rng, heads, inputCs);
+    }
+
+    static void learnHeadsKernel(
+        const Int2 &pos,
+        std::mt19937 &rng,
+        const std::vector<Predictor*> &heads,
+        const std::vector<const IntBuffer*> &hiddenTargetCs
+    ) {
+        learnHeads(pos, rng, heads, hiddenTargetCs);
+    }
+
+    // Whether the heads have identical weight structure, so one traversal serves all of them
+    static bool sameStructure(
+        const std::vector<Predictor*> &heads
+    );
+
+    // --- Shared weight helpers ---
+
+    bool hasSharedLayers() const;
+
+    // Zero the kernel update accumulators, one per thread of the learning team
+    void clearSharedDeltas(
+        int numThreads // Size of the learning team
+    );
+
+    // Reduce the per-thread kernel update accumulators into the shared kernels
+    void applySharedDeltas();
+
+    // --- Mini-batch helpers ---
+
+    // Size the pending update lists
+    void initDeferred();
+
+    // Count a learning step, committing when commitInterval is reached
+    void countLearnStep(
+        ComputeSystem &cs
+    );
+
+    // Block until a background commit is done
+    void waitCommit() const;
+
+    // Apply all pending updates serially
+    void flushDeferred();
+
+    // Discard all pending updates
+    void clearDeferred();
+
+    void applyDeferred(
+        int i
+    );
+
+    static void applyDeferredKernel(
+        int i,
+        std::mt19937 &rng,
+        Predictor* p
+    ) {
+        p->applyDeferred(i);
     }
 
+    // --- Event-driven helpers ---
+
+    void accumulateChange(
+        int vli,
+        int visibleColumnIndex,
+        int inputC
+    );
+
+    // --- Compaction helpers ---
+
+    // Remove hidden cells
+    void remapHidden(
+        const IntBuffer &cellMap, // Cell map over the hidden cells
+        int newZ // Hidden column size after compaction
+    );
+
+    // Remove input cells of a visible layer
+    void remapVisible(
+        int vli, // Index of visible layer
+        const IntBuffer &cellMap, // Cell map over the visible cells
+        int newZ // Visible column size after compaction
+    );
+
 public:
     float alpha; // Learning rate
+    float learnFraction; // Fraction of hidden columns that learn each step, in (0, 1]
+
+    // Error gating
+    float gateMargin; // Columns that predicted the target with at least this lead over the runner-up (normalized activation) do not learn. Negative disables
+    float gateDelta; // Cell updates with a smaller magnitude are skipped. 0 disables
+
+    // Mini-batch mode
+    int commitInterval; // Number of learning steps whose weight updates are accumulated and applied together. 1 applies them immediately
+    bool asyncCommit; // Whether accumulated updates are applied on a background thread, joined before the weights are next used
 
     // Defaults
     Predictor()
     :
-    alpha(0.5f)
+    hiddenActivationsValid(false),
+    hiddenActivationsExact(false),
+    pending(false),
+    learnSteps(0),
+    alpha(0.5f),
+    learnFraction(1.0f),
+    gateMargin(-1.0f),
+    gateDelta(0.0f),
+    commitInterval(1),
+    asyncCommit(false)
     {}
 
+    // Copy, once the background commit of the other predictor is done
+    Predictor(
+        const Predictor &other // Predictor to copy from
+    ) {
+        *this = other;
+    }
+
+    // Wait for the background commit, which writes the weights
+    ~Predictor() {
+        waitCommit();
+    }
+
+    // Assignment, once the background commits of both predictors are done
+    const Predictor &operator=(
+        const Predictor &other // Predictor to assign from
+    );
+
     // Create with random initialization
     void initRandom(
         ComputeSystem &cs, // Compute system
@@ -98,10 +305,68 @@ public:
         const std::vector<const IntBuffer*> &inputCs // Hidden/output/prediction size
     );
 
+    // Record the inputs of an activation without computing the predictions. Learning only needs the inputs, predictions are computed by evaluate when needed
+    void defer(
+        ComputeSystem &cs, // Compute system
+        const std::vector<const IntBuffer*> &inputCs // Input states
+    );
+
+    // Compute the predictions of a deferred activation. Does nothing if no activation is pending
+    void evaluate(
+        ComputeSystem &cs // Compute system
+    );
+
+    // Event-driven activation. Only hidden columns whose receptive field contains a changed input column are recomputed.
+    // Builds weight transposes on first use. The first call (and the first call after a regular activation or a state change) performs a full refresh
+    void activate(
+        ComputeSystem &cs, // Compute system
+        const std::vector<const IntBuffer*> &inputCs, // Input states
+        const std::vector<const IntBuffer*> &inputChanges // Indices of input columns that may have changed, per visible layer. nullptr means unknown (compare all columns)
+    );
+
+    // Predict for several independent input sets (streams) at once, without learning. The weights of each hidden column are loaded once for all streams.
+    // Does not touch the predictor's own states, results match activate on each stream
+    void activateBatch(
+        ComputeSystem &cs, // Compute system
+        const std::vector<std::vector<const IntBuffer*>> &inputCs, // Input states of each stream. Only the first hiddenCs.size() are read, so a longer reused buffer may be passed
+        const std::vector<IntBuffer*> &hiddenCs // Predictions of each stream (output)
+    );
+
     // Learning predictions (update weights)
     void learn(
         ComputeSystem &cs,
-        const IntBuffer* hiddenTargetCs
+        const IntBuffer* hiddenTargetCs // Target states, columns with negative targets do not learn
+    );
+
+    // Keep the inputs of the last activation before the next activation replaces them, so learnKept can learn from them afterwards
+    void keepInputs();
+
+    // Learn as learn would have before the last activation, from the inputs kept by keepInputs. Lets the activation run before learning.
+    // The weights then differ from the ones the activation used, event-driven activation refreshes fully next time
+    void learnKept(
+        ComputeSystem &cs,
+        const IntBuffer* hiddenTargetCs // Target states, columns with negative targets do not learn
+    );
+
+    // Activate several predictors (heads) reading the same inputs. Heads with identical structure share one traversal of the inputs per cell,
+    // otherwise each head is activated separately. Results match activating each head
+    static void activateHeads(
+        ComputeSystem &cs, // Compute system
+        const std::vector<Predictor*> &heads, // Predictors to activate
+        const std::vector<const IntBuffer*> &inputCs // Inputs shared by all heads
+    );
+
+    // Learn several predictors (heads) that were last activated together with activateHeads. Heads with identical structure share one traversal per cell,
+    // otherwise each head learns separately. Results match learning each head
+    static void learnHeads(
+        ComputeSystem &cs, // Compute system
+        const std::vector<Predictor*> &heads, // Predictors to update
+        const std::vector<const IntBuffer*> &hiddenTargetCs // Targets of each head, nullptr skips a head
+    );
+
+    // Apply the accumulated weight updates now (mini-batch mode). Updates not yet committed are not serialized
+    void commit(
+        ComputeSystem &cs // Compute system
     );
 
     // Write to stream
@@ -138,6 +403,16 @@ public:
         return hiddenCs;
     }
 
+    // Whether the last activation was deferred and not evaluated yet
+    bool isPending() const {
+        return pending;
+    }
+
+    // Get the hidden columns that changed on the last event-driven activation
+    const IntBuffer &getHiddenChanges() const {
+        return hiddenChanges;
+    }
+
     // Get the hidden size
     const Int3 &getHiddenSize() const {
         return hiddenSize;
@@ -8,12 +8,15 @@
 
 #include "SparseCoder.h"
 
+#include <algorithm>
+
 using namespace ogmaneo;
 
 void SparseCoder::forward(
     const Int2 &pos,
     std::mt19937 &rng,
-    const std::vector<const IntBuffer*> &inputCs
+    const std::vector<const IntBuffer*> &inputCs,
+    bool recordActivations
 ) {
     int hiddenColumnIndex = address2(pos, Int2(hiddenSize.x, hiddenSize.y));
 
@@ -30,9 +33,109 @@ void SparseCoder::forward(
             VisibleLayer &vl = visibleLayers[vli];
             const VisibleLayerDesc &vld = visibleLayerDescs[vli];
 
-            sum += vl.weights.multiplyOHVs(*inputCs[vli], hiddenIndex, vld.size.z) / std::max(1, vl.weights.count(hiddenIndex) / vld.size.z);
+            // Entirely absent input
+            if (vl.numPresent == 0)
+                continue;
+
+            if (vld.shared) {
+                int count;
+
+                float subSum = multiplySharedOHVs(vl.sharedWeights, *inputCs[vli], Int3(pos.x, pos.y, hc), vld.size, hiddenSize, vld.radius, count);
+
+                sum += subSum / std::max(1, count);
+            }
+            else if (vl.numPresent < vld.size.x * vld.size.y) {
+                // Renormalize over the present columns of the receptive field
+                int count;
+
+                float subSum = vl.weights.multiplyMaskedOHVs(*inputCs[vli], hiddenIndex, vld.size.z, count);
+
+                sum += subSum / std::max(1, count);
+            }
+            else
+                sum += vl.weights.multiplyOHVs(*inputCs[vli], hiddenIndex, vld.size.z) / std::max(1, vl.weights.count(hiddenIndex) / vld.size.z);
         }
 
+        if (recordActivations)
+            hiddenActivations[hiddenIndex] = sum;
+
+        if (sum > maxActivation) {
+            maxActivation = sum;
+            maxIndex = hc;
+        }
+    }
+
+    hiddenCs[hiddenColumnIndex] = maxIndex;
+}
+
+void SparseCoder::forwardBatch(
+    const Int2 &pos,
+    std::mt19937 &rng,
+    const std::vector<std::vector<const IntBuffer*>> &inputCs,
+    const std::vector<IntBuffer*> &hiddenCs
+) {
+    int hiddenColumnIndex = address2(pos, Int2(hiddenSize.x, hiddenSize.y));
+
+    int numStreams = hiddenCs.size();
+
+    // Scratch, reused across calls on the same thread
+    static thread_local FloatBuffer sums;
+    static thread_local FloatBuffer maxActivations;
+    static thread_local IntBuffer maxIndices;
+
+    sums.resize(numStreams);
+    maxActivations.assign(numStreams, -999999.0f);
+    maxIndices.assign(numStreams, 0);
+
+    for (int hc = 0; hc < hiddenSize.z; hc++) {
+        int hiddenIndex = address3(Int3(pos.x, pos.y, hc), hiddenSize);
+
+        sums.assign(numStreams, 0.0f);
+
+        // Each row is traversed for all streams while it is in cache
+        for (int vli = 0; vli < visibleLayers.size(); vli++) {
+            VisibleLayer &vl = visibleLayers[vli];
+            const VisibleLayerDesc &vld = visibleLayerDescs[vli];
+
+            for (int s = 0; s < numStreams; s++) {
+                // Same as forward, absent columns contribute nothing and the rest is renormalized (a complete input divides by the full receptive field)
+                int count;
+
+                float subSum;
+
+                if (vld.shared)
+                    subSum = multiplySharedOHVs(vl.sharedWeights, *inputCs[s][vli], Int3(pos.x, pos.y, hc), vld.size, hiddenSize, vld.radius, count);
+                else
+                    subSum = vl.weights.multiplyMaskedOHVs(*inputCs[s][vli], hiddenIndex, vld.size.z, count);
+
+                sums[s] += subSum / std::max(1, count);
+            }
+        }
+
+        for (int s = 0; s < numStreams; s++) {
+            if (sums[s] > maxActivations[s]) {
+                maxActivations[s] = sums[s];
+                maxIndices[s] = hc;
+            }
+        }
+    }
+
+    for (int s = 0; s < numStreams; s++)
+        (*hiddenCs[s])[hiddenColumnIndex] = maxIndices[s];
+}
+
+void SparseCoder::choose(
+    int i,
+    std::mt19937 &rng
+) {
+    int hiddenColumnIndex = updateColumns[i];
+
+    int maxIndex = 0;
+    float maxActivation = -999999.0f;
+
+    for (int hc = 0; hc < hiddenSize.z; hc++) {
+        float sum = hiddenActivations[hc + hiddenColumnIndex * hiddenSize.z];
+
         if (sum > maxActivation) {
             maxActivation = sum;
             maxIndex = hc;
@@ -46,7 +149,9 @@ void SparseCoder::learn(
     const Int2 &pos,
     std::mt19937 &rng,
     const IntBuffer* inputCs,
-    int vli
+    int vli,
+    bool recordDeltas,
+    int t
 ) {
     VisibleLayer &vl = visibleLayers[vli];
     VisibleLayerDesc &vld = visibleLayerDescs[vli];
@@ -55,14 +160,36 @@ void SparseCoder::learn(
 
     int targetC = (*inputCs)[visibleColumnIndex];
 
+    // Nothing to reconstruct for an absent column
+    if (targetC < 0) {
+        if (recordDeltas)
+            vl.learnDeltas[visibleColumnIndex] = 0.0f;
+
+        return;
+    }
+
     int maxIndex = 0;
     float maxActivation = -999999.0f;
-    std::vector<float> activations(vld.size.z);
+
+    // Scratch, reused across calls on the same thread
+    static thread_local FloatBuffer activations;
+
+    activations.resize(vld.size.z);
 
     for (int vc = 0; vc < vld.size.z; vc++) {
         int visibleIndex = address3(Int3(pos.x, pos.y, vc), vld.size);
 
-        float sum = vl.weights.multiplyOHVsT(hiddenCs, visibleIndex, hiddenSize.z) / std::max(1, vl.weights.countT(visibleIndex) / hiddenSize.z);
+        float sum;
+        
+        if (vld.shared) {
+            int count;
+
+            sum = multiplySharedOHVsT(vl.sharedWeights, hiddenCs, Int3(pos.x, pos.y, vc), vld.size, hiddenSize, vld.radius, count);
+
+            sum /= std::max(1, count);
+        }
+        else
+            sum = vl.weights.multiplyOHVsT(hiddenCs, visibleIndex, hiddenSize.z) / std::max(1, vl.weights.countT(visibleIndex) / hiddenSize.z);
 
         activations[vc] = sum;
 
@@ -73,14 +200,426 @@ void SparseCoder::learn(
     }
 
     if (maxIndex != targetC) {
+        if (vld.shared) {
+            // Accumulate into this thread's kernel deltas, applied after the launch
+            for (int vc = 0; vc < vld.size.z; vc++) {
+                float delta = alpha * ((vc == targetC ? 1.0f : -1.0f) - std::tanh(activations[vc]));
+
+                deltaSharedOHVsT(vl.sharedDeltas[t], hiddenCs, delta, Int3(pos.x, pos.y, vc), vld.size, hiddenSize, vld.radius);
+            }
+
+            vl.sharedCounts[t]++;
+
+            return;
+        }
+
         for (int vc = 0; vc < vld.size.z; vc++) {
             int visibleIndex = address3(Int3(pos.x, pos.y, vc), vld.size);
 
             float delta = alpha * ((vc == targetC ? 1.0f : -1.0f) - std::tanh(activations[vc]));
 
-            vl.weights.deltaOHVsT(hiddenCs, delta, visibleIndex, hiddenSize.z);
+            if (commitInterval > 1)
+                vl.weights.deferDeltaOHVsT(hiddenCs, delta, visibleIndex, hiddenSize.z, vl.deferredIndices[visibleColumnIndex], vl.deferredValues[visibleColumnIndex]);
+            else
+                vl.weights.deltaOHVsT(hiddenCs, delta, visibleIndex, hiddenSize.z);
+
+            if (recordDeltas && vc == targetC)
+                vl.learnDeltas[visibleColumnIndex] = delta;
         }
     }
+    else if (recordDeltas)
+        vl.learnDeltas[visibleColumnIndex] = 0.0f;
+}
+
+void SparseCoder::learnFused(
+    int i,
+    std::mt19937 &rng,
+    const std::vector<const IntBuffer*> &inputCs,
+    bool recordDeltas,
+    int t
+) {
+    int vli = std::upper_bound(visibleColumnStarts.begin(), visibleColumnStarts.end(), i) - visibleColumnStarts.begin() - 1;
+
+    const VisibleLayerDesc &vld = visibleLayerDescs[vli];
+
+    int visibleColumnIndex = i - visibleColumnStarts[vli];
+
+    if (learnFraction < 1.0f && !learnTurn(learnCredits[i], learnFraction, rng)) {
+        if (recordDeltas)
+            visibleLayers[vli].learnDeltas[visibleColumnIndex] = 0.0f;
+
+        return;
+    }
+
+    // Inverse of address2
+    Int2 pos(visibleColumnIndex / vld.size.y, visibleColumnIndex % vld.size.y);
+
+    learn(pos, rng, inputCs[vli], vli, recordDeltas, t);
+}
+
+void SparseCoder::initLearnWork() {
+    visibleColumnStarts.resize(visibleLayers.size() + 1);
+
+    visibleColumnStarts[0] = 0;
+
+    for (int vli = 0; vli < visibleLayers.size(); vli++) {
+        const VisibleLayerDesc &vld = visibleLayerDescs[vli];
+
+        visibleColumnStarts[vli + 1] = visibleColumnStarts[vli] + vld.size.x * vld.size.y;
+    }
+
+    learnWorkSums.resize(visibleColumnStarts.back() + 1);
+
+    learnCredits = FloatBuffer(visibleColumnStarts.back(), -1.0f);
+
+    learnWorkSums[0] = 0;
+
+    for (int vli = 0; vli < visibleLayers.size(); vli++) {
+        VisibleLayer &vl = visibleLayers[vli];
+        const VisibleLayerDesc &vld = visibleLayerDescs[vli];
+
+        int numVisibleColumns = vld.size.x * vld.size.y;
+
+        for (int j = 0; j < numVisibleColumns; j++) {
+            int i = visibleColumnStarts[vli] + j;
+
+            int count;
+
+            if (vld.shared)
+                multiplySharedOHVsT(vl.sharedWeights, hiddenCs, Int3(j / vld.size.y, j % vld.size.y, 0), vld.size, hiddenSize, vld.radius, count);
+            else
+                count = vl.weights.countT(j * vld.size.z) / hiddenSize.z;
+
+            // Activation and update both traverse every weight onto the column's cells
+            learnWorkSums[i + 1] = learnWorkSums[i] + count * hiddenSize.z * vld.size.z;
+        }
+    }
+}
+
+void SparseCoder::initDeferred() {
+    for (int vli = 0; vli < visibleLayers.size(); vli++) {
+        VisibleLayer &vl = visibleLayers[vli];
+        const VisibleLayerDesc &vld = visibleLayerDescs[vli];
+
+        int numVisibleColumns = vld.size.x * vld.size.y;
+
+        if (vl.deferredIndices.size() != numVisibleColumns) {
+            vl.deferredIndices.resize(numVisibleColumns);
+            vl.deferredValues.resize(numVisibleColumns);
+        }
+    }
+}
+
+void SparseCoder::countLearnStep(
+    ComputeSystem &cs
+) {
+    if (commitInterval > 1)
+        learnSteps++;
+
+    // Also commits leftovers once mini-batch mode is turned off
+    if (learnSteps > 0 && learnSteps >= commitInterval)
+        commit(cs);
+}
+
+const SparseCoder &SparseCoder::operator=(
+    const SparseCoder &other
+) {
+    // The background commits write the weights being copied and replaced
+    other.waitCommit();
+
+    waitCommit();
+
+    hiddenSize = other.hiddenSize;
+
+    hiddenCs = other.hiddenCs;
+
+    hiddenActivations = other.hiddenActivations;
+    hiddenActivationsValid = other.hiddenActivationsValid;
+
+    hiddenChanges = other.hiddenChanges;
+    updateColumns = other.updateColumns;
+    updateCsPrev = other.updateCsPrev;
+    updateFlags = other.updateFlags;
+
+    hiddenUsages = other.hiddenUsages;
+
+    learnSteps = other.learnSteps;
+
+    visibleColumnStarts = other.visibleColumnStarts;
+    learnWorkSums = other.learnWorkSums;
+    learnCredits = other.learnCredits;
+
+    visibleLayers = other.visibleLayers;
+    visibleLayerDescs = other.visibleLayerDescs;
+
+    // Nothing left to commit in the background
+    commitFuture = std::shared_future<void>();
+
+    alpha = other.alpha;
+    learnFraction = other.learnFraction;
+    trackUsage = other.trackUsage;
+    commitInterval = other.commitInterval;
+    asyncCommit = other.asyncCommit;
+
+    return *this;
+}
+
+void SparseCoder::waitCommit() const {
+    if (commitFuture.valid())
+        commitFuture.wait();
+}
+
+void SparseCoder::flushDeferred() {
+    waitCommit();
+
+    for (int vli = 0; vli < visibleLayers.size(); vli++) {
+        for (int i = 0; i < visibleLayers[vli].deferredIndices.size(); i++)
+            applyDeferred(i, vli);
+    }
+
+    learnSteps = 0;
+}
+
+void SparseCoder::clearDeferred() {
+    waitCommit();
+
+    for (int vli = 0; vli < visibleLayers.size(); vli++) {
+        VisibleLayer &vl = visibleLayers[vli];
+
+        vl.deferredIndices.clear();
+        vl.deferredValues.clear();
+    }
+
+    learnSteps = 0;
+}
+
+void SparseCoder::applyDeferred(
+    int i,
+    int vli
+) {
+    VisibleLayer &vl = visibleLayers[vli];
+
+    // Updates of a visible column only touch weights onto that column, so columns can be applied in parallel
+    vl.weights.applyDeferredDeltas(vl.deferredIndices[i], vl.deferredValues[i]);
+}
+
+bool SparseCoder::updatePresence(
+    const std::vector<const IntBuffer*> &inputCs
+) {
+    bool masked = false;
+
+    for (int vli = 0; vli < visibleLayers.size(); vli++) {
+        VisibleLayer &vl = visibleLayers[vli];
+
+        vl.numPresent = 0;
+
+        for (int i = 0; i < inputCs[vli]->size(); i++) {
+            if ((*inputCs[vli])[i] >= 0)
+                vl.numPresent++;
+        }
+
+        if (vl.numPresent < inputCs[vli]->size())
+            masked = true;
+    }
+
+    return masked;
+}
+
+bool SparseCoder::hasSharedLayers() const {
+    for (int vli = 0; vli < visibleLayers.size(); vli++) {
+        if (visibleLayerDescs[vli].shared)
+            return true;
+    }
+
+    return false;
+}
+
+void SparseCoder::clearSharedDeltas(
+    int numThreads
+) {
+    for (int vli = 0; vli < visibleLayers.size(); vli++) {
+        VisibleLayer &vl = visibleLayers[vli];
+
+        if (!visibleLayerDescs[vli].shared)
+            continue;
+
+        vl.sharedDeltas.resize(numThreads);
+        vl.sharedCounts.assign(numThreads, 0);
+
+        for (int t = 0; t < numThreads; t++)
+            vl.sharedDeltas[t].assign(vl.sharedWeights.size(), 0.0f);
+    }
+}
+
+void SparseCoder::applySharedDeltas() {
+    for (int vli = 0; vli < visibleLayers.size(); vli++) {
+        VisibleLayer &vl = visibleLayers[vli];
+
+        if (!visibleLayerDescs[vli].shared)
+            continue;
+
+        int count = 0;
+
+        for (int t = 0; t < vl.sharedCounts.size(); t++)
+            count += vl.sharedCounts[t];
+
+        if (count == 0)
+            continue;
+
+        // Average over the columns that learned, so the step size does not grow with the layer size (each delta already includes alpha)
+        float scale = 1.0f / count;
+
+        for (int t = 0; t < vl.sharedDeltas.size(); t++) {
+            for (int i = 0; i < vl.sharedWeights.size(); i++)
+                vl.sharedWeights[i] += vl.sharedDeltas[t][i] * scale;
+        }
+    }
+}
+
+void SparseCoder::accumulateChange(
+    int vli,
+    int visibleColumnIndex,
+    int inputC
+) {
+    VisibleLayer &vl = visibleLayers[vli];
+    const VisibleLayerDesc &vld = visibleLayerDescs[vli];
+
+    int inputCPrev = vl.inputCsPrev[visibleColumnIndex];
+
+    if (inputC == inputCPrev)
+        return;
+
+    vl.inputCsPrev[visibleColumnIndex] = inputC;
+
+    int visibleIndexPrev = inputCPrev + visibleColumnIndex * vld.size.z;
+    int visibleIndex = inputC + visibleColumnIndex * vld.size.z;
+
+    // Both visible cells are referenced by the same hidden cells, in the same order
+    int startPrev = vl.weights.columnRanges[visibleIndexPrev];
+    int start = vl.weights.columnRanges[visibleIndex];
+    int count = vl.weights.columnRanges[visibleIndex + 1] - start;
+
+    for (int k = 0; k < count; k++) {
+        int hiddenIndex = vl.weights.rowIndices[start + k];
+
+        float delta = vl.weights.nonZeroValues[vl.weights.nonZeroValueIndices[start + k]] - vl.weights.nonZeroValues[vl.weights.nonZeroValueIndices[startPrev + k]];
+
+        hiddenActivations[hiddenIndex] += delta / std::max(1, vl.weights.count(hiddenIndex) / vld.size.z);
+
+        int hiddenColumnIndex = hiddenIndex / hiddenSize.z;
+
+        if (!updateFlags[hiddenColumnIndex]) {
+            updateFlags[hiddenColumnIndex] = true;
+
+            updateColumns.push_back(hiddenColumnIndex);
+        }
+    }
+}
+
+void SparseCoder::accumulateLearn(
+    int vli
+) {
+    VisibleLayer &vl = visibleLayers[vli];
+    const VisibleLayerDesc &vld = visibleLayerDescs[vli];
+
+    int numVisibleColumns = vld.size.x * vld.size.y;
+
+    // Learning only changed the weights of winning hidden cells. Of those, only the weight onto the current input cell is part of the accumulated sum
+    for (int i = 0; i < numVisibleColumns; i++) {
+        float delta = vl.learnDeltas[i];
+
+        if (delta == 0.0f)
+            continue;
+
+        int visibleIndex = vl.inputCsPrev[i] + i * vld.size.z;
+
+        for (int jj = vl.weights.columnRanges[visibleIndex]; jj < vl.weights.columnRanges[visibleIndex + 1]; jj += hiddenSize.z) {
+            int j = jj + hiddenCs[vl.weights.rowIndices[jj] / hiddenSize.z];
+
+            int hiddenIndex = vl.weights.rowIndices[j];
+
+            hiddenActivations[hiddenIndex] += delta / std::max(1, vl.weights.count(hiddenIndex) / vld.size.z);
+        }
+    }
+}
+
+void SparseCoder::countUsages() {
+    int numHiddenColumns = hiddenSize.x * hiddenSize.y;
+    int numHidden = numHiddenColumns * hiddenSize.z;
+
+    if (hiddenUsages.size() != numHidden)
+        hiddenUsages = IntBuffer(numHidden, 0);
+
+    for (int i = 0; i < numHiddenColumns; i++)
+        hiddenUsages[hiddenCs[i] + i * hiddenSize.z]++;
+}
+
+void SparseCoder::remapHidden(
+    const IntBuffer &cellMap,
+    int newZ
+) {
+    // Pending updates refer to the old weight layout
+    flushDeferred();
+
+    int numHiddenColumns = hiddenSize.x * hiddenSize.y;
+
+    IntBuffer rowMap = cellMapToIndexMap(cellMap, hiddenSize.z, newZ);
+
+    IntBuffer outCellMap(cellMap.begin(), cellMap.begin() + hiddenSize.z);
+
+    for (int vli = 0; vli < visibleLayers.size(); vli++) {
+        VisibleLayer &vl = visibleLayers[vli];
+        const VisibleLayerDesc &vld = visibleLayerDescs[vli];
+
+        if (vld.shared)
+            remapSharedKernel(vl.sharedWeights, identityCellMap(vld.size.z), vld.size.z, outCellMap, newZ, vld.radius);
+        else {
+            vl.weights.remapRows(rowMap, numHiddenColumns * newZ);
+            vl.weights.initT();
+        }
+    }
+
+    remapCs(hiddenCs, cellMap, hiddenSize.z);
+
+    hiddenSize.z = newZ;
+
+    hiddenUsages.clear();
+
+    hiddenActivationsValid = false;
+
+    initLearnWork();
+}
+
+void SparseCoder::remapVisible(
+    int vli,
+    const IntBuffer &cellMap,
+    int newZ
+) {
+    flushDeferred();
+
+    VisibleLayer &vl = visibleLayers[vli];
+    VisibleLayerDesc &vld = visibleLayerDescs[vli];
+
+    int numVisibleColumns = vld.size.x * vld.size.y;
+
+    if (vld.shared) {
+        IntBuffer inCellMap(cellMap.begin(), cellMap.begin() + vld.size.z);
+
+        remapSharedKernel(vl.sharedWeights, inCellMap, newZ, identityCellMap(hiddenSize.z), hiddenSize.z, vld.radius);
+    }
+    else {
+        vl.weights.remapColumns(cellMapToIndexMap(cellMap, vld.size.z, newZ), numVisibleColumns * newZ);
+        vl.weights.initT();
+    }
+
+    if (!vl.inputCsPrev.empty())
+        remapCs(vl.inputCsPrev, cellMap, vld.size.z);
+
+    vld.size.z = newZ;
+
+    hiddenActivationsValid = false;
+
+    initLearnWork();
 }
 
 void SparseCoder::initRandom(
@@ -88,6 +627,8 @@ void SparseCoder::initRandom(
     const Int3 &hiddenSize,
     const std::vector<VisibleLayerDesc> &visibleLayerDescs
 ) {
+    clearDeferred();
+
     this->visibleLayerDescs = visibleLayerDescs;
 
     this->hiddenSize = hiddenSize;
@@ -108,6 +649,16 @@ void SparseCoder::initRandom(
         int numVisibleColumns = vld.size.x * vld.size.y;
         int numVisible = numVisibleColumns * vld.size.z;
 
+        if (vld.shared) {
+            // Create one kernel for all hidden columns and initialize randomly
+            vl.sharedWeights.resize(sharedKernelSize(vld.size, hiddenSize, vld.radius));
+
+            for (int i = 0; i < vl.sharedWeights.size(); i++)
+                vl.sharedWeights[i] = weightDist(cs.rng);
+
+            continue;
+        }
+
         // Create weight matrix for this visible layer and initialize randomly
         initSMLocalRF(vld.size, hiddenSize, vld.radius, vl.weights);
 
@@ -120,37 +671,218 @@ void SparseCoder::initRandom(
 
     // Hidden Cs
     hiddenCs = IntBuffer(numHiddenColumns, 0);
+
+    hiddenActivationsValid = false;
+
+    initLearnWork();
+}
+
+void SparseCoder::activateBatch(
+    ComputeSystem &cs,
+    const std::vector<std::vector<const IntBuffer*>> &inputCs,
+    const std::vector<IntBuffer*> &hiddenCs
+) {
+    assert(inputCs.size() >= hiddenCs.size());
+
+    waitCommit();
+
+    runKernel2(cs, std::bind(SparseCoder::forwardBatchKernel, std::placeholders::_1, std::placeholders::_2, this, inputCs, hiddenCs), Int2(hiddenSize.x, hiddenSize.y), cs.rng, cs.batchSize2);
+}
+
+void SparseCoder::step(
+    ComputeSystem &cs,
+    const std::vector<const IntBuffer*> &inputCs,
+    bool learnEnabled
+) {
+    int numHiddenColumns = hiddenSize.x * hiddenSize.y;
+    int numHidden = numHiddenColumns * hiddenSize.z;
+
+    waitCommit();
+
+    updatePresence(inputCs);
+
+    runKernel2(cs, std::bind(SparseCoder::forwardKernel, std::placeholders::_1, std::placeholders::_2, this, inputCs, false), Int2(hiddenSize.x, hiddenSize.y), cs.rng, cs.batchSize2);
+
+    // Accumulators no longer track the weights/inputs
+    hiddenActivationsValid = false;
+
+    if (learnEnabled)
+        learn(cs, inputCs);
+
+    if (trackUsage)
+        countUsages();
 }
 
 void SparseCoder::step(
     ComputeSystem &cs,
     const std::vector<const IntBuffer*> &inputCs,
+    const std::vector<const IntBuffer*> &inputChanges,
     bool learnEnabled
 ) {
     int numHiddenColumns = hiddenSize.x * hiddenSize.y;
     int numHidden = numHiddenColumns * hiddenSize.z;
 
-    runKernel2(cs, std::bind(SparseCoder::forwardKernel, std::placeholders::_1, std::placeholders::_2, this, inputCs), Int2(hiddenSize.x, hiddenSize.y), cs.rng, cs.batchSize2);
+    waitCommit();
+
+    hiddenChanges.clear();
+
+    bool masked = updatePresence(inputCs);
+
+    // Shared kernels have no transpose to scatter changes through, absent columns have no previous cell to remove.
+    // Deferred updates only reach the weights on commit, which invalidates the accumulators anyway
+    bool refresh = masked || hasSharedLayers() || commitInterval > 1;
+
+    if (refresh)
+        hiddenActivationsValid = false;
+
+    if (!hiddenActivationsValid) {
+        // Full refresh
+        IntBuffer hiddenCsPrev = hiddenCs;
+
+        hiddenActivations.resize(numHidden);
+
+        runKernel2(cs, std::bind(SparseCoder::forwardKernel, std::placeholders::_1, std::placeholders::_2, this, inputCs, true), Int2(hiddenSize.x, hiddenSize.y), cs.rng, cs.batchSize2);
 
-    if (learnEnabled) {
         for (int vli = 0; vli < visibleLayers.size(); vli++) {
             VisibleLayer &vl = visibleLayers[vli];
             VisibleLayerDesc &vld = visibleLayerDescs[vli];
 
-            runKernel2(cs, std::bind(SparseCoder::learnKernel, std::placeholders::_1, std::placeholders::_2, this, inputCs[vli], vli), Int2(vld.size.x, vld.size.y), cs.rng, cs.batchSize2);
+            vl.inputCsPrev = *inputCs[vli];
+            vl.learnDeltas.resize(vld.size.x * vld.size.y);
+        }
+
+        for (int i = 0; i < numHiddenColumns; i++) {
+            if (hiddenCs[i] != hiddenCsPrev[i])
+                hiddenChanges.push_back(i);
+        }
+
+        updateFlags.resize(numHiddenColumns, false);
+
+        hiddenActivationsValid = true;
+    }
+    else {
+        updateColumns.clear();
+
+        // Scatter input changes into the accumulators
+        for (int vli = 0; vli < visibleLayers.size(); vli++) {
+            const VisibleLayerDesc &vld = visibleLayerDescs[vli];
+
+            if (inputChanges[vli] == nullptr) {
+                int numVisibleColumns = vld.size.x * vld.size.y;
+
+                for (int i = 0; i < numVisibleColumns; i++)
+                    accumulateChange(vli, i, (*inputCs[vli])[i]);
+            }
+            else {
+                for (int i = 0; i < inputChanges[vli]->size(); i++) {
+                    int visibleColumnIndex = (*inputChanges[vli])[i];
+
+                    accumulateChange(vli, visibleColumnIndex, (*inputCs[vli])[visibleColumnIndex]);
+                }
+            }
+        }
+
+        // Re-run argmax on affected columns only
+        updateCsPrev.resize(updateColumns.size());
+
+        for (int i = 0; i < updateColumns.size(); i++) {
+            updateCsPrev[i] = hiddenCs[updateColumns[i]];
+
+            updateFlags[updateColumns[i]] = false;
+        }
+
+        if (!updateColumns.empty())
+            runKernel1(cs, std::bind(SparseCoder::chooseKernel, std::placeholders::_1, std::placeholders::_2, this), updateColumns.size(), cs.rng, cs.batchSize1);
+
+        for (int i = 0; i < updateColumns.size(); i++) {
+            if (hiddenCs[updateColumns[i]] != updateCsPrev[i])
+                hiddenChanges.push_back(updateColumns[i]);
+        }
+    }
+
+    if (refresh)
+        hiddenActivationsValid = false;
+
+    if (learnEnabled)
+        learn(cs, inputCs);
+
+    if (trackUsage)
+        countUsages();
+}
+
+void SparseCoder::learn(
+    ComputeSystem &cs,
+    const std::vector<const IntBuffer*> &inputCs
+) {
+    // Accumulators left valid by an event-driven step keep tracking the weight updates
+    bool recordDeltas = hiddenActivationsValid;
+
+    if (commitInterval > 1)
+        initDeferred();
+
+    // Learn over all visible layers in a single launch, shared kernel accumulators are sized from the team that runs it
+    runKernel1BalancedTeam(cs, std::bind(SparseCoder::learnFusedKernel, std::placeholders::_1, std::placeholders::_2, std::placeholders::_3, this, inputCs, recordDeltas),
+        std::bind(&SparseCoder::clearSharedDeltas, this, std::placeholders::_1), learnWorkSums, cs.rng);
+
+    applySharedDeltas();
+
+    if (recordDeltas) {
+        for (int vli = 0; vli < visibleLayers.size(); vli++)
+            accumulateLearn(vli);
+    }
+
+    countLearnStep(cs);
+}
+
+void SparseCoder::commit(
+    ComputeSystem &cs
+) {
+    waitCommit();
+
+    learnSteps = 0;
+
+    if (asyncCommit) {
+        // Hand the pending updates over to the background pass, learning continues into empty lists
+        for (int vli = 0; vli < visibleLayers.size(); vli++) {
+            VisibleLayer &vl = visibleLayers[vli];
+
+            std::swap(vl.deferredIndices, vl.committingIndices);
+            std::swap(vl.deferredValues, vl.committingValues);
         }
+
+        initDeferred();
+
+        commitFuture = std::async(std::launch::async, [this]() {
+            for (int vli = 0; vli < visibleLayers.size(); vli++) {
+                VisibleLayer &vl = visibleLayers[vli];
+
+                for (int i = 0; i < vl.committingIndices.size(); i++)
+                    vl.weights.applyDeferredDeltas(vl.committingIndices[i], vl.committingValues[i]);
+            }
+        }).share();
     }
+    else {
+        for (int vli = 0; vli < visibleLayers.size(); vli++)
+            runKernel1(cs, std::bind(SparseCoder::applyDeferredKernel, std::placeholders::_1, std::placeholders::_2, this, vli), visibleLayers[vli].deferredIndices.size(), cs.rng, cs.batchSize1);
+    }
+
+    // Accumulators no longer track the weights
+    hiddenActivationsValid = false;
 }
 
 void SparseCoder::writeToStream(
     std::ostream &os
 ) const {
+    waitCommit();
+
     int numHiddenColumns = hiddenSize.x * hiddenSize.y;
     int numHidden = numHiddenColumns * hiddenSize.z;
 
     os.write(reinterpret_cast<const char*>(&hiddenSize), sizeof(Int3));
 
     os.write(reinterpret_cast<const char*>(&alpha), sizeof(float));
+    os.write(reinterpret_cast<const char*>(&learnFraction), sizeof(float));
+    os.write(reinterpret_cast<const char*>(&commitInterval), sizeof(int));
 
     writeBufferToStream(os, &hiddenCs);
 
@@ -165,18 +897,24 @@ void SparseCoder::writeToStream(
         os.write(reinterpret_cast<const char*>(&vld), sizeof(VisibleLayerDesc));
 
         writeSMToStream(os, vl.weights);
+
+        writeBufferToStream(os, &vl.sharedWeights);
     }
 }
 
 void SparseCoder::readFromStream(
     std::istream &is
 ) {
+    clearDeferred();
+
     is.read(reinterpret_cast<char*>(&hiddenSize), sizeof(Int3));
 
     int numHiddenColumns = hiddenSize.x * hiddenSize.y;
     int numHidden = numHiddenColumns * hiddenSize.z;
 
     is.read(reinterpret_cast<char*>(&alpha), sizeof(float));
+    is.read(reinterpret_cast<char*>(&learnFraction), sizeof(float));
+    is.read(reinterpret_cast<char*>(&commitInterval), sizeof(int));
 
     readBufferFromStream(is, &hiddenCs);
 
@@ -197,5 +935,11 @@ void SparseCoder::readFromStream(
         int numVisible = numVisibleColumns * vld.size.z;
 
         readSMFromStream(is, vl.weights);
+
+        readBufferFromStream(is, &vl.sharedWeights);
     }
+
+    hiddenActivationsValid = false;
+
+    initLearnWork();
 }
\ No newline at end of file
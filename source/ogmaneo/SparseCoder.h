@@ -20,17 +20,38 @@ public:
 
         int radius; // Radius onto input
 
+        bool shared; // Whether all hidden columns share one weight kernel (convolutional). A learning step moves the kernel by the mean of the updates of the visible columns that learned, so alpha does not scale with the layer size
+
         // Defaults
         VisibleLayerDesc()
         :
         size(4, 4, 16),
-        radius(2)
+        radius(2),
+        shared(false)
         {}
     };
 
     // Visible layer
     struct VisibleLayer {
-        SparseMatrix weights; // Weight matrix
+        SparseMatrix weights; // Weight matrix (unused if shared)
+
+        FloatBuffer sharedWeights; // Shared weight kernel (shared only)
+
+        // Kernel update accumulators and learning position counts, one per thread of the learning team (shared only)
+        std::vector<FloatBuffer> sharedDeltas;
+        IntBuffer sharedCounts;
+
+        IntBuffer inputCsPrev; // Previous input states (event-driven mode only)
+
+        FloatBuffer learnDeltas; // Target cell deltas of the last learning pass (event-driven mode only)
+
+        int numPresent; // Number of present (non-negative) input columns on the current step
+
+        // Pending weight updates per visible column, and those being applied by a background commit (mini-batch mode only)
+        std::vector<IntBuffer> deferredIndices;
+        std::vector<FloatBuffer> deferredValues;
+        std::vector<IntBuffer> committingIndices;
+        std::vector<FloatBuffer> committingValues;
     };
 
 private:
@@ -38,53 +59,230 @@ private:
 
     IntBuffer hiddenCs; // Hidden states
 
+    // Event-driven mode
+    FloatBuffer hiddenActivations; // Per-cell activation accumulators
+    bool hiddenActivationsValid; // Whether the accumulators match the current weights and inputs
+
+    IntBuffer hiddenChanges; // Hidden columns whose state changed on the last event-driven step
+    IntBuffer updateColumns; // Hidden columns to re-run argmax on
+    IntBuffer updateCsPrev; // States of updateColumns before the argmax
+    std::vector<char> updateFlags; // Whether a hidden column is already in updateColumns
+
+    IntBuffer hiddenUsages; // Number of steps each hidden cell won since usage tracking began or was reset
+
+    // Mini-batch mode
+    int learnSteps; // Learning steps since the last commit
+
+    // Fused learning
+    IntBuffer visibleColumnStarts; // Start of each visible layer in the flattened visible column range
+    IntBuffer learnWorkSums; // Exclusive prefix sum of the learning work of each flattened visible column
+    FloatBuffer learnCredits; // Learning schedule credit per visible column, flattened over visible layers
+
     // Visible layers and associated descriptors
     std::vector<VisibleLayer> visibleLayers;
     std::vector<VisibleLayerDesc> visibleLayerDescs;
+
+    std::shared_future<void> commitFuture; // Background commit, if one was started. Declared last, so destruction waits for it before anything it writes goes away
     
     // --- Kernels ---
     
     void forward(
         const Int2 &pos,
         std::mt19937 &rng,
-        const std::vector<const IntBuffer*> &inputCs
+        const std::vector<const IntBuffer*> &inputCs,
+        bool recordActivations
+    );
+
+    void forwardBatch(
+        const Int2 &pos,
+        std::mt19937 &rng,
+        const std::vector<std::vector<const IntBuffer*>> &inputCs,
+        const std::vector<IntBuffer*> &hiddenCs
+    );
+
+    void choose(
+        int i,
+        std::mt19937 &rng
     );
 
     void learn(
         const Int2 &pos,
         std::mt19937 &rng,
         const IntBuffer* inputCs,
-        int vli
+        int vli,
+        bool recordDeltas,
+        int t // Thread index in the learning team, selects the shared kernel accumulators
     );
 
     static void forwardKernel(
         const Int2 &pos,
         std::mt19937 &rng,
         SparseCoder* sc,
-        const std::vector<const IntBuffer*> &inputCs
+        const std::vector<const IntBuffer*> &inputCs,
+        bool recordActivations
     ) {
-        sc->forward(pos, rng, inputCs);
+        sc->forward(pos, rng, inputCs, recordActivations);
     }
 
-    static void learnKernel(
+    static void forwardBatchKernel(
         const Int2 &pos,
         std::mt19937 &rng,
         SparseCoder* sc,
-        const IntBuffer* inputCs,
+        const std::vector<std::vector<const IntBuffer*>> &inputCs,
+        const std::vector<IntBuffer*> &hiddenCs
+    ) {
+        sc->forwardBatch(pos, rng, inputCs, hiddenCs);
+    }
+
+    void learnFused(
+        int i,
+        std::mt19937 &rng,
+        const std::vector<const IntBuffer*> &inputCs,
+        bool recordDeltas,
+        int t
+    );
+
+    static void chooseKernel(
+        int i,
+        std::mt19937 &rng,
+        SparseCoder* sc
+    ) {
+        sc->choose(i, rng);
+    }
+
+    static void learnFusedKernel(
+        int i,
+        std::mt19937 &rng,
+        int t,
+        SparseCoder* sc,
+        const std::vector<const IntBuffer*> &inputCs,
+        bool recordDeltas
+    ) {
+        sc->learnFused(i, rng, inputCs, recordDeltas, t);
+    }
+
+    // Build the flattened learning work range over all visible layers
+    void initLearnWork();
+
+    // Count the present input columns of each visible layer. Returns whether any column is absent
+    bool updatePresence(
+        const std::vector<const IntBuffer*> &inputCs
+    );
+
+    // --- Shared weight helpers ---
+
+    bool hasSharedLayers() const;
+
+    // Zero the kernel update accumulators, one per thread of the learning team
+    void clearSharedDeltas(
+        int numThreads // Size of the learning team
+    );
+
+    // Reduce the per-thread kernel update accumulators into the shared kernels
+    void applySharedDeltas();
+
+    // --- Mini-batch helpers ---
+
+    // Size the pending update lists
+    void initDeferred();
+
+    // Count a learning step, committing when commitInterval is reached
+    void countLearnStep(
+        ComputeSystem &cs
+    );
+
+    // Block until a background commit is done
+    void waitCommit() const;
+
+    // Apply all pending updates serially
+    void flushDeferred();
+
+    // Discard all pending updates
+    void clearDeferred();
+
+    void applyDeferred(
+        int i,
+        int vli
+    );
+
+    static void applyDeferredKernel(
+        int i,
+        std::mt19937 &rng,
+        SparseCoder* sc,
         int vli
     ) {
-        sc->learn(pos, rng, inputCs, vli);
+        sc->applyDeferred(i, vli);
     }
 
+    // --- Event-driven helpers ---
+
+    void accumulateChange(
+        int vli,
+        int visibleColumnIndex,
+        int inputC
+    );
+
+    void accumulateLearn(
+        int vli
+    );
+
+    // --- Compaction helpers ---
+
+    // Count the current hidden states as wins
+    void countUsages();
+
+    // Remove hidden cells
+    void remapHidden(
+        const IntBuffer &cellMap, // Cell map over the hidden cells
+        int newZ // Hidden column size after compaction
+    );
+
+    // Remove input cells of a visible layer
+    void remapVisible(
+        int vli, // Index of visible layer
+        const IntBuffer &cellMap, // Cell map over the visible cells
+        int newZ // Visible column size after compaction
+    );
+
 public:
     float alpha; // Weight learning rate
+    float learnFraction; // Fraction of visible columns that learn each step, in (0, 1]
+
+    bool trackUsage; // Whether to count hidden cell wins (used to find dead cells)
+
+    // Mini-batch mode
+    int commitInterval; // Number of learning steps whose weight updates are accumulated and applied together. 1 applies them immediately
+    bool asyncCommit; // Whether accumulated updates are applied on a background thread, joined before the weights are next used
 
     // Defaults
     SparseCoder()
     :
-    alpha(0.1f)
+    hiddenActivationsValid(false),
+    learnSteps(0),
+    alpha(0.1f),
+    learnFraction(1.0f),
+    trackUsage(false),
+    commitInterval(1),
+    asyncCommit(false)
     {}
 
+    // Copy, once the background commit of the other layer is done
+    SparseCoder(
+        const SparseCoder &other // Sparse coder to copy from
+    ) {
+        *this = other;
+    }
+
+    // Wait for the background commit, which writes the weights
+    ~SparseCoder() {
+        waitCommit();
+    }
+
+    // Assignment, once the background commits of both layers are done
+    const SparseCoder &operator=(
+        const SparseCoder &other // Sparse coder to assign from
+    );
+
     // Create a sparse coding layer with random initialization
     void initRandom(
         ComputeSystem &cs, // Compute system
@@ -93,12 +291,40 @@ public:
     );
 
     // Activate the sparse coder (perform sparse coding)
+    void step(
+        ComputeSystem &cs, // Compute system
+        const std::vector<const IntBuffer*> &inputCs, // Input states, negative states mark absent columns (skipped and renormalized over)
+        bool learnEnabled // Whether to learn
+    );
+
+    // Event-driven step. Only hidden columns whose receptive field contains a changed input column are recomputed.
+    // The first call (and the first call after a regular step or a state change) performs a full refresh
     void step(
         ComputeSystem &cs, // Compute system
         const std::vector<const IntBuffer*> &inputCs, // Input states
+        const std::vector<const IntBuffer*> &inputChanges, // Indices of input columns that may have changed, per visible layer. nullptr means unknown (compare all columns)
         bool learnEnabled // Whether to learn
     );
 
+    // Learn from the last step, as step with learning would have. For steps run without learning, inputCs must be the inputs of that step
+    void learn(
+        ComputeSystem &cs, // Compute system
+        const std::vector<const IntBuffer*> &inputCs // Input states of the last step
+    );
+
+    // Encode several independent input sets (streams) at once, without learning. The weights of each hidden column are loaded once for all streams.
+    // Does not touch the layer's own states, results match step without learning on each stream
+    void activateBatch(
+        ComputeSystem &cs, // Compute system
+        const std::vector<std::vector<const IntBuffer*>> &inputCs, // Input states of each stream. Only the first hiddenCs.size() are read, so a longer reused buffer may be passed
+        const std::vector<IntBuffer*> &hiddenCs // Hidden states of each stream (output)
+    );
+
+    // Apply the accumulated weight updates now (mini-batch mode). Updates not yet committed are not serialized
+    void commit(
+        ComputeSystem &cs // Compute system
+    );
+
     // Write to stream
     void writeToStream(
         std::ostream &os // Stream to write to
@@ -133,11 +359,26 @@ public:
         return hiddenCs;
     }
 
+    // Get the hidden columns that changed on the last event-driven step
+    const IntBuffer &getHiddenChanges() const {
+        return hiddenChanges;
+    }
+
     // Get the hidden size
     const Int3 &getHiddenSize() const {
         return hiddenSize;
     }
 
+    // Get the number of wins of each hidden cell (empty if usage was never tracked)
+    const IntBuffer &getHiddenUsages() const {
+        return hiddenUsages;
+    }
+
+    // Zero the hidden cell win counts
+    void resetHiddenUsages() {
+        hiddenUsages.clear();
+    }
+
     friend class Hierarchy;
 };
 } // namespace ogmaneo
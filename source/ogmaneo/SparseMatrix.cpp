@@ -279,6 +279,32 @@ float SparseMatrix::multiplyOHVs(
 	return sum;
 }
 
+float SparseMatrix::multiplyMaskedOHVs(
+	const std::vector<int> &nonZeroIndices,
+	int row,
+	int oneHotSize,
+	int &count
+) {
+	float sum = 0.0f;
+
+	count = 0;
+
+	int nextIndex = row + 1;
+	
+	for (int jj = rowRanges[row]; jj < rowRanges[nextIndex]; jj += oneHotSize) {
+		int index = nonZeroIndices[columnIndices[jj] / oneHotSize];
+
+		if (index < 0)
+			continue;
+
+		sum += nonZeroValues[jj + index];
+
+		count++;
+	}
+
+	return sum;
+}
+
 float SparseMatrix::multiplyOHVsT(
 	const std::vector<int> &nonZeroIndices,
 	int column,
@@ -337,6 +363,48 @@ float SparseMatrix::multiplyOHVsT(
 	return sum;
 }
 
+void SparseMatrix::multiplyOHVsRows(
+	const std::vector<int> &nonZeroIndices,
+	int row,
+	int numRows,
+	int oneHotSize,
+	std::vector<float> &sums
+) {
+	int nextIndex = row + 1;
+
+	int rowSize = rowRanges[nextIndex] - rowRanges[row];
+
+	for (int jj = rowRanges[row]; jj < rowRanges[nextIndex]; jj += oneHotSize) {
+		int j = jj + nonZeroIndices[columnIndices[jj] / oneHotSize];
+
+		for (int r = 0; r < numRows; r++)
+			sums[r] += nonZeroValues[j + r * rowSize];
+	}
+}
+
+void SparseMatrix::multiplyOHVsRowsBatch(
+	const std::vector<const std::vector<int>*> &nonZeroIndices,
+	int row,
+	int numRows,
+	int oneHotSize,
+	std::vector<float> &sums
+) {
+	int nextIndex = row + 1;
+
+	int rowSize = rowRanges[nextIndex] - rowRanges[row];
+
+	for (int jj = rowRanges[row]; jj < rowRanges[nextIndex]; jj += oneHotSize) {
+		int visibleColumnIndex = columnIndices[jj] / oneHotSize;
+
+		for (int b = 0; b < nonZeroIndices.size(); b++) {
+			int j = jj + (*nonZeroIndices[b])[visibleColumnIndex];
+
+			for (int r = 0; r < numRows; r++)
+				sums[r + b * numRows] += nonZeroValues[j + r * rowSize];
+		}
+	}
+}
+
 float SparseMatrix::distance2OHVs(
 	const std::vector<int> &nonZeroIndices,
 	int row,
@@ -467,6 +535,72 @@ void SparseMatrix::deltaOHVsT(
 	}
 }
 
+void SparseMatrix::deltaOHVsRows(
+	const std::vector<int> &nonZeroIndices,
+	const std::vector<float> &deltas,
+	int row,
+	int numRows,
+	int oneHotSize
+) {
+	int nextIndex = row + 1;
+
+	int rowSize = rowRanges[nextIndex] - rowRanges[row];
+
+	for (int jj = rowRanges[row]; jj < rowRanges[nextIndex]; jj += oneHotSize) {
+		int j = jj + nonZeroIndices[columnIndices[jj] / oneHotSize];
+
+		for (int r = 0; r < numRows; r++)
+			nonZeroValues[j + r * rowSize] += deltas[r];
+	}
+}
+
+void SparseMatrix::deferDeltaOHVs(
+	const std::vector<int> &nonZeroIndices,
+	float delta,
+	int row,
+	int oneHotSize,
+	std::vector<int> &deferredIndices,
+	std::vector<float> &deferredValues
+) {
+	int nextIndex = row + 1;
+
+	for (int jj = rowRanges[row]; jj < rowRanges[nextIndex]; jj += oneHotSize) {
+		int j = jj + nonZeroIndices[columnIndices[jj] / oneHotSize];
+
+		deferredIndices.push_back(j);
+		deferredValues.push_back(delta);
+	}
+}
+
+void SparseMatrix::deferDeltaOHVsT(
+	const std::vector<int> &nonZeroIndices,
+	float delta,
+	int column,
+	int oneHotSize,
+	std::vector<int> &deferredIndices,
+	std::vector<float> &deferredValues
+) {
+	int nextIndex = column + 1;
+
+	for (int jj = columnRanges[column]; jj < columnRanges[nextIndex]; jj += oneHotSize) {
+		int j = jj + nonZeroIndices[rowIndices[jj] / oneHotSize];
+
+		deferredIndices.push_back(nonZeroValueIndices[j]);
+		deferredValues.push_back(delta);
+	}
+}
+
+void SparseMatrix::applyDeferredDeltas(
+	std::vector<int> &deferredIndices,
+	std::vector<float> &deferredValues
+) {
+	for (int i = 0; i < deferredIndices.size(); i++)
+		nonZeroValues[deferredIndices[i]] += deferredValues[i];
+
+	deferredIndices.clear();
+	deferredValues.clear();
+}
+
 void SparseMatrix::hebb(
 	const std::vector<float> &in,
 	int row,
@@ -529,4 +663,81 @@ void SparseMatrix::hebbOHVsT(
 			nonZeroValues[nonZeroValueIndices[j]] += alpha * (target - nonZeroValues[nonZeroValueIndices[j]]);
 		}
 	}
-}
\ No newline at end of file
+}
+
+void SparseMatrix::remapRows(
+	const std::vector<int> &rowMap,
+	int newRows
+) {
+	std::vector<float> newNonZeroValues;
+	std::vector<int> newRowRanges;
+	std::vector<int> newColumnIndices;
+
+	newRowRanges.reserve(newRows + 1);
+	newRowRanges.push_back(0);
+
+	for (int row = 0; row < rows; row++) {
+		if (rowMap[row] < 0)
+			continue;
+
+		assert(rowMap[row] == newRowRanges.size() - 1);
+
+		for (int j = rowRanges[row]; j < rowRanges[row + 1]; j++) {
+			newNonZeroValues.push_back(nonZeroValues[j]);
+			newColumnIndices.push_back(columnIndices[j]);
+		}
+
+		newRowRanges.push_back(newNonZeroValues.size());
+	}
+
+	assert(newRowRanges.size() == newRows + 1);
+
+	rows = newRows;
+
+	nonZeroValues = newNonZeroValues;
+	rowRanges = newRowRanges;
+	columnIndices = newColumnIndices;
+
+	nonZeroValueIndices.clear();
+	columnRanges.clear();
+	rowIndices.clear();
+}
+
+void SparseMatrix::remapColumns(
+	const std::vector<int> &columnMap,
+	int newColumns
+) {
+	int nonZeroIndex = 0;
+
+	int start = 0;
+
+	// Compact in place, rows only shrink
+	for (int row = 0; row < rows; row++) {
+		int nextStart = rowRanges[row + 1];
+
+		for (int j = start; j < nextStart; j++) {
+			int column = columnMap[columnIndices[j]];
+
+			if (column < 0)
+				continue;
+
+			nonZeroValues[nonZeroIndex] = nonZeroValues[j];
+			columnIndices[nonZeroIndex] = column;
+
+			nonZeroIndex++;
+		}
+
+		start = nextStart;
+
+		rowRanges[row + 1] = nonZeroIndex;
+	}
+
+	columns = newColumns;
+
+	nonZeroValues.resize(nonZeroIndex);
+	columnIndices.resize(nonZeroIndex);
+
+	nonZeroValueIndices.clear();
+	columnRanges.clear();
+	rowIndices.clear();
+}
@@ -28,7 +28,10 @@ struct SparseMatrix {
 
 	// --- Init ---
 
-	SparseMatrix() {}
+	SparseMatrix()
+	:
+	rows(0), columns(0)
+	{}
 
 	// If you don't want to construct immediately
 	SparseMatrix(
@@ -141,6 +144,14 @@ struct SparseMatrix {
 		int oneHotSize
 	);
 
+	// Skips negative (absent) indices, count receives the number of present one-hot vectors
+	float multiplyMaskedOHVs(
+		const std::vector<int> &nonZeroIndices,
+		int row,
+		int oneHotSize,
+		int &count
+	);
+
 	float multiplyOHVs(
 		const std::vector<int> &nonZeroIndices,
 		const std::vector<float> &nonZeroScalars,
@@ -155,6 +166,24 @@ struct SparseMatrix {
 		int oneHotSize
 	);
 
+	// Same as multiplyOHVs for numRows consecutive rows with identical structure, in one traversal. Results are added to sums
+	void multiplyOHVsRows(
+		const std::vector<int> &nonZeroIndices,
+		int row,
+		int numRows,
+		int oneHotSize,
+		std::vector<float> &sums
+	);
+
+	// Same as multiplyOHVsRows for a batch of inputs, in one traversal of the rows. Sums are batch-major (numRows per input), results are added
+	void multiplyOHVsRowsBatch(
+		const std::vector<const std::vector<int>*> &nonZeroIndices,
+		int row,
+		int numRows,
+		int oneHotSize,
+		std::vector<float> &sums
+	);
+
 	float distance2OHVs(
 		const std::vector<int> &nonZeroIndices,
 		int row,
@@ -211,6 +240,43 @@ struct SparseMatrix {
 		int oneHotSize
 	);
 
+	// Same as deltaOHVs for numRows consecutive rows with identical structure and one delta each, in one traversal
+	void deltaOHVsRows(
+		const std::vector<int> &nonZeroIndices,
+		const std::vector<float> &deltas,
+		int row,
+		int numRows,
+		int oneHotSize
+	);
+
+	// --- Deferred Delta Rules ---
+
+	// Same as deltaOHVs, but records the updates as (nonZeroValues index, delta) pairs instead of applying them
+	void deferDeltaOHVs(
+		const std::vector<int> &nonZeroIndices,
+		float delta,
+		int row,
+		int oneHotSize,
+		std::vector<int> &deferredIndices,
+		std::vector<float> &deferredValues
+	);
+
+	// Same as deltaOHVsT, but records the updates as (nonZeroValues index, delta) pairs instead of applying them
+	void deferDeltaOHVsT(
+		const std::vector<int> &nonZeroIndices,
+		float delta,
+		int column,
+		int oneHotSize,
+		std::vector<int> &deferredIndices,
+		std::vector<float> &deferredValues
+	);
+
+	// Apply recorded updates in recording order, then clear them
+	void applyDeferredDeltas(
+		std::vector<int> &deferredIndices,
+		std::vector<float> &deferredValues
+	);
+
 	// --- Hebb Rules ---
 
 	void hebb(
@@ -238,5 +304,21 @@ struct SparseMatrix {
 		int oneHotSize,
 		float alpha
 	);
+
+	// --- Restructuring ---
+
+	// Remove rows with a negative map entry and renumber the rest to their map entry.
+	// The map must preserve the order of the kept rows. Clears the transpose
+	void remapRows(
+		const std::vector<int> &rowMap,
+		int newRows
+	);
+
+	// Remove columns with a negative map entry and renumber the rest to their map entry.
+	// The map must preserve the order of the kept columns. Clears the transpose
+	void remapColumns(
+		const std::vector<int> &columnMap,
+		int newColumns
+	);
 };
 } // namespace ogmaneo
\ No newline at end of file